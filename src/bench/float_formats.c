@@ -0,0 +1,79 @@
+// Copyright 2023 Lawrence Livermore National Security, LLC and other
+// libjustify Project Developers. See the top-level LICENSE file for details.
+//
+// SPDX-License-Identifier: MIT
+
+// Time capturing and printing a column of doubles with each floating-point
+// conversion, against what the same work costs through snprintf(): one
+// call to measure each value and one to print it.
+//
+//     bench_float_formats [rows]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <time.h>
+#include <cprintf.h>
+
+static double now(void)
+{
+    struct timespec t;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+int main(int argc, char **argv)
+{
+    static const char *formats[] = { "%f\n", "%.3f\n", "%e\n", "%.15e\n", "%g\n", "%.17g\n",
+                                     "%a\n" };
+    size_t n = (argc > 1) ? strtoul(argv[1], NULL, 10) : 1000000;
+    double *xs = malloc(n * sizeof(double)), t, sink = 0;
+    FILE *null = fopen("/dev/null", "w");
+    uint64_t s = 88172645463325252ULL;
+    char buf[512];
+
+    if (NULL == xs || NULL == null)
+    {
+        perror("bench_float_formats");
+        return EXIT_FAILURE;
+    }
+    // Measurements of all sizes: a few significant digits, scaled by up to
+    // six orders of magnitude either way.
+    for (size_t i = 0; i < n; i++)
+    {
+        s ^= s << 13;
+        s ^= s >> 7;
+        s ^= s << 17;
+        xs[i] = (double)(s % 2000000) / 1000.0 * pow(10, (int)(s >> 40) % 13 - 6);
+    }
+
+    printf("%-8s %14s %14s\n", "format", "cprintf ns", "snprintf ns");
+    for (size_t k = 0; k < sizeof(formats) / sizeof(formats[0]); k++)
+    {
+        double lib, ref;
+
+        t = now();
+        for (size_t i = 0; i < n; i++)
+        {
+            cfprintf(null, formats[k], xs[i]);
+        }
+        cflush();
+        lib = (now() - t) / n * 1e9;
+
+        t = now();
+        for (size_t i = 0; i < n; i++)
+        {
+            sink += snprintf(NULL, 0, formats[k], xs[i]);
+            sink += snprintf(buf, sizeof(buf), formats[k], xs[i]);
+        }
+        ref = (now() - t) / n * 1e9;
+
+        printf("%-8.*s %14.1f %14.1f\n", (int) strlen(formats[k]) - 1, formats[k], lib, ref);
+    }
+    fclose(null);
+    free(xs);
+    return (sink > 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
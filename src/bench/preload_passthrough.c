@@ -0,0 +1,66 @@
+// Copyright 2023 Lawrence Livermore National Security, LLC and other
+// libjustify Project Developers. See the top-level LICENSE file for details.
+//
+// SPDX-License-Identifier: MIT
+
+// Time the output calls libjustify-preload.so stands in for, with and
+// without it. Run it both ways with stdout thrown away and compare:
+//
+//     bench_preload_passthrough [calls] > /dev/null
+//     LD_PRELOAD=lib/libjustify-preload.so bench_preload_passthrough [calls] > /dev/null
+//
+// Every case but the last goes straight to the C library under the
+// preload, so the difference is what the interposition costs. The last
+// prints rows the preload captures as a table instead. Built with
+// -fno-builtin, so that printf() calls stay printf() calls.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+static double now(void)
+{
+    struct timespec t;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+int main(int argc, char **argv)
+{
+    static const char *cases[] = { "printf(\"text\\n\")", "printf(\"%ld \")", "puts()", "fwrite()",
+                                   "captured row" };
+    long n = (argc > 1) ? atol(argv[1]) : 10000000;
+
+    fprintf(stderr, "%-20s %10s\n", "call", "ns");
+    for (size_t k = 0; k < sizeof(cases) / sizeof(cases[0]); k++)
+    {
+        double t = now();
+
+        for (long i = 0; i < n; i++)
+        {
+            switch (k)
+            {
+                case 0:
+                    printf("a line of plain text\n");
+                    break;
+                case 1:
+                    printf("partial %ld ", i);
+                    break;
+                case 2:
+                    puts("a line of plain text");
+                    break;
+                case 3:
+                    fwrite("abcdefgh", 1, 8, stdout);
+                    break;
+                default:
+                    printf("%ld %ld %s\n", i, i * 7, "name");
+                    break;
+            }
+        }
+        printf("\n");    // Ends the line case 1 left open, and prints a captured table.
+        fflush(stdout);
+        fprintf(stderr, "%-20s %10.1f\n", cases[k], (now() - t) / n * 1e9);
+    }
+    return EXIT_SUCCESS;
+}
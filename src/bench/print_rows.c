@@ -0,0 +1,90 @@
+// Copyright 2023 Lawrence Livermore National Security, LLC and other
+// libjustify Project Developers. See the top-level LICENSE file for details.
+//
+// SPDX-License-Identifier: MIT
+
+// Time how long cflush() takes to print a captured table from row
+// templates, against the same table rendered a cell at a time by
+// render_row(). A width cap nothing reaches turns templates off without
+// changing the output, so the second set of timings is the fallback path
+// of print_something_already(). The cap is removed again after each.
+//
+//     bench_print_rows [rows]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <cprintf.h>
+
+static double now(void)
+{
+    struct timespec t;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+static const char *names[] = { "alpha", "bravo", "charlie", "delta", "echo-long-name", "f" };
+
+// Capture n rows of table k and return how long cflush() takes with them.
+static double flush_table(FILE *null, int k, size_t n)
+{
+    double t;
+
+    for (size_t i = 0; i < n; i++)
+    {
+        if (0 == k)
+        {
+            cfprintf(null, "%d | %8u | %-6ld | %x | %5d | %zu\n", (int) i, (unsigned) i * 2654435761u,
+                     (long) i * 37 - 5000000, (unsigned) i * 13, (int)(i % 1000) - 500, i * 3);
+        }
+        else
+        {
+            cfprintf(null, "%-4zu %-14s %10.3f %s\n", i % 4096, names[i % 6], (double) i / 7,
+                     names[(i / 6) % 6]);
+        }
+    }
+    t = now();
+    cflush();
+    return now() - t;
+}
+
+int main(int argc, char **argv)
+{
+    static const char *tables[] = { "6 integers", "strings, %f" };
+    size_t n = (argc > 1) ? strtoul(argv[1], NULL, 10) : 1000000;
+    FILE *null = fopen("/dev/null", "w");
+    double ns[2][2][2];    // [table][compact][fallback]
+
+    if (NULL == null)
+    {
+        perror("bench_print_rows");
+        return EXIT_FAILURE;
+    }
+    for (int k = 0; k < 2; k++)
+    {
+        for (int compact = 0; compact < 2; compact++)
+        {
+            cprintf_set_compact(compact);
+            for (int fallback = 0; fallback < 2; fallback++)
+            {
+                cprintf_set_width_cap(-1, (fallback) ? 1000 : 0, CPRINTF_CAP_TRUNCATE);
+                ns[k][compact][fallback] = flush_table(null, k, n) / n * 1e9;
+            }
+        }
+    }
+    cprintf_set_width_cap(-1, 0, CPRINTF_CAP_TRUNCATE);
+    cprintf_set_compact(0);
+
+    printf("%-12s %-8s %14s %14s\n", "table", "rows", "template ns", "render_row ns");
+    for (int k = 0; k < 2; k++)
+    {
+        for (int compact = 0; compact < 2; compact++)
+        {
+            printf("%-12s %-8s %14.1f %14.1f\n", tables[k], (compact) ? "compact" : "atoms",
+                   ns[k][compact][0], ns[k][compact][1]);
+        }
+    }
+    fclose(null);
+    return EXIT_SUCCESS;
+}
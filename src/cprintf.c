@@ -13,7 +13,20 @@
 #include <stdarg.h>     // variadic
 #include <wchar.h>      // wint_t
 #include <stdint.h>     // intmax_t
+#include <limits.h>     // INT_MAX
+#include <float.h>      // LDBL_MAX
+#include <math.h>       // signbit
+#include <unistd.h>     // pwrite
+#include <errno.h>      // errno
+#include <fcntl.h>      // O_CREAT
+#include <sched.h>      // sched_yield
+#include <pthread.h>    // pthread_create
+#include <stdatomic.h>  // atomic_load_explicit
+#include <sys/mman.h>   // shm_open
+#include <sys/stat.h>   // fstat
 #include <uchar.h>
+#include <locale.h>     // localeconv
+#include <ctype.h>      // isalpha
 #include <cprintf.h>
 
 
@@ -64,18 +77,45 @@ typedef enum
     C_INT_PTR
 } type_t;
 
-struct atom
+// The distinct strings a %s conversion has printed, so that each is copied
+// and measured once however many cells hold it. Cells refer to them by
+// pointer, or by code in packed rows.
+#define DICT_LIMIT 4096    // Strings beyond this many are kept per cell.
+
+struct dict_entry
+{
+    uint64_t hash;
+    char *s;            // In the table's string storage.
+    size_t width;       // What measure() made of it.
+    bool is_multibyte;
+    size_t excess;      // What it adds to state->multibyte_excess.
+};
+
+struct dict
+{
+    uint32_t *slots;    // Code + 1 of an entry, or 0; linear probing.
+    size_t nslots;
+    struct dict_entry *entries;    // Indexed by code.
+    size_t count;
+};
+
+// A conversion added with cprintf_register_conversion(). Its values are
+// stored as the type its argument is read as; only printing them differs.
+struct conversion
+{
+    int arg_type;       // CPRINTF_ARG_*
+    type_t type;
+    cprintf_width_fn width;
+    cprintf_format_fn format;
+};
+
+// A conversion specification or a run of ordinary text. Format strings are
+// parsed into these once per table and shared by every atom built from them.
+struct spec
 {
-    // Atoms should be allocated with calloc(). However, the value of
-    // NULL is implementation-dependent, so be sure any new pointers
-    // added here are explicitly set to NULL in create_atom() and freed
-    // in free_graph();
     bool is_conversion_specification;
-    size_t original_field_width;
-    size_t new_field_width;
 
     char *original_specification;
-    char *new_specification;
 
     char *flags;
     char *field_width;
@@ -84,11 +124,56 @@ struct atom
     char *conversion_specifier;
 
     char *ordinary_text;
+    size_t text_len;
+
+    type_t type;        // What va_arg() has to fetch for this conversion.
+    size_t mem_size;    // Size of the value in memory for cprintf_rows().
+    bool is_signed;
+    bool is_simple;     // Plain integer conversion whose width can be counted.
+    bool is_float;      // %f, %e, %g or %a of a double with no locale-dependent flags.
+    size_t float_precision;
+    size_t min_width;   // Field width given in the format, if any.
+    size_t conversion;  // Which conversion of the format this is.
+    bool is_borrowed;   // Written %&s: keep the caller's pointer.
+    bool is_hidden;     // Left out of the output; see apply_hidden().
+    struct dict *dict;  // Strings seen by a %s; see intern_string().
+    const struct conversion *custom;    // Registered conversion, or NULL.
+};
+
+// A parsed format string.
+struct format
+{
+    char *fmt;
+    size_t nspecs;
+    struct spec *specs;
+    size_t nconversions;
+    size_t *conversions; // Position in specs of each conversion.
+    bool tabulate;      // false if two conversions are adjacent
+    struct format *next;
+};
+
+struct atom
+{
+    // Atoms are carved out of calloc()ed slabs. However, the value of
+    // NULL is implementation-dependent, so be sure any new pointers
+    // added here are explicitly set to NULL in create_atom() and freed
+    // in free_graph();
+    bool is_conversion_specification;
+    size_t original_field_width;
+    size_t new_field_width;
+
+    const struct spec *spec;
+    char *new_specification;
+
     bool is_dummy;
 
     va_list *pargs;
     type_t type;
     value  val;
+    size_t column; // Index into state->columns.
+    bool is_multibyte; // Width is in display cells, padded by render_padded_by_cells().
+    bool is_deferred;  // Not measured because its column was hidden.
+    size_t repeats;    // On a row's first atom: copies collapsed into it.
 
     // navigation
     struct atom *right;
@@ -97,6 +182,82 @@ struct atom
     struct atom *down;
 };
 
+#define ATOMS_PER_SLAB 1024
+
+struct slab
+{
+    struct slab *next;
+    size_t used;
+    struct atom atoms[ATOMS_PER_SLAB];
+};
+
+// Strings copied from arguments are packed into chunks that are freed, or
+// reused by a retained table, all at once.
+#define STRINGS_PER_CHUNK 65536
+
+struct chunk
+{
+    struct chunk *next;
+    size_t used;
+    size_t size;
+    char data[];
+};
+
+// Per-column bookkeeping, kept up to date as atoms are created.
+struct column
+{
+    bool is_conversion_specification; // Kind of the first atom in the column.
+    size_t max_width;
+    size_t width_sum;
+    size_t count;                     // Conversions that produce output.
+
+    // Number of conversions of each width, kept once cells can be changed
+    // or deleted so max_width can shrink without a rescan.
+    size_t *hist;
+    size_t hist_cap;
+};
+
+// Growable buffer a row is rendered into before it is handed to the output.
+struct strbuf
+{
+    char *buf;
+    size_t len;
+    size_t cap;
+};
+
+// One conversion of the rows kept by pack_row(). Integers are stored as
+// zigzag varints of the difference from the previous value, doubles as the
+// XOR of their bits with the previous value's, trimmed of leading and
+// trailing zero bits as in Facebook's Gorilla. Strings are stored as varints
+// of their code in the conversion's dictionary.
+struct packed_column
+{
+    struct strbuf bytes;
+    unsigned bits;      // Bits of the last byte already written.
+    uint64_t last;      // Previous value, or its bits for a double.
+    unsigned lead;      // Zero bits around the previous XOR; a later one
+    unsigned trail;     // that fits inside them is stored without them.
+};
+
+// Where a reader of a packed_column has got to.
+struct packed_reader
+{
+    size_t bit;
+    uint64_t last;
+    unsigned lead;
+    unsigned trail;
+};
+
+// Rows of a single format of numbers and interned strings kept encoded
+// instead of as atoms.
+// They always follow every row in the graph.
+struct packed
+{
+    struct format *f;
+    size_t nrows;
+    struct packed_column *columns;    // One per conversion.
+};
+
 // Stores the state of the graph.
 struct State
 {
@@ -108,6 +269,87 @@ struct State
     struct atom *top_left; // Stores the root (furthest left) of the top row.
     struct atom *bot_left; // Stores the root (furthest left) of the bottom row.
     FILE *dest;
+
+    // Set when the table is rendered into caller memory by csnprintf().
+    bool to_buffer;
+    char *dest_str;
+    size_t dest_size;
+    size_t dest_len;
+
+    // Running totals that let us report the rendered size without a pass
+    // over the graph.
+    struct column *columns;
+    size_t ncolumns;
+    size_t text_bytes;
+    size_t multibyte_excess; // Bytes beyond display width of multibyte cells.
+
+    struct slab *slabs;      // Storage for every atom in the graph.
+    struct chunk *strings;   // Storage for the strings they hold.
+    struct chunk *string_chunk; // Chunk new strings go into.
+    struct format *formats;  // Format strings parsed for this table.
+
+    size_t nrows;
+    size_t used_columns;
+    struct format *row_format; // Format shared by every row, if there is one.
+    bool mixed_formats;
+
+    struct strbuf pending;   // Output waiting for pwrite().
+    struct strbuf row_buf;   // Each row is rendered here before it is emitted.
+
+    // Collapsing repeated rows: the row a repeat would be folded into, the
+    // bytes of the "(×N)" notes, and space to read a row's values into.
+    struct atom *last_row;
+    size_t repeat_bytes;
+    value *row_values;
+    size_t row_values_cap;
+
+    // Set at cflush() by cprintf_sort(): the captured rows in the order
+    // they print, and the last of them in the graph.
+    struct atom **order;
+    size_t norder;
+    struct atom *order_tail;
+
+    // Kept by note_sort_key() as rows are captured, so that sort_rows()
+    // needn't walk the graph: every row and, if cprintf_sort() was called
+    // first, its cell in sort column keyed_column (or NULL) and the keys of
+    // those cells. Only used while it covers every row and none has changed.
+    struct atom **keyed_rows;
+    struct atom **keyed_cells;
+    struct sort_entry *keys;
+    size_t nkeyed;
+    size_t nkeys;
+    size_t keyed_cap;
+    int keyed_column;
+    bool keyed_ties;    // Some keys only order a prefix of their value.
+    bool keys_stale;
+
+    struct packed *packed;   // Rows not turned into atoms yet.
+    uint32_t *row_codes;     // Dictionary codes of a row being packed.
+
+    // Set by cprintf_iter_begin(): the next row cprintf_iter_next() renders
+    // and how much of the one in row_buf it has handed out. Packed rows come
+    // last, decoded with iter_readers.
+    bool iterating;
+    struct atom *iter_row;
+    size_t iter_k;
+    size_t iter_pos;
+    struct packed_reader *iter_readers;
+    char **iter_specs;
+    size_t iter_packed;
+
+    // A retained table keeps its atoms between flushes. cursor is the next
+    // old row waiting to be refilled; free_atoms holds atoms of dropped rows.
+    struct atom *cursor;
+    struct atom *free_atoms;
+
+    // Built on first use by cprintf_set_cell()/cprintf_delete_row():
+    // row_first[r] is where row r's atoms start in cells.
+    bool indexed;
+    size_t *row_first;
+    size_t row_first_cap;
+    struct atom **cells;
+    size_t ncells;
+    size_t cells_cap;
 };
 
 void dump_graph(void);
@@ -140,6 +382,11 @@ void calculate_writeback(struct atom *a);
 void archive(const char *p, ptrdiff_t span, char **q);
 bool is(char *p, const char *q);
 void _cprintf(FILE *stream, const char *fmt, va_list *args);
+int _csnprintf(char *str, size_t size, const char *fmt, va_list *args);
+void _capture(const char *fmt, va_list *args);
+void _capture_typed(const char *fmt, size_t nargs, const struct cprintf_arg *args);
+void _ingest(const char *fmt, size_t n, const char *const bases[], const size_t strides[]);
+void bind_stream(FILE *stream);
 
 void exit_nice(void);
 
@@ -151,10 +398,223 @@ void teardown(void);
 void update_corners(struct atom *a, struct atom **top_left,
                     struct atom **top_right, struct atom **bot_left, struct atom **bot_right);
 
+void account_atom(struct atom *a);
+struct atom *alloc_atom(void);
+void free_slabs(void);
+void *copy_string(const void *s, size_t size);
+void free_strings(void);
+void merge_tables(void);
+void apply_hidden(struct format *f);
+void free_tables(void);
+
+struct format *lookup_format(const char *fmt);
+struct format *parse_format(const char *fmt);
+void resolve_type(struct spec *sp);
+void free_formats(void);
+size_t rendered_size(void);
+void emit(const char *buf, size_t len);
+void note_row_format(struct format *f);
+void write_pending(void);
+void render_cell(struct atom *c, struct strbuf *sb);
+void render_row(struct atom *a, struct strbuf *sb);
+void release_cell(struct atom *c);
+void truncate_rows(struct atom *row);
+void recycle_graph(void);
+struct atom *reuse_row(struct format *f);
+void publish_table(void);
+struct format *format_of(const struct spec *sp);
+void drop_index(void);
+void index_atom(struct atom *a);
+void hist_add(struct column *k, size_t w);
+void hist_remove(struct column *k, size_t w);
+void unaccount_atom(struct atom *a);
+void print_live(void);
+void accumulate(struct atom *a);
+void append_footers(void);
+void reset_footers(void);
+void write_data_outputs(void);
+bool render_piece(struct atom *c, size_t line, struct strbuf *sb);
+const struct cap *cap_for(const struct atom *a);
+size_t repeat_note(size_t n, char *buf, size_t size);
+void unpack_rows(void);
+void free_packed(struct packed *p);
+void pipeline_row(struct format *f, va_list *args);
+void finish_pipeline(void);
+void note_sort_key(const struct format *f, struct atom *row);
+void forget_sort_keys(void);
+
 static struct State *state = NULL;
 static bool is_initialized = false;
 static bool do_tabulate    = true;
 
+// Custom conversions, by character; unregistered ones have no format.
+static struct conversion conversions[UCHAR_MAX + 1];
+
+// When set, rendered output goes to sink_fn instead of the table's stream.
+static cprintf_write_fn sink_fn = NULL;
+static void *sink_ctx           = NULL;
+
+// Limits on how wide a column may get; see cprintf_set_width_cap().
+struct cap
+{
+    int policy;         // CPRINTF_CAP_*
+    size_t width;
+    double percentile;
+};
+
+static struct cap *caps         = NULL;    // Indexed by conversion.
+static size_t ncaps             = 0;
+static struct cap global_cap    = { CPRINTF_CAP_NONE, 0, 0 };
+static bool caps_set            = false;
+
+// Conversions left out of the output: hidden_columns[j] for the first
+// nhidden_columns, hide_others for the rest.
+static bool *hidden_columns     = NULL;
+static size_t nhidden_columns   = 0;
+static bool hide_others         = false;
+static bool hidden_changed      = false;    // Since rows were accounted.
+
+// Rows allocated by cprintf_table_alloc() and filled in by cprintf_fill_row(),
+// possibly from several threads at once. Filling only touches the row's own
+// atoms; they are accounted for when the table is merged, before anything
+// needs the column widths.
+struct cprintf_table
+{
+    struct format *f;
+    size_t nrows;
+    struct atom **rows;         // First atom of each row.
+    bool *filled;
+    bool merged;
+    size_t generation;          // Tells a thread its string chunk is stale.
+    _Atomic(struct chunk *) strings;    // Chunks the filled rows' strings are in.
+    atomic_size_t multibyte_excess;
+    struct cprintf_table *next;
+};
+
+static struct cprintf_table *tables = NULL;
+static size_t table_generation  = 0;
+
+// Set while this thread fills a row; strings then go to a chunk of its own.
+static _Thread_local struct cprintf_table *filling = NULL;
+static _Thread_local struct chunk *fill_chunk = NULL;
+static _Thread_local size_t fill_generation = 0;
+
+// Where measuring a cell formats it; each thread that captures has its own.
+static _Thread_local struct strbuf measure_scratch = { NULL, 0, 0 };
+static _Thread_local struct strbuf excess_scratch = { NULL, 0, 0 };
+
+// Where render_piece() formats a cell before cutting it.
+static _Thread_local struct strbuf piece_scratch = { NULL, 0, 0 };
+
+// Extra places cflush() sends each table: copies of the rendered text, or
+// the captured values in a machine-readable form.
+struct output
+{
+    FILE *stream;
+    int kind;           // CPRINTF_TEXT, CPRINTF_CSV, ...
+};
+
+static struct output *outputs   = NULL;
+static size_t noutputs          = 0;
+
+// One cell of a table shown in live mode.
+struct live_cell
+{
+    size_t off;     // Where the cell's text starts in the frame's text.
+    size_t len;     // Bytes, not counting a newline that ends the row.
+    size_t col;     // Display column the cell starts at.
+    size_t width;   // Display cells the text takes up.
+};
+
+// Everything needed to redraw only what changed since the last flush.
+struct live_frame
+{
+    struct strbuf text;
+    struct live_cell *cells;
+    size_t ncells;
+    size_t cells_cap;
+    size_t *rows;   // Index of each row's first cell; rows[nrows] == ncells.
+    size_t nrows;
+    size_t rows_cap;
+    size_t nlines;  // Terminal lines the frame takes up.
+    bool simple;    // Every row is exactly one line, ended by a newline.
+};
+
+// When set, cflush() redraws the previous table in place.
+static bool live_mode           = false;
+static bool live_shown          = false;
+static int live_current         = 0;    // Index of the frame on screen.
+static struct live_frame live_frames[2];
+
+// Running reductions of one conversion, printed as footer rows by cflush().
+struct footer
+{
+    unsigned ops;       // CPRINTF_REDUCE_* flags.
+    size_t count;
+    long double sum;
+    long double min;
+    long double max;
+};
+
+static struct footer *footers   = NULL;
+static size_t nfooters          = 0;
+static bool footer_dirty        = false;    // Rescan instead of trusting the totals.
+static bool adding_footers      = false;
+
+// When set, cflush() keeps the table's atoms for the next table.
+static bool retain_mode         = false;
+
+// When set, every %s and %ls keeps the caller's pointer, as %&s does.
+static bool borrow_strings      = false;
+
+// Whether a row equal to the one before it is counted instead of stored.
+static bool collapse_rows       = false;
+
+// Whether rows of numeric formats are kept encoded until cflush().
+static bool compact_rows        = false;
+
+// Conversion cflush() orders rows by, or -1 for capture order.
+static int sort_column          = -1;
+static bool sort_ascending      = true;
+
+// When set, the next cflush() writes with pwrite() starting at pwrite_offset.
+static int pwrite_fd            = -1;
+static off_t pwrite_offset      = 0;
+
+// Rows cprintf() has handed to the formatter thread, as records laid end to
+// end in a ring. head and tail count bytes ever written and read, so only
+// cprintf() moves head and only the formatter moves tail.
+#define PIPELINE_BYTES (1 << 20)
+#define PIPELINE_SPINS 64    // Empty looks before the formatter sleeps.
+
+struct pipeline
+{
+    char *ring;
+    atomic_size_t head;
+    atomic_size_t tail;
+    atomic_bool done;        // No more rows are coming.
+    atomic_bool sleeping;    // The formatter waits on wake for rows.
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    pthread_t thread;
+    bool running;
+    value *vals;             // Where cprintf() reads a row's arguments to.
+    size_t *lens;            // Bytes of the strings among them to copy.
+    size_t vals_cap;
+};
+
+// A row in the ring: its format, then its values, then copies of the
+// strings they point to. A record without a format pads to the ring's end.
+struct record
+{
+    size_t size;
+    struct format *f;
+};
+
+// When set, cprintf() leaves building the table to the formatter thread.
+static bool pipeline_mode       = false;
+static struct pipeline formatter;
+
 void setup(FILE *stream)
 {
     static bool callback_registered = false;
@@ -170,6 +630,73 @@ void setup(FILE *stream)
     state->origin                 = NULL;
     state->dest                   = stream;
 
+    state->to_buffer              = false;
+    state->dest_str               = NULL;
+    state->dest_size              = 0;
+    state->dest_len               = 0;
+
+    state->columns                = NULL;
+    state->ncolumns               = 0;
+    state->text_bytes             = 0;
+    state->multibyte_excess       = 0;
+
+    state->slabs                  = NULL;
+    state->strings                = NULL;
+    state->string_chunk           = NULL;
+    state->formats                = NULL;
+
+    state->nrows                  = 0;
+    state->used_columns           = 0;
+    state->row_format             = NULL;
+    state->mixed_formats          = false;
+
+    state->pending.buf            = NULL;
+    state->pending.len            = 0;
+    state->pending.cap            = 0;
+    state->row_buf.buf            = NULL;
+    state->row_buf.len            = 0;
+    state->row_buf.cap            = 0;
+
+    state->last_row               = NULL;
+    state->repeat_bytes           = 0;
+    state->row_values             = NULL;
+    state->row_values_cap         = 0;
+
+    state->order                  = NULL;
+    state->norder                 = 0;
+    state->order_tail             = NULL;
+
+    state->keyed_rows             = NULL;
+    state->keyed_cells            = NULL;
+    state->keys                   = NULL;
+    state->nkeyed                 = 0;
+    state->nkeys                  = 0;
+    state->keyed_cap              = 0;
+    state->keyed_column           = -1;
+    state->keyed_ties             = false;
+    state->keys_stale             = false;
+
+    state->packed                 = NULL;
+    state->row_codes              = NULL;
+
+    state->iterating              = false;
+    state->iter_row               = NULL;
+    state->iter_k                 = 0;
+    state->iter_pos               = 0;
+    state->iter_readers           = NULL;
+    state->iter_specs             = NULL;
+    state->iter_packed            = 0;
+
+    state->cursor                 = NULL;
+    state->free_atoms             = NULL;
+
+    state->indexed                = false;
+    state->row_first              = NULL;
+    state->row_first_cap          = 0;
+    state->cells                  = NULL;
+    state->ncells                 = 0;
+    state->cells_cap              = 0;
+
     state->top_left               = NULL;
     state->top_right              = NULL;
     state->bot_left               = NULL;
@@ -194,9 +721,32 @@ void teardown(void)
     state->last_atom_on_last_line = NULL;
     state->origin = NULL;
     state->dest = NULL;
-
+    state->dest_str = NULL;
+
+    free_packed(state->packed);    // Before the format it points to.
+    free_formats();
+    drop_index();
+    free(state->pending.buf);
+    free(state->row_buf.buf);
+    free(state->row_values);
+    free(state->row_codes);
+
+    free(state->order);
+    free(state->keyed_rows);
+    free(state->keyed_cells);
+    free(state->keys);
+    free(state->columns);
     free(state);
     state = NULL;
+
+    // This thread's scratch space; a pipeline thread frees its own.
+    struct strbuf *scratch[] = { &measure_scratch, &excess_scratch, &piece_scratch };
+    for (size_t i = 0; i < sizeof(scratch) / sizeof(scratch[0]); i++)
+    {
+        free(scratch[i]->buf);
+        scratch[i]->buf = NULL;
+        scratch[i]->len = scratch[i]->cap = 0;
+    }
 }
 
 // Rebuild the state if something horrible happens.
@@ -311,25 +861,165 @@ struct atom *top_left_finder_safe(void)
     return rv;
 }
 
-struct atom *_make_dummy(void)
+// Atoms are handed out from slabs so building a table doesn't cost a
+// calloc() per cell and freeing it doesn't cost a free() per cell.
+struct atom *alloc_atom(void)
 {
-    struct atom *a = calloc(sizeof(struct atom), 1);
+    struct slab *s = state->slabs;
+    struct atom *a = state->free_atoms;
 
-    if (NULL == a)
+    if (NULL != a)
     {
-        cprintf_error("Memory allocation failed.", EXIT_FAILURE);
+        state->free_atoms = a->right;
+        memset(a, 0, sizeof(struct atom));
+        return a;
     }
 
-    a->original_specification       = NULL;
-    a->new_specification            = NULL;
+    if (NULL == s || s->used == ATOMS_PER_SLAB)
+    {
+        s = calloc(1, sizeof(struct slab));
+        if (NULL == s)
+        {
+            cprintf_error("Memory allocation failed.", EXIT_FAILURE);
+        }
+        s->next = state->slabs;
+        s->used = 0;
+        state->slabs = s;
+    }
+    return &s->atoms[s->used++];
+}
+
+void free_slabs(void)
+{
+    struct slab *s = state->slabs, *next;
+
+    while (NULL != s)
+    {
+        next = s->next;
+        free(s);
+        s = next;
+    }
+    state->slabs = NULL;
+}
+
+// copy_string() for a thread in cprintf_fill_row(): no other thread
+// writes to its chunk, and full chunks are handed to the table without a
+// lock.
+static void *fill_string(const void *s, size_t size)
+{
+    struct chunk *c = (fill_generation == filling->generation) ? fill_chunk : NULL;
+    size_t at;
+
+    if (NULL == c || c->size - c->used < size + sizeof(wchar_t))
+    {
+        size_t n = (size > STRINGS_PER_CHUNK) ? size + sizeof(wchar_t) : STRINGS_PER_CHUNK;
+
+        c = malloc(sizeof(struct chunk) + n);
+        if (NULL == c)
+        {
+            cprintf_error("Memory allocation failed.", EXIT_FAILURE);
+        }
+        c->used = 0;
+        c->size = n;
+        c->next = atomic_load(&filling->strings);
+        while (!atomic_compare_exchange_weak(&filling->strings, &c->next, c))
+            ;
+        fill_chunk = c;
+        fill_generation = filling->generation;
+    }
+    at = (c->used + sizeof(wchar_t) - 1) / sizeof(wchar_t) * sizeof(wchar_t);
+    c->used = at + size;
+    return memcpy(c->data + at, s, size);
+}
+
+// Copy size bytes of s into the table's string storage.
+void *copy_string(const void *s, size_t size)
+{
+    struct chunk *c = state->string_chunk;
+    size_t at;
+
+    if (NULL != filling)
+    {
+        return fill_string(s, size);
+    }
+
+    // Skip to a chunk with room, reusing ones a retained table left behind.
+    while (NULL != c && c->size - c->used < size + sizeof(wchar_t))
+    {
+        c = c->next;
+        if (NULL != c)
+        {
+            state->string_chunk = c;
+        }
+    }
+    if (NULL == c)
+    {
+        size_t n = (size > STRINGS_PER_CHUNK) ? size + sizeof(wchar_t) : STRINGS_PER_CHUNK;
+
+        c = malloc(sizeof(struct chunk) + n);
+        if (NULL == c)
+        {
+            cprintf_error("Memory allocation failed.", EXIT_FAILURE);
+        }
+        c->next = NULL;
+        c->used = 0;
+        c->size = n;
+        if (NULL == state->string_chunk)
+        {
+            state->strings = c;
+        }
+        else
+        {
+            state->string_chunk->next = c;
+        }
+        state->string_chunk = c;
+    }
+
+    // Keep wide strings aligned.
+    at = (c->used + sizeof(wchar_t) - 1) / sizeof(wchar_t) * sizeof(wchar_t);
+    c->used = at + size;
+    return memcpy(c->data + at, s, size);
+}
+
+// Empty the dictionaries of the table's formats, whose strings are in
+// storage about to be freed or reused.
+static void forget_interned(void)
+{
+    for (struct format *f = state->formats; NULL != f; f = f->next)
+    {
+        for (size_t i = 0; i < f->nspecs; i++)
+        {
+            struct dict *d = f->specs[i].dict;
+            if (NULL != d && d->count > 0)
+            {
+                memset(d->slots, 0, d->nslots * sizeof(uint32_t));
+                d->count = 0;
+            }
+        }
+    }
+}
 
-    a->flags                        = NULL;
-    a->field_width                  = NULL;
-    a->precision                    = NULL;
-    a->length_modifier              = NULL;
-    a->conversion_specifier         = NULL;
+void free_strings(void)
+{
+    struct chunk *c = state->strings, *next;
+
+    while (NULL != c)
+    {
+        next = c->next;
+        free(c);
+        c = next;
+    }
+    state->strings = NULL;
+    state->string_chunk = NULL;
+    forget_interned();
+}
+
+struct atom *_make_dummy(void)
+{
+    struct atom *a = alloc_atom();
 
-    a->ordinary_text                = NULL;
+    a->spec                         = NULL;
+    a->new_specification            = NULL;
     a->pargs                        = NULL;
 
     a->right                        = NULL;
@@ -463,7 +1153,7 @@ void dump_graph(void)
         c = a;
         while (NULL != c)
         {
-            printf("o=%-20p", c->ordinary_text);
+            printf("o=%-20p", (c->spec) ? c->spec->ordinary_text : NULL);
             c = c->right;
         }
         printf("\n");
@@ -472,7 +1162,7 @@ void dump_graph(void)
         c = a;
         while (NULL != c)
         {
-            printf("orig=%-17s", c->original_specification);
+            printf("orig=%-17s", (c->spec) ? c->spec->original_specification : "(null)");
             c = c->right;
         }
         printf("\n");
@@ -554,57 +1244,240 @@ void _free_graph(struct atom *a)
         a = top_left_finder_safe(); // Fixes state->top_left if it got broken.
     }
 
-    // Find the rightmost atom in the top line.
-    if (a->right)
+    // Walk the rows top to bottom; every row starts in the first column.
+    struct atom *row = a, *next_row, *c;
+    while (NULL != row)
+    {
+        next_row = row->down;
+        for (c = row; NULL != c; c = c->right)
+        {
+            release_cell(c);
+        }
+        row = next_row;
+    }
+    state->origin = NULL;
+    state->top_left = NULL;
+
+    // The atoms themselves go all at once.
+    state->free_atoms = NULL;
+    state->cursor = NULL;
+    free_slabs();
+    free_strings();
+    return;
+}
+
+// Free whatever a cell owns; the atom itself belongs to a slab and its
+// strings to the table's string storage.
+void release_cell(struct atom *c)
+{
+    free(c->new_specification);
+    c->new_specification = NULL;
+    if (C_CHARX == c->type)
+    {
+        c->val.c_charx = NULL;
+    }
+    else if (C_WCHAR_TX == c->type)
+    {
+        c->val.c_wchar_tx = NULL;
+    }
+}
+
+// Remove row and every row below it from the graph.
+void truncate_rows(struct atom *row)
+{
+    struct atom *next_row, *c, *next;
+
+    drop_index();
+    if (row == state->origin)
     {
-        _free_graph(a->right);
+        // Nothing survives, so start again from an empty graph.
+        free_graph();
+        state->empty_graph = true;
+        state->bot_left = NULL;
+        state->top_right = NULL;
+        state->bot_right = NULL;
+        state->last_atom_on_last_line = NULL;
+        state->last_row = NULL;
+        state->repeat_bytes = 0;
+        return;
     }
 
-    // For each atom in the top line, find the last atom in that column.
-    if (a->down)
+    // New rows will be appended after the last surviving one.
+    for (c = row->up; NULL != c->right; c = c->right)
+        ;
+    state->last_atom_on_last_line = c;
+
+    while (row != state->bot_left)
     {
-        _free_graph(a->down);
+        next_row = row->down;
+        for (c = row; NULL != c; c = next)
+        {
+            next = c->right;
+            release_cell(c);
+            c->up->down = c->down;
+            c->down->up = c->up;
+            c->right = state->free_atoms;
+            state->free_atoms = c;
+        }
+        row = next_row;
     }
+    state->cursor = NULL;
+}
 
-    // If we're at the point where we're looking at the atom in the top left
-    // corner, we're done.
-    // If top_left got broken,
-    if (a == state->top_left)
+// Drop the values of a printed table but keep its atoms, specifications
+// and bookkeeping allocations so the next table can be written over them.
+void recycle_graph(void)
+{
+    for (struct atom *row = state->origin; row != state->bot_left; row = row->down)
+    {
+        row->repeats = 0;
+        for (struct atom *c = row; NULL != c; c = c->right)
+        {
+            if (C_CHARX == c->type)
+            {
+                c->val.c_charx = NULL;
+            }
+            else if (C_WCHAR_TX == c->type)
+            {
+                c->val.c_wchar_tx = NULL;
+            }
+            c->is_multibyte = false;
+        }
+    }
+    for (struct chunk *c = state->strings; NULL != c; c = c->next)
     {
-        state->origin = NULL;
-        state->top_left = NULL;
+        c->used = 0;
     }
+    state->string_chunk = state->strings;
+    forget_interned();
+    drop_index();
+    memset(state->columns, 0, state->ncolumns * sizeof(struct column));
+    state->text_bytes = 0;
+    state->multibyte_excess = 0;
+    state->nrows = 0;
+    state->used_columns = 0;
+    state->last_row = NULL;
+    state->repeat_bytes = 0;
+    free(state->order);
+    state->order = NULL;
+    state->norder = 0;
+    forget_sort_keys();
+    state->row_format = NULL;
+    state->mixed_formats = false;
+    state->dest_len = 0;
+    state->cursor = state->origin;
+    do_tabulate = true;
+}
+
+// In a retained table, hand back the next old row if it was built from f.
+// Once a row doesn't match, it and everything below it are dropped.
+struct atom *reuse_row(struct format *f)
+{
+    struct atom *row = state->cursor;
 
-    // If there's an atom above us, disconnect from it.
-    if (a->up)
+    if (NULL == row)
+    {
+        return NULL;
+    }
+    if (row->spec != &f->specs[0])
     {
-        a->up->down = NULL;
+        truncate_rows(row);
+        return NULL;
     }
+    state->cursor = (row->down == state->bot_left) ? NULL : row->down;
+    state->nrows++;
+    state->last_row = NULL;
+    row->repeats = 0;
+    return row;
+}
 
-    // If there's an atom to the left of us, disconnect from it.
-    if (a->left)
+void index_atom(struct atom *a)
+{
+    if (NULL == a->left)
     {
-        a->left->right = NULL;
+        if (state->nrows >= state->row_first_cap)
+        {
+            size_t n = (state->row_first_cap) ? state->row_first_cap * 2 : 256;
+            size_t *p = realloc(state->row_first, n * sizeof(size_t));
+            if (NULL == p)
+            {
+                cprintf_error("Memory allocation failed.", EXIT_FAILURE);
+            }
+            state->row_first = p;
+            state->row_first_cap = n;
+        }
+        state->row_first[state->nrows - 1] = state->ncells;
     }
-    if (do_tabulate == false)
+    if (state->ncells == state->cells_cap)
     {
-        // point to the some thing
-        free(a->original_specification);
+        size_t n = (state->cells_cap) ? state->cells_cap * 2 : 1024;
+        struct atom **p = realloc(state->cells, n * sizeof(struct atom *));
+        if (NULL == p)
+        {
+            cprintf_error("Memory allocation failed.", EXIT_FAILURE);
+        }
+        state->cells = p;
+        state->cells_cap = n;
     }
-    else
+    state->cells[state->ncells++] = a;
+}
+
+// Index the rows captured so far and histogram their widths. From here on
+// create_atom() and account_atom() keep both up to date.
+static void build_index(void)
+{
+    size_t nrows, r = 0;
+
+    merge_tables();
+    unpack_rows();
+    nrows = state->nrows;
+
+    state->nrows = 0;
+    state->ncells = 0;
+    for (struct atom *row = state->origin; r < nrows; row = row->down, r++)
+    {
+        state->nrows++;
+        for (struct atom *c = row; NULL != c; c = c->right)
+        {
+            index_atom(c);
+            if (c->is_conversion_specification)
+            {
+                hist_add(&state->columns[c->column], c->original_field_width);
+            }
+        }
+    }
+    state->indexed = true;
+}
+
+void drop_index(void)
+{
+    free(state->row_first);
+    free(state->cells);
+    state->row_first = NULL;
+    state->cells = NULL;
+    state->row_first_cap = state->ncells = state->cells_cap = 0;
+    for (size_t i = 0; i < state->ncolumns; i++)
     {
-        free(a->original_specification);
-        free(a->new_specification);
+        free(state->columns[i].hist);
+        state->columns[i].hist = NULL;
+        state->columns[i].hist_cap = 0;
     }
-    free(a->flags);
-    free(a->field_width);
-    free(a->precision);
-    free(a->length_modifier);
-    free(a->conversion_specifier);
-    free(a->ordinary_text);
-    free(a);
+    state->indexed = false;
+}
 
-    return;
+// The first atom of row, checking that there is such a row.
+static struct atom *row_start(size_t row, const char *caller)
+{
+    finish_pipeline();
+    if (is_initialized == false || NULL == state || row >= state->nrows)
+    {
+        cprintf_error("Error in %s: There is no row %zu.", caller, row);
+    }
+    if (!state->indexed)
+    {
+        build_index();
+    }
+    return state->cells[state->row_first[row]];
 }
 
 void free_graph()
@@ -682,34 +1555,28 @@ struct atom *create_atom(bool is_newline)
     const size_t extend_by = 1;
     struct atom *curr_lower_dummy = NULL;
 
-    struct atom *a = calloc(sizeof(struct atom), 1);
+    struct atom *a;
 
-    if (NULL == a)
+    if (NULL == state || is_initialized == false)
     {
-        cprintf_error("Memory allocation failed.", EXIT_FAILURE);
+        cprintf_error("Error in create_atom: Graph is not initialized.", EXIT_FAILURE);
+    }
+    if (NULL != state->packed)
+    {
+        unpack_rows();    // New atoms go below the packed rows.
     }
+    a = alloc_atom();
 
     // recall the value of NULL is implementation-specific.
-    a->original_specification       = NULL;
+    a->spec                         = NULL;
     a->new_specification            = NULL;
-
-    a->flags                        = NULL;
-    a->field_width                  = NULL;
-    a->precision                    = NULL;
-    a->length_modifier              = NULL;
-    a->conversion_specifier         = NULL;
-
-    a->ordinary_text                = NULL;
     a->pargs                        = NULL;
 
     a->right                        = NULL;
     a->left                         = NULL;
     a->up                           = NULL;
     a->down                         = NULL;
-    if (NULL == state || is_initialized == false)
-    {
-        cprintf_error("Error in create_atom: Graph is not initialized.", EXIT_FAILURE);
-    }
+    a->repeats                      = 0;
     // Origin
     if (NULL == state->origin)
     {
@@ -731,9 +1598,19 @@ struct atom *create_atom(bool is_newline)
     a->up = a->down->up;
     a->up->down = a;
     a->down->up = a;
-    state->last_atom_on_last_line = a;
-
-    return a;
+    a->column = (a->left) ? a->left->column + 1 : 0;
+    if (NULL == a->left)
+    {
+        state->nrows++;
+        state->last_row = NULL;
+    }
+    if (state->indexed)
+    {
+        index_atom(a);
+    }
+    state->last_atom_on_last_line = a;
+
+    return a;
 }
 
 // Conversion specifications look like this:
@@ -791,6 +1668,11 @@ ptrdiff_t parse_conversion_specifier(const char *p)
 {
     // conversion specifiers are:
     // d, i, o, u, x, X, e, E, f, F, g, G, a, A, c, C, s, S, p, n, m
+    // and any registered with cprintf_register_conversion().
+    if (NULL != conversions[(unsigned char) *p].format)
+    {
+        return 1;
+    }
     size_t d = strspn(p, "diouxXeEfFgGaAcCsSpnm");
     // This one is mandatory and there can only be one.
     if (d == 0)
@@ -819,640 +1701,7324 @@ bool is(char *p, const char *q)
     return lenp == lenq ? (bool) ! strncmp(p, q, lenq) : false;
 }
 
-static void calc_actual_width(struct atom *a)
+static void sb_reserve(struct strbuf *sb, size_t n)
 {
-    // Reproduces the big table at
-    // https://en.cppreference.com/w/c/io/fprintf
-    /*
-        length      conversion
-        modifier    specifier       type
-        --------------------------------
-        (none)      c               int
-        l           c               wint_t
-        (none)      s               char*
-        l           s               wchar_t*
-        hh          d/i             signed char [int]
-        h           d/i             short [int]
-        (none)      d/i             int
-        l           d/i             long
-        ll          d/i             long long
-        j           d/i             intmax_t
-        z           d/i             signed size_t [ssize_t]
-        t           d/i             ptrdiff_t
-        hh          o/x/X/u         unsigned char [int]
-        h           o/x/X/u         unsigned short [int]
-        (none)      o/x/X/u         unsigned int
-        l           o/x/X/u         unsigned long
-        ll          o/x/X/u         unsigned long long
-        j           o/x/X/u         uintmax_t
-        z           o/x/X/u         size_t
-        t           o/x/X/u         unsigned ptrdiff_t [?]
-        (none)/l    f/F/e/E/a/A/g/G double
-        L           f/F/e/E/a/A/g/G long double
-        (none)      p               void*
-        (none)      n               int*
-    */
-    if (a->is_dummy)
-    {
-        // Return early if this is a dummy atom. TODO: This isn't great fix it.
-        return;
-    }
-
-    static char buf[4097];
-
-    if (is(a->conversion_specifier, "c"))
+    // Make room for n more bytes plus a terminating null.
+    if (sb->len + n + 1 > sb->cap)
     {
-        if (is(a->length_modifier, ""))
+        size_t cap = (sb->cap) ? sb->cap : 256;
+        while (sb->len + n + 1 > cap)
         {
-            a->type = C_INT;
-            a->val.c_int = va_arg(*(a->pargs), int);
-            snprintf(buf, 4096, a->original_specification, a->val.c_int);
+            cap *= 2;
         }
-        else if (is(a->length_modifier, "l"))
+        char *p = realloc(sb->buf, cap);
+        if (NULL == p)
         {
-            a->type = C_WINT_T;
-            a->val.c_wint_t = va_arg(*(a->pargs), wint_t);
-            snprintf(buf, 4096, a->original_specification, a->val.c_wint_t);
-        }
-        else
-        {
-            cprintf_error("Error in calc_actual_width: Invalid length modifier for \%c",
-                          EXIT_FAILURE);
+            cprintf_error("Memory allocation failed.", EXIT_FAILURE);
         }
+        sb->buf = p;
+        sb->cap = cap;
     }
+}
+
+static void sb_append(struct strbuf *sb, const char *p, size_t n)
+{
+    sb_reserve(sb, n);
+    memcpy(sb->buf + sb->len, p, n);
+    sb->len += n;
+    sb->buf[sb->len] = '\0';
+}
+
+static void sb_printf(struct strbuf *sb, const char *fmt, ...)
+{
+    va_list args, args2;
+    int rc;
 
-    else if (is(a->conversion_specifier, "s"))
+    sb_reserve(sb, 64);
+    va_start(args, fmt);
+    va_copy(args2, args);
+    rc = vsnprintf(sb->buf + sb->len, sb->cap - sb->len, fmt, args);
+    if (rc >= 0 && (size_t) rc >= sb->cap - sb->len)
     {
-        if (is(a->length_modifier, ""))
-        {
-            a->type = C_CHARX;
-            a->val.c_charx = strdup(va_arg(*(a->pargs), char *));
-            if (!a->val.c_charx)
-            {
-                cprintf_error("Error in calc_actual_width: Memory allocation failed",
-                              EXIT_FAILURE);
-            }
-            snprintf(buf, 4096, a->original_specification, a->val.c_charx);
-        }
-        else if (is(a->length_modifier, "l"))
-        {
-            a->type = C_WCHAR_TX;
-            a->val.c_wchar_tx = wcsdup(va_arg(*(a->pargs), wchar_t *));
-            if (!a->val.c_wchar_tx)
-            {
-                // Handle memory allocation failure
-                cprintf_error("Error in calc_actual_width: Memory allocation failed",
-                              EXIT_FAILURE);
-            }
-            snprintf(buf, 4096, a->original_specification, a->val.c_wchar_tx);
-        }
-        else
-        {
-            cprintf_error("Error in calc_actual_width: Invalid length modifier for %s",
-                          EXIT_FAILURE);
-        }
+        sb_reserve(sb, rc);
+        rc = vsnprintf(sb->buf + sb->len, sb->cap - sb->len, fmt, args2);
     }
+    va_end(args2);
+    va_end(args);
 
-    /*    else if( is(a->conversion_specifier, "s") ){
-            if( is( a->length_modifier, "" ) ){
-                a->type = C_CHARX;
-                a->val.c_charx = va_arg( *(a->pargs), char* );
-                snprintf( buf, 4096, a->original_specification, a->val.c_charx );
-            }else if( is( a->length_modifier, "l" ) ){
-                a->type = C_WCHAR_TX;
-                a->val.c_wchar_tx = va_arg( *(a->pargs), wchar_t* );
-                snprintf( buf, 4096, a->original_specification, a->val.c_wchar_tx );
-            }else{
-                cprintf_error("Error in calc_actual_width: Invalid length modifier for \%s", EXIT_FAILURE);
-            }
-        }
-    */
+    if (rc < 0)
+    {
+        cprintf_warning("Warning in %s: Unable to format %s.", __PRETTY_FUNCTION__, fmt);
+        return;
+    }
+    sb->len += rc;
+}
+
+#ifdef __SIZEOF_INT128__
+typedef unsigned __int128 uint128_t;
+
+static int bit_length(uint128_t v)
+{
+    uint64_t hi = (uint64_t)(v >> 64), lo = (uint64_t) v;
+    return (hi) ? 128 - __builtin_clzll(hi) : (lo) ? 64 - __builtin_clzll(lo) : 0;
+}
 
-    else if (is(a->conversion_specifier, "d") || is(a->conversion_specifier, "i"))
+// Write the digits of the double with the given bits, made positive and
+// rounded to p decimal places, to buf without a decimal point and return
+// how many there are (at least p + 1), or 0 if the exact value needs more
+// than 128 bits. Like glibc, this rounds the exact binary value to nearest,
+// ties to even.
+static size_t fixed_digits(uint64_t bits, size_t p, char *buf)
+{
+    uint64_t m = bits & ((1ULL << 52) - 1), lo;
+    int e = (int)(bits >> 52 & 0x7ff);
+    uint128_t n, ten = 1;
+    size_t len = 0;
+    char tmp[48];
+
+    if (0 == e)
     {
-        if (is(a->length_modifier, "hh") || is(a->length_modifier, "h") ||
-            is(a->length_modifier, ""))
-        {
-            a->type = C_INT;
-            a->val.c_int = va_arg(*(a->pargs), int);
-            snprintf(buf, 4096, a->original_specification, a->val.c_int);
-        }
-        else if (is(a->length_modifier, "l"))
-        {
-            a->type = C_LONG;
-            a->val.c_long = va_arg(*(a->pargs), long);
-            snprintf(buf, 4096, a->original_specification, a->val.c_long);
-        }
-        else if (is(a->length_modifier, "ll"))
-        {
-            a->type = C_LONG_LONG;
-            a->val.c_long_long = va_arg(*(a->pargs), long long);
-            snprintf(buf, 4096, a->original_specification, a->val.c_long_long);
-        }
-        else if (is(a->length_modifier, "j"))
-        {
-            a->type = C_INTMAX_T;
-            a->val.c_intmax_t = va_arg(*(a->pargs), intmax_t);
-            snprintf(buf, 4096, a->original_specification, a->val.c_intmax_t);
-        }
-        else if (is(a->length_modifier, "z"))
-        {
-            a->type = C_SSIZE_T;
-            a->val.c_ssize_t = va_arg(*(a->pargs), ssize_t);
-            snprintf(buf, 4096, a->original_specification, a->val.c_ssize_t);
-        }
-        else if (is(a->length_modifier, "t"))
-        {
-            a->type = C_PTRDIFF_T;
-            a->val.c_ptrdiff_t = va_arg(*(a->pargs), ptrdiff_t);
-            snprintf(buf, 4096, a->original_specification, a->val.c_ptrdiff_t);
-        }
-        else
-        {
-            cprintf_error("Error in calc_actual_width: Invalid length modifier for \%d or \%i",
-                          EXIT_FAILURE);
-        }
+        e = -1074;
     }
-    else if (is(a->conversion_specifier, "o") || is(a->conversion_specifier, "x") ||
-             is(a->conversion_specifier, "X") || is(a->conversion_specifier, "u"))
+    else
     {
-        if (is(a->length_modifier, "hh") || is(a->length_modifier, "h"))
-        {
-            a->type = C_INT;
-            a->val.c_int = va_arg(*(a->pargs), int);
-            snprintf(buf, 4096, a->original_specification, a->val.c_int);
-        }
-        else if (is(a->length_modifier, ""))
-        {
-            a->type = C_UNSIGNED_INT;
-            a->val.c_unsigned_int = va_arg(*(a->pargs), unsigned int);
-            snprintf(buf, 4096, a->original_specification, a->val.c_unsigned_int);
-        }
-        else if (is(a->length_modifier, "l"))
-        {
-            a->type = C_UNSIGNED_LONG;
-            a->val.c_unsigned_long = va_arg(*(a->pargs), unsigned long);
-            snprintf(buf, 4096, a->original_specification, a->val.c_unsigned_long);
-        }
-        else if (is(a->length_modifier, "ll"))
-        {
-            a->type = C_UNSIGNED_LONG_LONG;
-            a->val.c_unsigned_long_long = va_arg(*(a->pargs), unsigned long long);
-            snprintf(buf, 4096, a->original_specification, a->val.c_unsigned_long_long);
-        }
-        else if (is(a->length_modifier, "j"))
-        {
-            a->type = C_UINTMAX_T;
-            a->val.c_uintmax_t = va_arg(*(a->pargs), uintmax_t);
-            snprintf(buf, 4096, a->original_specification, a->val.c_uintmax_t);
-        }
-        else if (is(a->length_modifier, "z"))
-        {
-            a->type = C_SIZE_T;
-            a->val.c_size_t = va_arg(*(a->pargs), size_t);
-            snprintf(buf, 4096, a->original_specification, a->val.c_size_t);
-        }
-        else if (is(a->length_modifier, "t"))
-        {
-            a->type = C_PTRDIFF_T;
-            a->val.c_ptrdiff_t = va_arg(*(a->pargs), ptrdiff_t);
-            snprintf(buf, 4096, a->original_specification, a->val.c_ptrdiff_t);
-        }
-        else
-        {
-            cprintf_error("Error in calc_actual_width: Invalid length modifier for \%o, \%x, \%X, or \%u",
-                          EXIT_FAILURE);
-        }
+        m |= 1ULL << 52;
+        e -= 1075;
     }
-    else if (is(a->conversion_specifier, "f") || is(a->conversion_specifier, "F") ||
-             is(a->conversion_specifier, "e") || is(a->conversion_specifier, "E") ||
-             is(a->conversion_specifier, "a") || is(a->conversion_specifier, "A") ||
-             is(a->conversion_specifier, "g") || is(a->conversion_specifier, "G"))
+    if (p > 38)
     {
-        if (is(a->length_modifier, "l") || is(a->length_modifier, ""))
-        {
-            a->type = C_DOUBLE;
-            a->val.c_double = va_arg(*(a->pargs), double);
-            snprintf(buf, 4096, a->original_specification, a->val.c_double);
-        }
-        else if (is(a->length_modifier, "L"))
-        {
-            a->type = C_LONG_DOUBLE;
-            a->val.c_long_double = va_arg(*(a->pargs), long double);
-            snprintf(buf, 4096, a->original_specification, a->val.c_long_double);
-        }
-        else
-        {
-            cprintf_error("Error in calc_actual_width: Invalid length modifier for \%f, \%F, \%e, \%E, \%a, \%A, \%g, or \%G",
-                          EXIT_FAILURE);
-        }
+        return 0;
     }
-    else if (is(a->conversion_specifier, "p"))
+    for (size_t i = 0; i < p; i++)
     {
-        if (is(a->length_modifier, ""))
-        {
-            a->type = C_VOIDX;
-            a->val.c_voidx = va_arg(*(a->pargs), void *);
-            snprintf(buf, 4096, a->original_specification, a->val.c_voidx);
-        }
-        else
-        {
-            cprintf_error("Error in calc_actual_width: Invalid length modifier for \%p",
-                          EXIT_FAILURE);
-        }
+        ten *= 10;
     }
-    else if (is(a->conversion_specifier, "n"))     // This is a writeback
+
+    // The value times 10^p is m * 10^p * 2^e.
+    if (bit_length(m) + bit_length(ten) > 127)
     {
-        if (is(a->length_modifier, ""))
-        {
-            a->type = C_INT_PTR;
-            a->val.c_intp = va_arg(*(a->pargs), int *);
-            a->original_field_width = 0;
-        }
-        else
+        return 0;
+    }
+    n = m * ten;
+    if (e >= 0)
+    {
+        if (bit_length(n) + e > 127)
         {
-            cprintf_error("Error in calc_actual_width: Invalid length modifier for \%n",
-                          EXIT_FAILURE);
+            return 0;
         }
-        return; //TODO check if this is better trying to set field width to buf
+        n <<= e;
+    }
+    else if (-e >= 128)
+    {
+        n = 0;  // Less than half of the last place.
     }
     else
     {
-        cprintf_error("Error in calc_actual_width: Invalid conversion specifier.",
-                      EXIT_FAILURE);
+        uint128_t q = n >> -e, r = n - (q << -e), half = (uint128_t) 1 << (-e - 1);
+        n = q + (r > half || (r == half && (q & 1)));
     }
 
-    if (strnlen(buf, 4096) > 4095)
+    // At most one 128-bit division; the rest is done in 64 bits.
+    lo = (uint64_t) n;
+    if (n >> 64)
+    {
+        lo = (uint64_t)(n % 10000000000000000000ULL);
+        for (int i = 0; i < 19; i++, lo /= 10)
+        {
+            tmp[len++] = '0' + lo % 10;
+        }
+        lo = (uint64_t)(n / 10000000000000000000ULL);
+    }
+    do
+    {
+        tmp[len++] = '0' + lo % 10;
+        lo /= 10;
+    } while (lo);
+    while (len < p + 1)
+    {
+        tmp[len++] = '0';
+    }
+    for (size_t i = 0; i < len; i++)
     {
-        cprintf_error("Error in calc_actual_width: snprintf truncated.", EXIT_FAILURE);
+        buf[i] = tmp[len - 1 - i];
     }
-    a->original_field_width = strlen(buf);
+    return len;
 }
+#endif
 
-// TODO: Not super happy with the way this is set up. It's a little convoluted.
-void calc_max_width()
+// Longest precision formatted here; anything longer goes to snprintf().
+#define FLOAT_PRECISION_MAX 512
+
+// Write the exact decimal expansion of the finite double with the given
+// bits, made positive, to buf: its significant digits without leading or
+// trailing zeros, at most 767 of them. Returns how many there are, 0 for
+// zero, and stores the power of ten of the first one in *exp10.
+static size_t exact_digits(uint64_t bits, char *buf, int *exp10)
 {
-    // Really can't remember why I put this here but it can't hurt
-    if (NULL == state)
+    uint32_t w[84];    // The value times 10^scale, least significant word first.
+    char tmp[800];
+    uint64_t m = bits & ((1ULL << 52) - 1);
+    int e = (int)(bits >> 52 & 0x7ff), scale = 0;
+    size_t nw, len = 0, lo = 0;
+
+    if (0 == e)
     {
-        cprintf_error("Error in calc_max_width: state/empty is null.", EXIT_FAILURE);
+        e = -1074;
     }
-    struct atom *aiter = state->origin, *citer, *diter; //A is the top dummy
-    if (NULL == aiter)
+    else
     {
-        cprintf_error("Error in calc_max_width: origin is null.", EXIT_FAILURE);
+        m |= 1ULL << 52;
+        e -= 1075;
     }
-    diter = top_left_finder_safe();
+    if (0 == m)
+    {
+        return 0;
+    }
+    while (e < 0 && 0 == (m & 1))
+    {
+        m >>= 1;
+        e++;
+    }
+    w[0] = (uint32_t) m;
+    w[1] = (uint32_t)(m >> 32);
+    nw = (w[1]) ? 2 : 1;
 
-    size_t w = 0;
-    while (NULL != diter)
+    if (e > 0)
     {
-        aiter = diter->down;
-        if (aiter->is_conversion_specification)
+        // m * 2^e: shift by whole words, then by the bits left over.
+        size_t ws = e / 32;
+        int bs = e % 32;
+        uint32_t carry = 0;
+
+        if (bs)
         {
-            citer = aiter;
-            while (citer->is_dummy == false &&
-                   NULL != citer->down)  // last is a sanity check
+            for (size_t i = 0; i < nw; i++)
             {
-                // find max field width
-                if (citer->original_field_width > w)
-                {
-                    w = citer->original_field_width;
-                }
-                citer = citer->down;
+                uint32_t v = w[i];
+                w[i] = (v << bs) | carry;
+                carry = v >> (32 - bs);
             }
-            citer = aiter;
-            while (citer->is_dummy == false)  // makes clean up easier
+            if (carry)
             {
-                // set max field width
-                citer->new_field_width = w;
-                citer = citer->down;
+                w[nw++] = carry;
             }
-            w = 0;
         }
-        diter = diter->right;
-    }
-}
-
-void generate_new_specs()
-{
-    char buf[4099];
-    int rc;
-    struct atom *a = top_left_finder_safe(), *c; //A is the top dummy row.
-    if (NULL == a)
-    {
-        cprintf_error("Error in generate_new_specs: origin is null.", EXIT_FAILURE);
+        memmove(w + ws, w, nw * sizeof(uint32_t));
+        memset(w, 0, ws * sizeof(uint32_t));
+        nw += ws;
     }
-    while (NULL != a)
+    else if (e < 0)
     {
-        c = a;
-        while (NULL != c)
+        // m * 2^e = m * 5^-e / 10^-e, multiplying by 5^13 where possible.
+        scale = -e;
+        for (int left = scale; left > 0; left -= 13)
         {
-            if (c->is_conversion_specification)
+            uint32_t c = 1;
+            uint64_t carry = 0;
+
+            for (int k = 0; k < left && k < 13; k++)
             {
-                rc = snprintf(buf, 4099, "%%%s%zu%s%s%s", c->flags, c->new_field_width,
-                              c->precision, c->length_modifier, c->conversion_specifier);
-                if (rc > 4099)
-                {
-                    cprintf_error("Error in generate_new_specs: snprintf truncated.", EXIT_FAILURE);
-                }
-                archive(buf, strlen(buf), &(c->new_specification));
+                c *= 5;
+            }
+            for (size_t i = 0; i < nw; i++)
+            {
+                uint64_t v = (uint64_t) w[i] * c + carry;
+                w[i] = (uint32_t) v;
+                carry = v >> 32;
+            }
+            if (carry)
+            {
+                w[nw++] = (uint32_t) carry;
             }
-            c = c->down;
         }
-        a = a->right;
     }
-}
 
-void calculate_writeback(struct atom *a)
-{
-    // Calculate writeback handles %n specifiers traversing right to left summing up the field widths
-    // and then writing back the total to the pointer
-    int sum = 0;
-    for (struct atom *c = a; NULL != c; c = c->left)
+    // Nine decimal digits per division, least significant first.
+    while (nw > 0)
     {
-        if (c->is_conversion_specification)
+        uint64_t r = 0;
+
+        for (size_t i = nw; i-- > 0;)
         {
-            sum += c->new_field_width;
+            uint64_t v = (r << 32) | w[i];
+            w[i] = (uint32_t)(v / 1000000000);
+            r = v % 1000000000;
         }
-        else if (c->ordinary_text)
+        while (nw > 0 && 0 == w[nw - 1])
         {
-            sum += strlen(c->ordinary_text);
+            nw--;
         }
-        else
+        for (int k = 0; k < 9; k++, r /= 10)
         {
-            cprintf_error("Error in calculate_writeback: atom is neither conversion specification nor ordinary text.",
-                          EXIT_FAILURE);
+            tmp[len++] = '0' + r % 10;
         }
     }
-    if (a->val.c_intp != NULL)
+    while ('0' == tmp[len - 1])
     {
-        *a->val.c_intp = sum; //Writeback
+        len--;
     }
-    else
+    while ('0' == tmp[lo])
     {
-        // handle error
-        fprintf(stderr, "Error: a->val.c_intp is NULL\n");
+        lo++;
+    }
+    *exp10 = (int) len - 1 - scale;
+    for (size_t i = 0; i < len - lo; i++)
+    {
+        buf[i] = tmp[len - 1 - i];
     }
+    return len - lo;
 }
 
-void print_something_already()
+// Round the n digits exact_digits() left in d to the first keep of them,
+// to nearest with ties to even as glibc does, and return how many are
+// left once trailing zeros are dropped. A carry past the first digit
+// raises *exp10.
+static size_t round_digits(char *d, size_t n, long keep, int *exp10)
 {
-    // bunch of checks to see if Something horrible happened... No dummies.
-    // TODO: make this use find_top_left_safe
-    if (NULL == state || NULL == state->origin || NULL == state->origin->up ||
-        NULL == state->origin->down || NULL == state->bot_left)
+    bool up;
+
+    if (keep >= (long) n)
     {
-        cprintf_error("Warning in %s: Graph is not initialized.", __PRETTY_FUNCTION__);
+        return n;
     }
-    struct atom *a = state->origin, *c;
-
-    while (NULL != a && a != state->bot_left)
+    if (keep < 0)
     {
-        c = a;
-        while (NULL != c)
+        return 0;
+    }
+    // Digits after d[keep] are never all zeros, so a 5 there is a tie only
+    // if it is the last digit.
+    up = d[keep] > '5' || ('5' == d[keep] && ((size_t) keep + 1 < n ||
+                                             (keep > 0 && ((d[keep - 1] - '0') & 1))));
+    n = keep;
+    if (up)
+    {
+        while (n > 0 && '9' == d[n - 1])
         {
-            if (c->is_conversion_specification)
-            {
-                if (do_tabulate == false)    // TODO: This is so hacky it's not even funny
-                {
-                    c->new_specification = c->original_specification;
-                }
-                switch (c->type)
-                {
-                    case C_INT_PTR:
-                        calculate_writeback(c);
-                        break;
-                    case C_INT:
-                        fprintf(state->dest, c->new_specification, c->val.c_int);
-                        break;
-                    case C_WINT_T:
-                        fprintf(state->dest, c->new_specification, c->val.c_wint_t);
-                        break;
-                    case C_CHARX:
-                        fprintf(state->dest, c->new_specification, c->val.c_charx);
-                        break;
-                    case C_WCHAR_TX:
-                        fprintf(state->dest, c->new_specification, c->val.c_wchar_tx);
-                        break;
-                    case C_LONG:
-                        fprintf(state->dest, c->new_specification, c->val.c_long);
-                        break;
-                    case C_LONG_LONG:
-                        fprintf(state->dest, c->new_specification, c->val.c_long_long);
-                        break;
-                    case C_INTMAX_T:
-                        fprintf(state->dest, c->new_specification, c->val.c_intmax_t);
-                        break;
-                    case C_SSIZE_T:
-                        fprintf(state->dest, c->new_specification, c->val.c_ssize_t);
-                        break;
-                    case C_PTRDIFF_T:
-                        fprintf(state->dest, c->new_specification, c->val.c_ptrdiff_t);
-                        break;
-                    case C_UNSIGNED_INT:
-                        fprintf(state->dest, c->new_specification, c->val.c_unsigned_int);
-                        break;
-                    case C_UNSIGNED_LONG:
-                        fprintf(state->dest, c->new_specification, c->val.c_unsigned_long);
-                        break;
-                    case C_UNSIGNED_LONG_LONG:
-                        fprintf(state->dest, c->new_specification, c->val.c_unsigned_long_long);
-                        break;
-                    case C_UINTMAX_T:
-                        fprintf(state->dest, c->new_specification, c->val.c_uintmax_t);
-                        break;
-                    case C_SIZE_T:
-                        fprintf(state->dest, c->new_specification, c->val.c_size_t);
-                        break;
-                    case C_DOUBLE:
-                        fprintf(state->dest, c->new_specification, c->val.c_double);
-                        break;
-                    case C_LONG_DOUBLE:
-                        fprintf(state->dest, c->new_specification, c->val.c_long_double);
-                        break;
-                    case C_VOIDX:
-                        fprintf(state->dest, c->new_specification, c->val.c_voidx);
-                        break;
-                    default:
-                        cprintf_warning("Warning in %s: Invalid type.", __PRETTY_FUNCTION__);
-                        break;
-                }
-            }
-            else if (c->is_dummy == false)
-            {
-                printf("%s", c->ordinary_text);
-            }
-            c = c->right;
+            n--;
         }
-        a = a->down;
+        if (0 == n)
+        {
+            d[0] = '1';
+            (*exp10)++;
+            return 1;
+        }
+        d[n - 1]++;
     }
-}
+    while (n > 0 && '0' == d[n - 1])
+    {
+        n--;
+    }
+    return n;
+}
 
-void _cprintf(FILE *stream, const char *fmt, va_list *args)
+// Write d (n digits, the first worth 10^exp10) as %f with p decimals.
+static size_t fixed_text(const char *d, size_t n, int exp10, size_t p, bool alt, char *out)
 {
-    struct atom *a;
-    const char *p = fmt, *q = fmt;
-    ptrdiff_t d = 0;
-    ptrdiff_t span;
-    bool ptf = true;
-    //static bool exit_callback_constructed = false;
+    char *o = out;
 
-    if (fileno(stream) == -1)
+    if (0 == n || exp10 < 0)
     {
-        cprintf_error("Error: Invalid stream\n", EXIT_FAILURE);
+        *o++ = '0';
     }
-    if (fmt == NULL)
+    else
     {
-        cprintf_error("Error: Invalid format string\n", EXIT_FAILURE);
-        exit_nice();
+        for (long i = 0; i <= exp10; i++)
+        {
+            *o++ = (i < (long) n) ? d[i] : '0';
+        }
     }
-    if (args == NULL)
+    if (p > 0 || alt)
     {
-        cprintf_error("Error: Invalid args\n", EXIT_FAILURE);
+        *o++ = '.';
     }
-    /* There's a reasonable argument that newlines should be indicated by
-       '\n' in the ordinary text, which would allow successive calls to
-       cprintf() to populate a single line.  This raises, however, the
-       question of what to do with cprintf("\n\n") and similar.  For now,
-       keep parsing easy.
-    */
-    bool is_newline = true;
+    for (size_t j = 1; j <= p; j++)
+    {
+        long i = exp10 + (long) j;
+        *o++ = (n > 0 && i >= 0 && i < (long) n) ? d[i] : '0';
+    }
+    return o - out;
+}
+
+// Write d as %e with p decimals.
+static size_t exp_text(const char *d, size_t n, int exp10, size_t p, bool alt, bool upper,
+                       char *out)
+{
+    char *o = out, tmp[8];
+    int x = (n > 0) ? exp10 : 0, k = 0;
 
-    if (is_initialized == false || state == NULL || state->dest == NULL)
+    *o++ = (n > 0) ? d[0] : '0';
+    if (p > 0 || alt)
     {
-        setup(stream);
-        is_initialized = true;
+        *o++ = '.';
+    }
+    for (size_t j = 1; j <= p; j++)
+    {
+        *o++ = (j < n) ? d[j] : '0';
+    }
+    *o++ = (upper) ? 'E' : 'e';
+    *o++ = (x < 0) ? '-' : '+';
+    x = (x < 0) ? -x : x;
+    do
+    {
+        tmp[k++] = '0' + x % 10;
+        x /= 10;
+    } while (x);
+    if (1 == k)
+    {
+        *o++ = '0';
+    }
+    while (k > 0)
+    {
+        *o++ = tmp[--k];
     }
+    return o - out;
+}
 
-    if (state->dest != stream)
+// Write the positive finite double with the given bits as %a with p hex
+// digits after the point, or as many as it takes if precision is false.
+static size_t hex_text(uint64_t bits, size_t p, bool precision, bool alt, bool upper, char *out)
+{
+    const char *hex = (upper) ? "0123456789ABCDEF" : "0123456789abcdef";
+    uint64_t m = bits & ((1ULL << 52) - 1);
+    int e = (int)(bits >> 52 & 0x7ff), lead = (0 != e), x, k = 0;
+    size_t nd = 13;
+    char *o = out, tmp[8];
+
+    x = (0 != e) ? e - 1023 : (0 != m) ? -1022 : 0;
+    if (precision && p < 13)
     {
-        cprintf_error("Error: Multiple streams not supported.", EXIT_FAILURE);
+        // Round to 4p bits, ties to even. A carry bumps the leading digit.
+        int drop = 52 - 4 * (int) p;
+        uint64_t rem = m & ((1ULL << drop) - 1), half = 1ULL << (drop - 1);
+
+        m >>= drop;
+        if (rem > half || (rem == half && (m & 1)))
+        {
+            m++;
+        }
+        if (m >> (4 * p))
+        {
+            m &= (1ULL << (4 * p)) - 1;
+            lead++;
+        }
+        m <<= drop;
+        nd = p;
+    }
+    else if (precision)
+    {
+        nd = p;
+    }
+    else
+    {
+        while (nd > 0 && 0 == (m >> (4 * (13 - nd)) & 0xf))
+        {
+            nd--;
+        }
     }
 
-    while (*p != '\0')
+    *o++ = '0';
+    *o++ = (upper) ? 'X' : 'x';
+    *o++ = hex[lead];
+    if (nd > 0 || alt)
     {
-        d = strcspn(p, "%");
-        q = p;
-        if (d == 0)
+        *o++ = '.';
+    }
+    for (size_t i = 0; i < nd; i++)
+    {
+        *o++ = (i < 13) ? hex[m >> (48 - 4 * i) & 0xf] : '0';
+    }
+    *o++ = (upper) ? 'P' : 'p';
+    *o++ = (x < 0) ? '-' : '+';
+    x = (x < 0) ? -x : x;
+    do
+    {
+        tmp[k++] = '0' + x % 10;
+        x /= 10;
+    } while (x);
+    while (k > 0)
+    {
+        *o++ = tmp[--k];
+    }
+    return o - out;
+}
+
+// Write x, formatted with sp's conversion and precision but without sign
+// or padding, to out, which has room for FLOAT_PRECISION_MAX + 320 bytes.
+// Returns the length, or 0 for what is left to snprintf(). *prefix is set
+// to the length of the "0x" that zero padding goes after.
+static size_t float_text(const struct spec *sp, double x, char *out, size_t *prefix)
+{
+    char cs = sp->conversion_specifier[0], d[800];
+    size_t p = sp->float_precision, n;
+    bool alt = NULL != strchr(sp->flags, '#'), upper = cs < 'a';
+    uint64_t bits;
+    int exp10 = 0;
+
+    memcpy(&bits, &x, sizeof(bits));
+    bits &= ~(1ULL << 63);
+    *prefix = 0;
+    if (0x7ff == (bits >> 52 & 0x7ff) || p > FLOAT_PRECISION_MAX)
+    {
+        return 0;
+    }
+    switch (cs | 0x20)
+    {
+        case 'a':
+            *prefix = 2;
+            return hex_text(bits, p, !is(sp->precision, ""), alt, upper, out);
+        case 'f':
+#ifdef __SIZEOF_INT128__
+            n = fixed_digits(bits, p, d);
+            if (n > 0)
+            {
+                memcpy(out, d, n - p);
+                if (p > 0 || alt)
+                {
+                    out[n - p] = '.';
+                    memcpy(out + n - p + 1, d + n - p, p);
+                    return n + 1;
+                }
+                return n;
+            }
+#endif
+            n = exact_digits(bits, d, &exp10);
+            n = round_digits(d, n, exp10 + 1 + (long) p, &exp10);
+            return fixed_text(d, n, exp10, p, alt, out);
+        case 'e':
+            n = exact_digits(bits, d, &exp10);
+            n = round_digits(d, n, (long) p + 1, &exp10);
+            return exp_text(d, n, exp10, p, alt, upper, out);
+        default:
         {
-            if (ptf != true)
+            // %g: P significant digits, as %e if the exponent X is below -4
+            // or P and up, else as %f, without trailing zeros unless '#'.
+            size_t P = (0 == p) ? 1 : p, len, end;
+            int X, before;
+
+            n = exact_digits(bits, d, &exp10);
+            before = exp10;
+            n = round_digits(d, n, (long) P, &exp10);
+            X = (n > 0) ? exp10 : 0;
+            if ((long) P > X && X >= -4)
             {
-                do_tabulate = false;
+                len = fixed_text(d, n, exp10, P - 1 - X, alt, out);
+                end = len;
             }
-            ptf = false;
-            // We've found a conversion specification.
-            a = create_atom(is_newline);
+            else
+            {
+                // glibc keeps the decimals %f would have had when rounding
+                // carries 9...9.5 out of it, so "%#g" of 999999.5 is 1.e+06.
+                size_t decimals = ((long) P == X && before == X - 1) ? 0 : P - 1;
 
-            if (a == NULL)
+                len = exp_text(d, n, exp10, decimals, alt, upper, out);
+                end = (const char *) memchr(out, upper ? 'E' : 'e', len) - out;
+            }
+            if (!alt && NULL != memchr(out, '.', end))
             {
-                cprintf_error("Error: Memory allocation failed.", EXIT_FAILURE);
+                size_t cut = end;
+
+                while ('0' == out[cut - 1])
+                {
+                    cut--;
+                }
+                if ('.' == out[cut - 1])
+                {
+                    cut--;
+                }
+                memmove(out + cut, out + end, len - end);
+                len -= end - cut;
             }
-            a->pargs = args;
-            a->is_conversion_specification = true;
+            return len;
+        }
+    }
+}
 
-            q++; // Skip over initial '%'
+// Append x formatted with spec, a %f, %e, %g or %a conversion of sp,
+// exactly as snprintf() would. Returns false for anything it leaves to
+// snprintf().
+static bool format_float(struct strbuf *sb, const struct spec *sp, const char *spec, double x)
+{
+    char text[FLOAT_PRECISION_MAX + 320], sign = 0, *o;
+    const char *q = spec + 1;
+    size_t len, prefix, width, body, pad;
+    uint64_t bits;
 
-            span = parse_flags(q);
-            archive(q, span, &(a->flags));
-            q += span;
+    len = float_text(sp, x, text, &prefix);
+    if (0 == len)
+    {
+        return false;
+    }
 
-            span = parse_field_width(q);
-            archive(q, span, &(a->field_width));
-            q += span;
+    // The field width comes from spec, which cflush() may have widened.
+    q += strspn(q, "#0- +'I");
+    width = strtoul(q, NULL, 10);
 
-            span = parse_precision(q);
-            archive(q, span, &(a->precision));
-            q += span;
+    memcpy(&bits, &x, sizeof(bits));
+    if (bits >> 63)
+    {
+        sign = '-';
+    }
+    else if (strchr(sp->flags, '+'))
+    {
+        sign = '+';
+    }
+    else if (strchr(sp->flags, ' '))
+    {
+        sign = ' ';
+    }
+    body = (0 != sign) + len;
+    pad = (width > body) ? width - body : 0;
 
-            span = parse_length_modifier(q);
-            archive(q, span, &(a->length_modifier));
-            q += span;
+    sb_reserve(sb, body + pad);
+    o = sb->buf + sb->len;
+    if (NULL == strchr(sp->flags, '-') && NULL == strchr(sp->flags, '0'))
+    {
+        memset(o, ' ', pad);
+        o += pad;
+    }
+    if (sign)
+    {
+        *o++ = sign;
+    }
+    memcpy(o, text, prefix);
+    o += prefix;
+    if (NULL == strchr(sp->flags, '-') && NULL != strchr(sp->flags, '0'))
+    {
+        memset(o, '0', pad);
+        o += pad;
+    }
+    memcpy(o, text + prefix, len - prefix);
+    o += len - prefix;
+    if (NULL != strchr(sp->flags, '-'))
+    {
+        memset(o, ' ', pad);
+        o += pad;
+    }
+    sb->len += body + pad;
+    sb->buf[sb->len] = '\0';
+    return true;
+}
 
-            span = parse_conversion_specifier(q);
-            archive(q, span, &(a->conversion_specifier));
-            q += span;
+// The value of a custom conversion as its callbacks see it.
+static void custom_arg(const struct spec *sp, const value *v, struct cprintf_arg *arg)
+{
+    arg->type = sp->custom->arg_type;
+    switch (arg->type)
+    {
+        case CPRINTF_ARG_SIGNED:
+            arg->value.i = v->c_long_long;
+            break;
+        case CPRINTF_ARG_UNSIGNED:
+            arg->value.u = v->c_unsigned_long_long;
+            break;
+        case CPRINTF_ARG_DOUBLE:
+            arg->value.d = v->c_double;
+            break;
+        case CPRINTF_ARG_LONG_DOUBLE:
+            memcpy(arg->value.ld, &v->c_long_double, sizeof(long double));
+            break;
+        case CPRINTF_ARG_STRING:
+            arg->value.p = v->c_charx;
+            break;
+        default:
+            arg->value.p = v->c_voidx;
+            break;
+    }
+}
 
-            if (span < 0)
+// The precision given to a custom conversion, or -1.
+static int custom_precision(const struct spec *sp)
+{
+    return ('.' == sp->precision[0]) ? atoi(sp->precision + 1) : -1;
+}
+
+// Have a's custom conversion write its text straight into sb, then pad it
+// to the field width spec asks for, as printf() would.
+static void render_custom(struct atom *a, const char *spec, struct strbuf *sb)
+{
+    struct cprintf_arg arg;
+    size_t width = strtoul(spec + 1 + strspn(spec + 1, "#0- +'I"), NULL, 10);
+    size_t room, pad;
+    int rc;
+
+    custom_arg(a->spec, &a->val, &arg);
+    sb_reserve(sb, width);
+    room = sb->cap - sb->len;
+    rc = a->spec->custom->format(sb->buf + sb->len, room, &arg, custom_precision(a->spec));
+    if (rc >= 0 && (size_t) rc >= room)
+    {
+        sb_reserve(sb, rc);
+        room = sb->cap - sb->len;
+        rc = a->spec->custom->format(sb->buf + sb->len, room, &arg, custom_precision(a->spec));
+    }
+    if (rc < 0 || (size_t) rc >= room)
+    {
+        cprintf_warning("Warning in %s: Unable to format %s.", __PRETTY_FUNCTION__, spec);
+        sb->buf[sb->len] = '\0';
+        return;
+    }
+
+    pad = (width > (size_t) rc) ? width - rc : 0;
+    sb_reserve(sb, rc + pad);
+    if (NULL == strchr(a->spec->flags, '-'))
+    {
+        memmove(sb->buf + sb->len + pad, sb->buf + sb->len, rc);
+        memset(sb->buf + sb->len, ' ', pad);
+    }
+    else
+    {
+        memset(sb->buf + sb->len + rc, ' ', pad);
+    }
+    sb->len += rc + pad;
+    sb->buf[sb->len] = '\0';
+}
+
+// Append a's value to sb, formatted with spec.
+static void render_value(struct atom *a, const char *spec, struct strbuf *sb)
+{
+    if (NULL != a->spec->custom)
+    {
+        render_custom(a, spec, sb);
+        return;
+    }
+    switch (a->type)
+    {
+        case C_INT_PTR:
+            calculate_writeback(a);
+            break;
+        case C_INT:
+            sb_printf(sb, spec, a->val.c_int);
+            break;
+        case C_WINT_T:
+            sb_printf(sb, spec, a->val.c_wint_t);
+            break;
+        case C_CHARX:
+            sb_printf(sb, spec, a->val.c_charx);
+            break;
+        case C_WCHAR_TX:
+            sb_printf(sb, spec, a->val.c_wchar_tx);
+            break;
+        case C_LONG:
+            sb_printf(sb, spec, a->val.c_long);
+            break;
+        case C_LONG_LONG:
+            sb_printf(sb, spec, a->val.c_long_long);
+            break;
+        case C_INTMAX_T:
+            sb_printf(sb, spec, a->val.c_intmax_t);
+            break;
+        case C_SSIZE_T:
+            sb_printf(sb, spec, a->val.c_ssize_t);
+            break;
+        case C_PTRDIFF_T:
+            sb_printf(sb, spec, a->val.c_ptrdiff_t);
+            break;
+        case C_UNSIGNED_INT:
+            sb_printf(sb, spec, a->val.c_unsigned_int);
+            break;
+        case C_UNSIGNED_LONG:
+            sb_printf(sb, spec, a->val.c_unsigned_long);
+            break;
+        case C_UNSIGNED_LONG_LONG:
+            sb_printf(sb, spec, a->val.c_unsigned_long_long);
+            break;
+        case C_UINTMAX_T:
+            sb_printf(sb, spec, a->val.c_uintmax_t);
+            break;
+        case C_SIZE_T:
+            sb_printf(sb, spec, a->val.c_size_t);
+            break;
+        case C_DOUBLE:
+            if (!a->spec->is_float || !format_float(sb, a->spec, spec, a->val.c_double))
             {
-                cprintf_error("Error: Invalid conversion specifier.", EXIT_FAILURE);
+                sb_printf(sb, spec, a->val.c_double);
             }
+            break;
+        case C_LONG_DOUBLE:
+            sb_printf(sb, spec, a->val.c_long_double);
+            break;
+        case C_VOIDX:
+            sb_printf(sb, spec, a->val.c_voidx);
+            break;
+        default:
+            cprintf_warning("Warning in %s: Invalid type.", __PRETTY_FUNCTION__);
+            break;
+    }
+}
+
+// Code points that take no cells (combining marks, joiners and other
+// format characters) and code points that take two (East Asian wide and
+// fullwidth characters, most emoji). Both tables are sorted so they can be
+// binary searched.
+struct interval
+{
+    uint32_t first;
+    uint32_t last;
+};
 
-            archive(p, q - p, &(a->original_specification));
+static const struct interval zero_width[] =
+{
+    { 0x0300, 0x036F }, { 0x0483, 0x0489 }, { 0x0591, 0x05BD }, { 0x05BF, 0x05BF },
+    { 0x05C1, 0x05C2 }, { 0x05C4, 0x05C5 }, { 0x05C7, 0x05C7 }, { 0x0610, 0x061A },
+    { 0x064B, 0x065F }, { 0x0670, 0x0670 }, { 0x06D6, 0x06DC }, { 0x06DF, 0x06E4 },
+    { 0x06E7, 0x06E8 }, { 0x06EA, 0x06ED }, { 0x0711, 0x0711 }, { 0x0730, 0x074A },
+    { 0x07A6, 0x07B0 }, { 0x07EB, 0x07F3 }, { 0x0816, 0x0819 }, { 0x081B, 0x0823 },
+    { 0x0825, 0x0827 }, { 0x0829, 0x082D }, { 0x0859, 0x085B }, { 0x08D3, 0x08E1 },
+    { 0x08E3, 0x0902 }, { 0x093A, 0x093A }, { 0x093C, 0x093C }, { 0x0941, 0x0948 },
+    { 0x094D, 0x094D }, { 0x0951, 0x0957 }, { 0x0962, 0x0963 }, { 0x0981, 0x0981 },
+    { 0x09BC, 0x09BC }, { 0x09C1, 0x09C4 }, { 0x09CD, 0x09CD }, { 0x09E2, 0x09E3 },
+    { 0x0A01, 0x0A02 }, { 0x0A3C, 0x0A3C }, { 0x0A41, 0x0A42 }, { 0x0A47, 0x0A48 },
+    { 0x0A4B, 0x0A4D }, { 0x0A51, 0x0A51 }, { 0x0A70, 0x0A71 }, { 0x0A75, 0x0A75 },
+    { 0x0A81, 0x0A82 }, { 0x0ABC, 0x0ABC }, { 0x0AC1, 0x0AC5 }, { 0x0AC7, 0x0AC8 },
+    { 0x0ACD, 0x0ACD }, { 0x0AE2, 0x0AE3 }, { 0x0B01, 0x0B01 }, { 0x0B3C, 0x0B3C },
+    { 0x0B3F, 0x0B3F }, { 0x0B41, 0x0B44 }, { 0x0B4D, 0x0B4D }, { 0x0B56, 0x0B56 },
+    { 0x0B62, 0x0B63 }, { 0x0B82, 0x0B82 }, { 0x0BC0, 0x0BC0 }, { 0x0BCD, 0x0BCD },
+    { 0x0C00, 0x0C00 }, { 0x0C3E, 0x0C40 }, { 0x0C46, 0x0C48 }, { 0x0C4A, 0x0C4D },
+    { 0x0C55, 0x0C56 }, { 0x0C62, 0x0C63 }, { 0x0C81, 0x0C81 }, { 0x0CBC, 0x0CBC },
+    { 0x0CBF, 0x0CBF }, { 0x0CC6, 0x0CC6 }, { 0x0CCC, 0x0CCD }, { 0x0CE2, 0x0CE3 },
+    { 0x0D00, 0x0D01 }, { 0x0D41, 0x0D44 }, { 0x0D4D, 0x0D4D }, { 0x0D62, 0x0D63 },
+    { 0x0DCA, 0x0DCA }, { 0x0DD2, 0x0DD4 }, { 0x0DD6, 0x0DD6 }, { 0x0E31, 0x0E31 },
+    { 0x0E34, 0x0E3A }, { 0x0E47, 0x0E4E }, { 0x0EB1, 0x0EB1 }, { 0x0EB4, 0x0EBC },
+    { 0x0EC8, 0x0ECD }, { 0x0F18, 0x0F19 }, { 0x0F35, 0x0F35 }, { 0x0F37, 0x0F37 },
+    { 0x0F39, 0x0F39 }, { 0x0F71, 0x0F7E }, { 0x0F80, 0x0F84 }, { 0x0F86, 0x0F87 },
+    { 0x0F8D, 0x0FBC }, { 0x0FC6, 0x0FC6 }, { 0x102D, 0x1030 }, { 0x1032, 0x1037 },
+    { 0x1039, 0x103A }, { 0x103D, 0x103E }, { 0x1058, 0x1059 }, { 0x105E, 0x1060 },
+    { 0x1071, 0x1074 }, { 0x1082, 0x1082 }, { 0x1085, 0x1086 }, { 0x108D, 0x108D },
+    { 0x109D, 0x109D }, { 0x1160, 0x11FF }, { 0x135D, 0x135F }, { 0x1712, 0x1714 },
+    { 0x1732, 0x1734 }, { 0x1752, 0x1753 }, { 0x1772, 0x1773 }, { 0x17B4, 0x17B5 },
+    { 0x17B7, 0x17BD }, { 0x17C6, 0x17C6 }, { 0x17C9, 0x17D3 }, { 0x17DD, 0x17DD },
+    { 0x180B, 0x180E }, { 0x1885, 0x1886 }, { 0x18A9, 0x18A9 }, { 0x1920, 0x1922 },
+    { 0x1927, 0x1928 }, { 0x1932, 0x1932 }, { 0x1939, 0x193B }, { 0x1A17, 0x1A18 },
+    { 0x1A1B, 0x1A1B }, { 0x1A56, 0x1A56 }, { 0x1A58, 0x1A5E }, { 0x1A60, 0x1A60 },
+    { 0x1A62, 0x1A62 }, { 0x1A65, 0x1A6C }, { 0x1A73, 0x1A7C }, { 0x1A7F, 0x1A7F },
+    { 0x1AB0, 0x1AFF }, { 0x1B00, 0x1B03 }, { 0x1B34, 0x1B34 }, { 0x1B36, 0x1B3A },
+    { 0x1B3C, 0x1B3C }, { 0x1B42, 0x1B42 }, { 0x1B6B, 0x1B73 }, { 0x1B80, 0x1B81 },
+    { 0x1BA2, 0x1BA5 }, { 0x1BA8, 0x1BA9 }, { 0x1BAB, 0x1BAD }, { 0x1BE6, 0x1BE6 },
+    { 0x1BE8, 0x1BE9 }, { 0x1BED, 0x1BED }, { 0x1BEF, 0x1BF1 }, { 0x1C2C, 0x1C33 },
+    { 0x1C36, 0x1C37 }, { 0x1CD0, 0x1CD2 }, { 0x1CD4, 0x1CE0 }, { 0x1CE2, 0x1CE8 },
+    { 0x1CED, 0x1CED }, { 0x1CF4, 0x1CF4 }, { 0x1CF8, 0x1CF9 }, { 0x1DC0, 0x1DFF },
+    { 0x200B, 0x200F }, { 0x202A, 0x202E }, { 0x2060, 0x2064 }, { 0x20D0, 0x20F0 },
+    { 0x2CEF, 0x2CF1 }, { 0x2D7F, 0x2D7F }, { 0x2DE0, 0x2DFF }, { 0x302A, 0x302D },
+    { 0x3099, 0x309A }, { 0xA66F, 0xA672 }, { 0xA674, 0xA67D }, { 0xA69E, 0xA69F },
+    { 0xA6F0, 0xA6F1 }, { 0xA802, 0xA802 }, { 0xA806, 0xA806 }, { 0xA80B, 0xA80B },
+    { 0xA825, 0xA826 }, { 0xA8C4, 0xA8C5 }, { 0xA8E0, 0xA8F1 }, { 0xA926, 0xA92D },
+    { 0xA947, 0xA951 }, { 0xA980, 0xA982 }, { 0xA9B3, 0xA9B3 }, { 0xA9B6, 0xA9B9 },
+    { 0xA9BC, 0xA9BC }, { 0xA9E5, 0xA9E5 }, { 0xAA29, 0xAA2E }, { 0xAA31, 0xAA32 },
+    { 0xAA35, 0xAA36 }, { 0xAA43, 0xAA43 }, { 0xAA4C, 0xAA4C }, { 0xAAB0, 0xAAB0 },
+    { 0xAAB2, 0xAAB4 }, { 0xAAB7, 0xAAB8 }, { 0xAABE, 0xAABF }, { 0xAAC1, 0xAAC1 },
+    { 0xAAEC, 0xAAED }, { 0xAAF6, 0xAAF6 }, { 0xABE5, 0xABE5 }, { 0xABE8, 0xABE8 },
+    { 0xABED, 0xABED }, { 0xD7B0, 0xD7FF }, { 0xFB1E, 0xFB1E }, { 0xFE00, 0xFE0F },
+    { 0xFE20, 0xFE2F }, { 0xFEFF, 0xFEFF }, { 0xFFF9, 0xFFFB }, { 0x101FD, 0x101FD },
+    { 0x102E0, 0x102E0 }, { 0x10376, 0x1037A }, { 0x10A01, 0x10A03 }, { 0x10A05, 0x10A06 },
+    { 0x10A0C, 0x10A0F }, { 0x10A38, 0x10A3A }, { 0x10A3F, 0x10A3F }, { 0x10AE5, 0x10AE6 },
+    { 0x11001, 0x11001 }, { 0x11038, 0x11046 }, { 0x1107F, 0x11081 }, { 0x110B3, 0x110B6 },
+    { 0x110B9, 0x110BA }, { 0x11100, 0x11102 }, { 0x11127, 0x1112B }, { 0x1112D, 0x11134 },
+    { 0x11173, 0x11173 }, { 0x11180, 0x11181 }, { 0x111B6, 0x111BE }, { 0x1D167, 0x1D169 },
+    { 0x1D173, 0x1D182 }, { 0x1D185, 0x1D18B }, { 0x1D1AA, 0x1D1AD }, { 0x1D242, 0x1D244 },
+    { 0x1E8D0, 0x1E8D6 }, { 0x1E944, 0x1E94A }, { 0xE0001, 0xE0001 }, { 0xE0020, 0xE007F },
+    { 0xE0100, 0xE01EF }
+};
 
-            calc_actual_width(a);
-            a->pargs = NULL;    // cleanup
-            p = q;
+static const struct interval double_width[] =
+{
+    { 0x1100, 0x115F }, { 0x231A, 0x231B }, { 0x2329, 0x232A }, { 0x23E9, 0x23EC },
+    { 0x23F0, 0x23F0 }, { 0x23F3, 0x23F3 }, { 0x25FD, 0x25FE }, { 0x2614, 0x2615 },
+    { 0x2648, 0x2653 }, { 0x267F, 0x267F }, { 0x2693, 0x2693 }, { 0x26A1, 0x26A1 },
+    { 0x26AA, 0x26AB }, { 0x26BD, 0x26BE }, { 0x26C4, 0x26C5 }, { 0x26CE, 0x26CE },
+    { 0x26D4, 0x26D4 }, { 0x26EA, 0x26EA }, { 0x26F2, 0x26F3 }, { 0x26F5, 0x26F5 },
+    { 0x26FA, 0x26FA }, { 0x26FD, 0x26FD }, { 0x2705, 0x2705 }, { 0x270A, 0x270B },
+    { 0x2728, 0x2728 }, { 0x274C, 0x274C }, { 0x274E, 0x274E }, { 0x2753, 0x2755 },
+    { 0x2757, 0x2757 }, { 0x2795, 0x2797 }, { 0x27B0, 0x27B0 }, { 0x27BF, 0x27BF },
+    { 0x2B1B, 0x2B1C }, { 0x2B50, 0x2B50 }, { 0x2B55, 0x2B55 }, { 0x2E80, 0x303E },
+    { 0x3041, 0x33FF }, { 0x3400, 0x4DBF }, { 0x4E00, 0x9FFF }, { 0xA000, 0xA4CF },
+    { 0xA960, 0xA97F }, { 0xAC00, 0xD7A3 }, { 0xF900, 0xFAFF }, { 0xFE10, 0xFE19 },
+    { 0xFE30, 0xFE6F }, { 0xFF00, 0xFF60 }, { 0xFFE0, 0xFFE6 }, { 0x16FE0, 0x16FE4 },
+    { 0x17000, 0x187F7 }, { 0x18800, 0x18CD5 }, { 0x1B000, 0x1B16F }, { 0x1F004, 0x1F004 },
+    { 0x1F0CF, 0x1F0CF }, { 0x1F18E, 0x1F18E }, { 0x1F191, 0x1F19A }, { 0x1F200, 0x1F202 },
+    { 0x1F210, 0x1F23B }, { 0x1F240, 0x1F248 }, { 0x1F250, 0x1F251 }, { 0x1F260, 0x1F265 },
+    { 0x1F300, 0x1F320 }, { 0x1F32D, 0x1F335 }, { 0x1F337, 0x1F37C }, { 0x1F37E, 0x1F393 },
+    { 0x1F3A0, 0x1F3CA }, { 0x1F3CF, 0x1F3D3 }, { 0x1F3E0, 0x1F3F0 }, { 0x1F3F4, 0x1F3F4 },
+    { 0x1F3F8, 0x1F43E }, { 0x1F440, 0x1F440 }, { 0x1F442, 0x1F4FC }, { 0x1F4FF, 0x1F53D },
+    { 0x1F54B, 0x1F54E }, { 0x1F550, 0x1F567 }, { 0x1F57A, 0x1F57A }, { 0x1F595, 0x1F596 },
+    { 0x1F5A4, 0x1F5A4 }, { 0x1F5FB, 0x1F64F }, { 0x1F680, 0x1F6C5 }, { 0x1F6CC, 0x1F6CC },
+    { 0x1F6D0, 0x1F6D2 }, { 0x1F6D5, 0x1F6D7 }, { 0x1F6EB, 0x1F6EC }, { 0x1F6F4, 0x1F6FC },
+    { 0x1F7E0, 0x1F7EB }, { 0x1F90C, 0x1F93A }, { 0x1F93C, 0x1F945 }, { 0x1F947, 0x1F9FF },
+    { 0x1FA70, 0x1FAFF }, { 0x20000, 0x2FFFD }, { 0x30000, 0x3FFFD }
+};
+
+static bool in_table(uint32_t cp, const struct interval *t, size_t n)
+{
+    size_t lo = 0, hi = n;
+
+    if (cp < t[0].first || cp > t[n - 1].last)
+    {
+        return false;
+    }
+    while (lo < hi)
+    {
+        size_t mid = lo + (hi - lo) / 2;
+        if (cp > t[mid].last)
+        {
+            lo = mid + 1;
+        }
+        else if (cp < t[mid].first)
+        {
+            hi = mid;
         }
         else
         {
-            // We've found some normal text.
-            ptf = true;
-            a = create_atom(is_newline);
-            a->is_conversion_specification = false;
-            archive(q, d, &(a->ordinary_text));
-            q += d;
-            p = q;
+            return true;
         }
-        is_newline = false;
     }
+    return false;
 }
 
-// Callback for exit() to free memory
-void exit_nice(void)
+// Number of terminal cells used by a single code point.
+static size_t codepoint_width(uint32_t cp)
 {
-    if (is_initialized == true)
+    if (cp < 0x80)
     {
-        cflush();
+        return 1;
+    }
+    if (cp < 0xA0)    // C1 controls
+    {
+        return 0;
+    }
+    if (in_table(cp, zero_width, sizeof(zero_width) / sizeof(zero_width[0])))
+    {
+        return 0;
     }
-    exit(0);
+    if (in_table(cp, double_width, sizeof(double_width) / sizeof(double_width[0])))
+    {
+        return 2;
+    }
+    return 1;
 }
 
-void cprintf(const char *fmt, ...)
+// Returns the number of leading bytes of s that are plain ASCII.
+static size_t ascii_prefix(const char *s, size_t len)
 {
-    va_list args;
-    va_start(args, fmt);
-    _cprintf(stdout, fmt, &args);
-    va_end(args);
-}
+    size_t i = 0;
+    uint64_t w;
 
-void cfprintf(FILE *stream, const char *fmt, ...)
-{
-    va_list args;
-    va_start(args, fmt);
-    _cprintf(stream, fmt, &args);
-    va_end(args);
+    // Test eight bytes at a time; the compiler is free to widen this further.
+    while (i + sizeof(w) <= len)
+    {
+        memcpy(&w, s + i, sizeof(w));
+        if (w & 0x8080808080808080ULL)
+        {
+            break;
+        }
+        i += sizeof(w);
+    }
+    while (i < len && (unsigned char) s[i] < 0x80)
+    {
+        i++;
+    }
+    return i;
 }
 
-void cvprintf(const char *fmt, va_list args)
+// Decode the character at p[i] and return its length in bytes, storing the
+// display cells it takes up in *width. Malformed bytes count as one cell.
+static size_t next_char(const unsigned char *p, size_t len, size_t i, size_t *width)
 {
-    va_list args2;
-    va_copy(args2, args);
-    _cprintf(stdout, fmt, &args2);
-    va_end(args2);
+    uint32_t cp;
+    size_t n;
+
+    *width = 1;
+    if (p[i] < 0x80)
+    {
+        return 1;
+    }
+    else if ((p[i] & 0xE0) == 0xC0)
+    {
+        cp = p[i] & 0x1F;
+        n = 2;
+    }
+    else if ((p[i] & 0xF0) == 0xE0)
+    {
+        cp = p[i] & 0x0F;
+        n = 3;
+    }
+    else if ((p[i] & 0xF8) == 0xF0)
+    {
+        cp = p[i] & 0x07;
+        n = 4;
+    }
+    else
+    {
+        return 1;
+    }
+
+    size_t k = 1;
+    while (k < n && i + k < len && (p[i + k] & 0xC0) == 0x80)
+    {
+        cp = (cp << 6) | (p[i + k] & 0x3F);
+        k++;
+    }
+    if (k < n)
+    {
+        // Truncated sequence.
+        return 1;
+    }
+    *width = codepoint_width(cp);
+    return n;
 }
 
-void cvfprintf(FILE *stream, const char *fmt, va_list args)
+// Number of terminal cells needed to display len bytes of UTF-8 text.
+// Bytes that are not valid UTF-8 are counted as one cell each, which is
+// how most terminals show the replacement character.
+static size_t display_width(const char *s, size_t len)
 {
-    va_list args2;
-    va_copy(args2, args);
-    _cprintf(stream, fmt, &args2);
-    va_end(args2);
+    const unsigned char *p = (const unsigned char *) s;
+    size_t i = ascii_prefix(s, len);
+    size_t width = i, w;
+
+    while (i < len)
+    {
+        i += next_char(p, len, i, &w);
+        width += w;
+    }
+    return width;
 }
 
-void cflush()
+// Bytes of the longest run of whole characters at s that fits in max
+// display cells; the cells it takes up are stored in *cells.
+static size_t fit_cells(const char *s, size_t len, size_t max, size_t *cells)
 {
-    if (is_initialized != false)
+    const unsigned char *p = (const unsigned char *) s;
+    size_t i = 0, width = 0, w, n;
+
+    while (i < len)
     {
-        if (do_tabulate != false)
+        n = next_char(p, len, i, &w);
+        if (width + w > max)
         {
-            calc_max_width();
-            generate_new_specs();
+            break;
+        }
+        i += n;
+        width += w;
+    }
+    *cells = width;
+    return i;
+}
+
+// Build a copy of a's specification without a field width. Text conversions
+// with multibyte output are rendered this way and padded by display cells,
+// since printf() pads by bytes.
+static void unpadded_specification(struct atom *a, char *buf, size_t size)
+{
+    snprintf(buf, size, "%%%s%s%s%s", a->spec->flags, a->spec->precision,
+             a->spec->length_modifier, a->spec->conversion_specifier);
+}
+
+static bool is_text_conversion(struct atom *a)
+{
+    return a->type == C_CHARX || a->type == C_WCHAR_TX ||
+           'c' == a->spec->conversion_specifier[0] || NULL != a->spec->custom;
+}
+
+// Render a into sb, padded with spaces to width display cells.
+static void render_padded_by_cells(struct atom *a, size_t width, struct strbuf *sb)
+{
+    char spec[64];
+    size_t start = sb->len;
+    size_t cells, pad;
+
+    unpadded_specification(a, spec, sizeof(spec));
+    render_value(a, spec, sb);
+
+    cells = display_width(sb->buf + start, sb->len - start);
+    pad = (width > cells) ? width - cells : 0;
+    sb_reserve(sb, pad);
+    if (NULL == strchr(a->spec->flags, '-'))
+    {
+        memmove(sb->buf + start + pad, sb->buf + start, sb->len - start);
+        memset(sb->buf + start, ' ', pad);
+    }
+    else
+    {
+        memset(sb->buf + sb->len, ' ', pad);
+    }
+    sb->len += pad;
+    sb->buf[sb->len] = '\0';
+}
+
+// Bytes a's unpadded text takes beyond the display cells it occupies.
+static size_t multibyte_excess_of(struct atom *a, size_t *cells)
+{
+    struct strbuf *scratch = &excess_scratch;
+    char spec[64];
+
+    scratch->len = 0;
+    unpadded_specification(a, spec, sizeof(spec));
+    render_value(a, spec, scratch);
+    *cells = display_width(scratch->buf, scratch->len);
+    return scratch->len - *cells;
+}
+
+// Called when a text conversion produced non-ASCII output: measure it in
+// display cells rather than bytes.
+static void measure_multibyte(struct atom *a)
+{
+    size_t cells, width;
+    size_t excess = multibyte_excess_of(a, &cells);
+
+    width = a->spec->min_width;
+    a->original_field_width = (cells > width) ? cells : width;
+    a->is_multibyte = true;
+
+    // Padding is added per cell, so each such atom writes this many more
+    // bytes than its width suggests.
+    if (NULL != filling)
+    {
+        atomic_fetch_add(&filling->multibyte_excess, excess);
+    }
+    else
+    {
+        state->multibyte_excess += excess;
+    }
+}
+
+void resolve_type(struct spec *sp)
+{
+    // Reproduces the big table at
+    // https://en.cppreference.com/w/c/io/fprintf
+    /*
+        length      conversion
+        modifier    specifier       type
+        --------------------------------
+        (none)      c               int
+        l           c               wint_t
+        (none)      s               char*
+        l           s               wchar_t*
+        hh          d/i             signed char [int]
+        h           d/i             short [int]
+        (none)      d/i             int
+        l           d/i             long
+        ll          d/i             long long
+        j           d/i             intmax_t
+        z           d/i             signed size_t [ssize_t]
+        t           d/i             ptrdiff_t
+        hh          o/x/X/u         unsigned char [int]
+        h           o/x/X/u         unsigned short [int]
+        (none)      o/x/X/u         unsigned int
+        l           o/x/X/u         unsigned long
+        ll          o/x/X/u         unsigned long long
+        j           o/x/X/u         uintmax_t
+        z           o/x/X/u         size_t
+        t           o/x/X/u         unsigned ptrdiff_t [?]
+        (none)/l    f/F/e/E/a/A/g/G double
+        L           f/F/e/E/a/A/g/G long double
+        (none)      p               void*
+        (none)      n               int*
+    */
+    // This used to be done for every cell as it was captured. The answer
+    // only depends on the specification, so it is now worked out once when
+    // the format string is parsed.
+    char *cs = sp->conversion_specifier;
+    char *lm = sp->length_modifier;
+
+    sp->is_signed = false;
+    sp->custom = NULL;
+    if (NULL != conversions[(unsigned char) cs[0]].format)
+    {
+        if (!is(lm, ""))
+        {
+            cprintf_error("Error in resolve_type: Length modifiers don't apply to %%%s.",
+                          cs);
+        }
+        sp->custom = &conversions[(unsigned char) cs[0]];
+        sp->type = sp->custom->type;
+        sp->is_signed = (CPRINTF_ARG_SIGNED == sp->custom->arg_type);
+        switch (sp->type)
+        {
+            case C_LONG_LONG:
+                sp->mem_size = sizeof(long long);
+                break;
+            case C_UNSIGNED_LONG_LONG:
+                sp->mem_size = sizeof(unsigned long long);
+                break;
+            case C_DOUBLE:
+                sp->mem_size = sizeof(double);
+                break;
+            case C_LONG_DOUBLE:
+                sp->mem_size = sizeof(long double);
+                break;
+            case C_CHARX:
+                sp->mem_size = sizeof(char *);
+                break;
+            default:
+                sp->mem_size = sizeof(void *);
+                break;
+        }
+    }
+    else if (is(cs, "c"))
+    {
+        if (is(lm, ""))
+        {
+            sp->type = C_INT;
+            sp->mem_size = sizeof(char);
+        }
+        else if (is(lm, "l"))
+        {
+            sp->type = C_WINT_T;
+            sp->mem_size = sizeof(wchar_t);
+        }
+        else
+        {
+            cprintf_error("Error in calc_actual_width: Invalid length modifier for \%c",
+                          EXIT_FAILURE);
+        }
+    }
+    else if (is(cs, "s"))
+    {
+        if (is(lm, ""))
+        {
+            sp->type = C_CHARX;
+            sp->mem_size = sizeof(char *);
+        }
+        else if (is(lm, "l"))
+        {
+            sp->type = C_WCHAR_TX;
+            sp->mem_size = sizeof(wchar_t *);
+        }
+        else
+        {
+            cprintf_error("Error in calc_actual_width: Invalid length modifier for %s",
+                          EXIT_FAILURE);
+        }
+    }
+    else if (is(cs, "d") || is(cs, "i"))
+    {
+        sp->is_signed = true;
+        if (is(lm, "hh"))
+        {
+            sp->type = C_INT;
+            sp->mem_size = sizeof(signed char);
+        }
+        else if (is(lm, "h"))
+        {
+            sp->type = C_INT;
+            sp->mem_size = sizeof(short);
+        }
+        else if (is(lm, ""))
+        {
+            sp->type = C_INT;
+            sp->mem_size = sizeof(int);
+        }
+        else if (is(lm, "l"))
+        {
+            sp->type = C_LONG;
+            sp->mem_size = sizeof(long);
+        }
+        else if (is(lm, "ll"))
+        {
+            sp->type = C_LONG_LONG;
+            sp->mem_size = sizeof(long long);
+        }
+        else if (is(lm, "j"))
+        {
+            sp->type = C_INTMAX_T;
+            sp->mem_size = sizeof(intmax_t);
+        }
+        else if (is(lm, "z"))
+        {
+            sp->type = C_SSIZE_T;
+            sp->mem_size = sizeof(ssize_t);
+        }
+        else if (is(lm, "t"))
+        {
+            sp->type = C_PTRDIFF_T;
+            sp->mem_size = sizeof(ptrdiff_t);
+        }
+        else
+        {
+            cprintf_error("Error in calc_actual_width: Invalid length modifier for \%d or \%i",
+                          EXIT_FAILURE);
+        }
+    }
+    else if (is(cs, "o") || is(cs, "x") || is(cs, "X") || is(cs, "u"))
+    {
+        if (is(lm, "hh"))
+        {
+            sp->type = C_INT;
+            sp->mem_size = sizeof(unsigned char);
+        }
+        else if (is(lm, "h"))
+        {
+            sp->type = C_INT;
+            sp->mem_size = sizeof(unsigned short);
+        }
+        else if (is(lm, ""))
+        {
+            sp->type = C_UNSIGNED_INT;
+            sp->mem_size = sizeof(unsigned int);
+        }
+        else if (is(lm, "l"))
+        {
+            sp->type = C_UNSIGNED_LONG;
+            sp->mem_size = sizeof(unsigned long);
+        }
+        else if (is(lm, "ll"))
+        {
+            sp->type = C_UNSIGNED_LONG_LONG;
+            sp->mem_size = sizeof(unsigned long long);
+        }
+        else if (is(lm, "j"))
+        {
+            sp->type = C_UINTMAX_T;
+            sp->mem_size = sizeof(uintmax_t);
+        }
+        else if (is(lm, "z"))
+        {
+            sp->type = C_SIZE_T;
+            sp->mem_size = sizeof(size_t);
+        }
+        else if (is(lm, "t"))
+        {
+            sp->type = C_PTRDIFF_T;
+            sp->mem_size = sizeof(ptrdiff_t);
+        }
+        else
+        {
+            cprintf_error("Error in calc_actual_width: Invalid length modifier for \%o, \%x, \%X, or \%u",
+                          EXIT_FAILURE);
+        }
+    }
+    else if (is(cs, "f") || is(cs, "F") || is(cs, "e") || is(cs, "E") ||
+             is(cs, "a") || is(cs, "A") || is(cs, "g") || is(cs, "G"))
+    {
+        if (is(lm, "l") || is(lm, ""))
+        {
+            sp->type = C_DOUBLE;
+            sp->mem_size = sizeof(double);
+        }
+        else if (is(lm, "L"))
+        {
+            sp->type = C_LONG_DOUBLE;
+            sp->mem_size = sizeof(long double);
+        }
+        else
+        {
+            cprintf_error("Error in calc_actual_width: Invalid length modifier for \%f, \%F, \%e, \%E, \%a, \%A, \%g, or \%G",
+                          EXIT_FAILURE);
+        }
+    }
+    else if (is(cs, "p"))
+    {
+        if (is(lm, ""))
+        {
+            sp->type = C_VOIDX;
+            sp->mem_size = sizeof(void *);
+        }
+        else
+        {
+            cprintf_error("Error in calc_actual_width: Invalid length modifier for \%p",
+                          EXIT_FAILURE);
+        }
+    }
+    else if (is(cs, "n"))     // This is a writeback
+    {
+        if (is(lm, ""))
+        {
+            sp->type = C_INT_PTR;
+            sp->mem_size = sizeof(int *);
+        }
+        else
+        {
+            cprintf_error("Error in calc_actual_width: Invalid length modifier for \%n",
+                          EXIT_FAILURE);
+        }
+    }
+    else
+    {
+        cprintf_error("Error in calc_actual_width: Invalid conversion specifier.",
+                      EXIT_FAILURE);
+    }
+
+    // Integer conversions without a precision or any flags that change the
+    // digits can be measured by counting digits instead of calling snprintf().
+    sp->min_width = strtoul(sp->field_width, NULL, 10);
+    sp->is_simple = strspn(cs, "diouxX") == 1 && is(sp->precision, "") &&
+                    strspn(sp->flags, "-0+ ") == strlen(sp->flags);
+
+    // Doubles are formatted without snprintf(), as long as the locale uses '.'.
+    sp->is_float = C_DOUBLE == sp->type && strspn(cs, "fFeEgGaA") == 1 &&
+                   strspn(sp->flags, "-0+ #") == strlen(sp->flags) &&
+                   0 == strcmp(localeconv()->decimal_point, ".");
+    sp->float_precision = (is(sp->precision, "")) ? 6 : strtoul(sp->precision + 1, NULL, 10);
+}
+
+struct format *parse_format(const char *fmt)
+{
+    struct format *f = calloc(1, sizeof(struct format));
+    struct spec *sp;
+    const char *p = fmt, *q = fmt;
+    ptrdiff_t d = 0;
+    ptrdiff_t span;
+    bool ptf = true;
+    size_t cap = 0;
+
+    if (NULL == f)
+    {
+        cprintf_error("Memory allocation failed.", EXIT_FAILURE);
+    }
+    archive(fmt, strlen(fmt), &(f->fmt));
+    f->specs = NULL;
+    f->next = NULL;
+    f->tabulate = true;
+
+    while (*p != '\0')
+    {
+        if (f->nspecs == cap)
+        {
+            cap = (cap) ? cap * 2 : 8;
+            sp = realloc(f->specs, cap * sizeof(struct spec));
+            if (NULL == sp)
+            {
+                cprintf_error("Memory allocation failed.", EXIT_FAILURE);
+            }
+            f->specs = sp;
+        }
+        sp = &f->specs[f->nspecs++];
+        memset(sp, 0, sizeof(struct spec));
+        sp->original_specification = NULL;
+        sp->flags                  = NULL;
+        sp->field_width            = NULL;
+        sp->precision              = NULL;
+        sp->length_modifier        = NULL;
+        sp->conversion_specifier   = NULL;
+        sp->ordinary_text          = NULL;
+        sp->dict                   = NULL;
+        sp->custom                 = NULL;
+
+        d = strcspn(p, "%");
+        q = p;
+        if (d == 0)
+        {
+            if (ptf != true)
+            {
+                f->tabulate = false;
+            }
+            ptf = false;
+            // We've found a conversion specification.
+            sp->is_conversion_specification = true;
+
+            q++; // Skip over initial '%'
+
+            // %&s borrows the string instead of copying it.
+            if ('&' == *q)
+            {
+                sp->is_borrowed = true;
+                q++;
+            }
+
+            span = parse_flags(q);
+            archive(q, span, &(sp->flags));
+            q += span;
+
+            span = parse_field_width(q);
+            archive(q, span, &(sp->field_width));
+            q += span;
+
+            span = parse_precision(q);
+            archive(q, span, &(sp->precision));
+            q += span;
+
+            span = parse_length_modifier(q);
+            archive(q, span, &(sp->length_modifier));
+            q += span;
+
+            span = parse_conversion_specifier(q);
+            archive(q, span, &(sp->conversion_specifier));
+            q += span;
+
+            if (span < 0)
+            {
+                cprintf_error("Error: Invalid conversion specifier.", EXIT_FAILURE);
+            }
+
+            archive(p, q - p, &(sp->original_specification));
+            if (sp->is_borrowed)
+            {
+                // printf() mustn't see the '&'.
+                memmove(sp->original_specification + 1, sp->original_specification + 2,
+                        strlen(sp->original_specification + 1));
+            }
+            resolve_type(sp);
+            if (sp->is_borrowed && C_CHARX != sp->type && C_WCHAR_TX != sp->type)
+            {
+                cprintf_error("Error: & only applies to %%s and %%ls.", EXIT_FAILURE);
+            }
+            if (C_CHARX == sp->type && !sp->is_borrowed)
+            {
+                sp->dict = calloc(1, sizeof(struct dict));
+                if (NULL == sp->dict)
+                {
+                    cprintf_error("Memory allocation failed.", EXIT_FAILURE);
+                }
+                sp->dict->slots = NULL;
+                sp->dict->entries = NULL;
+            }
+            f->nconversions++;
+            p = q;
+        }
+        else
+        {
+            // We've found some normal text.
+            ptf = true;
+            sp->is_conversion_specification = false;
+            archive(q, d, &(sp->ordinary_text));
+            sp->text_len = d;
+            q += d;
+            p = q;
+        }
+    }
+
+    f->conversions = calloc(f->nconversions + 1, sizeof(size_t));
+    if (NULL == f->conversions)
+    {
+        cprintf_error("Memory allocation failed.", EXIT_FAILURE);
+    }
+    for (size_t i = 0, j = 0; i < f->nspecs; i++)
+    {
+        if (f->specs[i].is_conversion_specification)
+        {
+            f->specs[i].conversion = j;
+            f->conversions[j++] = i;
+        }
+    }
+    apply_hidden(f);
+    return f;
+}
+
+// The format whose specifications include sp.
+struct format *format_of(const struct spec *sp)
+{
+    for (struct format *f = state->formats; NULL != f; f = f->next)
+    {
+        if (sp >= f->specs && sp < f->specs + f->nspecs)
+        {
+            return f;
+        }
+    }
+    return NULL;
+}
+
+// Returns the parsed form of fmt, parsing it the first time it is seen.
+// Tables rarely use more than a handful of formats, so a list kept in most
+// recently used order is plenty.
+struct format *lookup_format(const char *fmt)
+{
+    struct format *f = state->formats, *prev = NULL;
+
+    while (NULL != f)
+    {
+        if (f->fmt[0] == fmt[0] && 0 == strcmp(f->fmt, fmt))
+        {
+            if (NULL != prev)
+            {
+                prev->next = f->next;
+                f->next = state->formats;
+                state->formats = f;
+            }
+            return f;
+        }
+        prev = f;
+        f = f->next;
+    }
+
+    f = parse_format(fmt);
+    f->next = state->formats;
+    state->formats = f;
+    return f;
+}
+
+void free_formats(void)
+{
+    struct format *f = state->formats, *next;
+
+    while (NULL != f)
+    {
+        next = f->next;
+        for (size_t i = 0; i < f->nspecs; i++)
+        {
+            struct spec *sp = &f->specs[i];
+            free(sp->original_specification);
+            free(sp->flags);
+            free(sp->field_width);
+            free(sp->precision);
+            free(sp->length_modifier);
+            free(sp->conversion_specifier);
+            free(sp->ordinary_text);
+            if (NULL != sp->dict)
+            {
+                free(sp->dict->slots);
+                free(sp->dict->entries);
+                free(sp->dict);
+            }
+        }
+        free(f->specs);
+        free(f->conversions);
+        free(f->fmt);
+        free(f);
+        f = next;
+    }
+    state->formats = NULL;
+}
+
+static const uint64_t powers_of_ten[19] =
+{
+    10ULL, 100ULL, 1000ULL, 10000ULL, 100000ULL, 1000000ULL, 10000000ULL,
+    100000000ULL, 1000000000ULL, 10000000000ULL, 100000000000ULL,
+    1000000000000ULL, 10000000000000ULL, 100000000000000ULL,
+    1000000000000000ULL, 10000000000000000ULL, 100000000000000000ULL,
+    1000000000000000000ULL, 10000000000000000000ULL
+};
+
+// Branch-free so that loops over a column of values vectorize.
+static size_t decimal_digits(uint64_t v)
+{
+    size_t n = 1;
+    for (size_t i = 0; i < 19; i++)
+    {
+        n += (v >= powers_of_ten[i]);
+    }
+    return n;
+}
+
+// The magnitude of v as a simple integer conversion prints it, and in neg
+// whether it is negative.
+static uint64_t integer_magnitude(const struct spec *sp, const value *v, bool *neg)
+{
+    uint64_t u = 0;
+    int64_t i = 0;
+
+    *neg = false;
+    switch (sp->type)
+    {
+        case C_INT:
+            // hh and h values are converted back to char and short by printf().
+            if (sp->mem_size == 1)
+            {
+                i = (sp->is_signed) ? (signed char) v->c_int : (unsigned char) v->c_int;
+            }
+            else if (sp->mem_size == 2)
+            {
+                i = (sp->is_signed) ? (short) v->c_int : (unsigned short) v->c_int;
+            }
+            else
+            {
+                i = v->c_int;
+            }
+            break;
+        case C_LONG:
+            i = v->c_long;
+            break;
+        case C_LONG_LONG:
+            i = v->c_long_long;
+            break;
+        case C_INTMAX_T:
+            i = v->c_intmax_t;
+            break;
+        case C_SSIZE_T:
+            i = v->c_ssize_t;
+            break;
+        case C_PTRDIFF_T:
+            i = v->c_ptrdiff_t;
+            break;
+        case C_UNSIGNED_INT:
+            u = v->c_unsigned_int;
+            break;
+        case C_UNSIGNED_LONG:
+            u = v->c_unsigned_long;
+            break;
+        case C_UNSIGNED_LONG_LONG:
+            u = v->c_unsigned_long_long;
+            break;
+        case C_UINTMAX_T:
+            u = v->c_uintmax_t;
+            break;
+        case C_SIZE_T:
+            u = v->c_size_t;
+            break;
+        default:
+            break;
+    }
+    switch (sp->type)
+    {
+        case C_INT:
+        case C_LONG:
+        case C_LONG_LONG:
+        case C_INTMAX_T:
+        case C_SSIZE_T:
+        case C_PTRDIFF_T:
+            if (sp->is_signed)
+            {
+                *neg = i < 0;
+                u = (*neg) ? -(uint64_t) i : (uint64_t) i;
+            }
+            else if (sp->type == C_INT)
+            {
+                u = (unsigned int) i;
+            }
+            else
+            {
+                u = (uint64_t) i;
+            }
+            break;
+        default:
+            break;
+    }
+    return u;
+}
+
+// Width of a simple integer conversion of v, without calling snprintf().
+static size_t integer_width(const struct spec *sp, const value *v)
+{
+    bool neg;
+    uint64_t u = integer_magnitude(sp, v, &neg);
+    size_t n;
+
+    switch (sp->conversion_specifier[0])
+    {
+        case 'x':
+        case 'X':
+            for (n = 1; u >>= 4; n++)
+                ;
+            break;
+        case 'o':
+            for (n = 1; u >>= 3; n++)
+                ;
+            break;
+        default:
+            n = decimal_digits(u);
+            if (neg || (sp->is_signed && strpbrk(sp->flags, "+ ")))
+            {
+                n++;
+            }
+            break;
+    }
+    return (n > sp->min_width) ? n : sp->min_width;
+}
+
+static const double double_powers_of_ten[] =
+{
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+// Width of a plain %f or %e conversion of x, worked out from its magnitude,
+// or 0 if it takes formatting to tell: %g and %a, whose widths depend on
+// the digits, infinities, NaNs, values too large for the table above and
+// values so close to where rounding carries into another digit that the
+// estimate can't be trusted.
+static size_t float_width(const struct spec *sp, double x)
+{
+    size_t p = sp->float_precision, n;
+    uint64_t bits;
+
+    memcpy(&bits, &x, sizeof(bits));
+    if (0x7ff == (bits >> 52 & 0x7ff) || NULL == strchr("fFeE", sp->conversion_specifier[0]))
+    {
+        return 0;
+    }
+    x = (bits >> 63) ? -x : x;
+    n = ((bits >> 63) || strpbrk(sp->flags, "+ ")) ? 1 : 0;
+    n += (p > 0 || strchr(sp->flags, '#')) ? p + 1 : 0;
+
+    if ('e' == (sp->conversion_specifier[0] | 0x20))
+    {
+        // d.ddde+dd, with a third exponent digit from 1e100 up and 1e-99 down.
+        if ((x > 1e98 && x < 1e101) || (x > 1e-101 && x < 1e-98))
+        {
+            return 0;
+        }
+        n += 5 + (x >= 1e100 || (0 != x && x < 1e-99));
+    }
+    else
+    {
+        size_t d = 1;
+        double t;
+
+        if (x >= 1e21)
+        {
+            return 0;
+        }
+        while (x >= double_powers_of_ten[d])
+        {
+            d++;
+        }
+        // Rounding to p places carries into digit d + 1 from 10^d - 0.5e-p.
+        t = double_powers_of_ten[d] - ((p < 23) ? 0.5 / double_powers_of_ten[p] : 0);
+        if (x > t - t * 1e-15 && x < t + t * 1e-15)
+        {
+            return 0;
+        }
+        n += d + (x > t);
+    }
+    return (n > sp->min_width) ? n : sp->min_width;
+}
+
+// Work out how wide a's value prints with its original specification.
+static void measure(struct atom *a)
+{
+    struct strbuf *scratch = &measure_scratch;
+
+    if (a->spec->is_hidden)
+    {
+        a->original_field_width = 0;
+        a->is_deferred = true;    // Measured if the column is shown after all.
+        return;
+    }
+    a->is_deferred = false;
+    if (a->spec->is_simple)
+    {
+        a->original_field_width = integer_width(a->spec, &a->val);
+        return;
+    }
+    if (a->spec->is_float && 0 != (a->original_field_width = float_width(a->spec, a->val.c_double)))
+    {
+        return;
+    }
+    if (NULL != a->spec->custom && NULL != a->spec->custom->width)
+    {
+        struct cprintf_arg arg;
+        size_t w;
+
+        custom_arg(a->spec, &a->val, &arg);
+        w = a->spec->custom->width(&arg, custom_precision(a->spec));
+        a->original_field_width = (w > a->spec->min_width) ? w : a->spec->min_width;
+        return;
+    }
+
+    scratch->len = 0;
+    render_value(a, a->spec->original_specification, scratch);
+    a->original_field_width = scratch->len;
+
+    // printf() counts bytes, but a column has to line up in display cells.
+    if (is_text_conversion(a) &&
+        ascii_prefix(scratch->buf, scratch->len) != scratch->len)
+    {
+        measure_multibyte(a);
+    }
+}
+
+// Copy a's string into the table unless the caller lends it until cflush().
+static void keep_string(struct atom *a)
+{
+    if (borrow_strings || a->spec->is_borrowed)
+    {
+        return;
+    }
+    if (C_CHARX == a->type && NULL != a->val.c_charx)
+    {
+        a->val.c_charx = copy_string(a->val.c_charx, strlen(a->val.c_charx) + 1);
+    }
+    else if (C_WCHAR_TX == a->type && NULL != a->val.c_wchar_tx)
+    {
+        a->val.c_wchar_tx = copy_string(a->val.c_wchar_tx,
+                                        (wcslen(a->val.c_wchar_tx) + 1) * sizeof(wchar_t));
+    }
+}
+
+// Read the next argument from args as the type t of a conversion.
+static void fetch_value(type_t t, va_list *args, value *v)
+{
+    switch (t)
+    {
+        case C_INT:
+            v->c_int = va_arg(*args, int);
+            break;
+        case C_WINT_T:
+            v->c_wint_t = va_arg(*args, wint_t);
+            break;
+        case C_CHARX:
+            v->c_charx = va_arg(*args, char *);
+            break;
+        case C_WCHAR_TX:
+            v->c_wchar_tx = va_arg(*args, wchar_t *);
+            break;
+        case C_LONG:
+            v->c_long = va_arg(*args, long);
+            break;
+        case C_LONG_LONG:
+            v->c_long_long = va_arg(*args, long long);
+            break;
+        case C_INTMAX_T:
+            v->c_intmax_t = va_arg(*args, intmax_t);
+            break;
+        case C_SSIZE_T:
+            v->c_ssize_t = va_arg(*args, ssize_t);
+            break;
+        case C_PTRDIFF_T:
+            v->c_ptrdiff_t = va_arg(*args, ptrdiff_t);
+            break;
+        case C_UNSIGNED_INT:
+            v->c_unsigned_int = va_arg(*args, unsigned int);
+            break;
+        case C_UNSIGNED_LONG:
+            v->c_unsigned_long = va_arg(*args, unsigned long);
+            break;
+        case C_UNSIGNED_LONG_LONG:
+            v->c_unsigned_long_long = va_arg(*args, unsigned long long);
+            break;
+        case C_UINTMAX_T:
+            v->c_uintmax_t = va_arg(*args, uintmax_t);
+            break;
+        case C_SIZE_T:
+            v->c_size_t = va_arg(*args, size_t);
+            break;
+        case C_DOUBLE:
+            v->c_double = va_arg(*args, double);
+            break;
+        case C_LONG_DOUBLE:
+            v->c_long_double = va_arg(*args, long double);
+            break;
+        case C_VOIDX:
+            v->c_voidx = va_arg(*args, void *);
+            break;
+        case C_INT_PTR:    // This is a writeback
+            v->c_intp = va_arg(*args, int *);
+            break;
+        default:
+            cprintf_error("Error in fetch_value: Invalid conversion specifier.",
+                          EXIT_FAILURE);
+    }
+}
+
+// Double the slots of d and put its entries back in them.
+static void grow_dict(struct dict *d)
+{
+    size_t n = (d->nslots) ? d->nslots * 2 : 16;
+    uint32_t *slots = calloc(n, sizeof(uint32_t));
+    struct dict_entry *entries = realloc(d->entries, (n / 2) * sizeof(struct dict_entry));
+
+    if (NULL == slots || NULL == entries)
+    {
+        cprintf_error("Memory allocation failed.", EXIT_FAILURE);
+    }
+    for (size_t code = 0; code < d->count; code++)
+    {
+        size_t i = entries[code].hash & (n - 1);
+        while (0 != slots[i])
+        {
+            i = (i + 1) & (n - 1);
+        }
+        slots[i] = code + 1;
+    }
+    free(d->slots);
+    d->slots = slots;
+    d->nslots = n;
+    d->entries = entries;
+}
+
+// The entry of sp's dictionary for s, added if it is new. NULL when s
+// isn't kept there: it's borrowed, the dictionary is full, or the row is
+// being filled by another thread.
+static struct dict_entry *intern_string(const struct spec *sp, const char *s)
+{
+    struct dict *d = sp->dict;
+    struct dict_entry *e;
+    uint64_t h = UINT64_C(0xcbf29ce484222325);    // FNV-1a
+    size_t len, i, before;
+    struct atom tmp;
+
+    if (NULL == d || NULL == s || borrow_strings || sp->is_hidden || NULL != filling)
+    {
+        return NULL;
+    }
+    for (len = 0; '\0' != s[len]; len++)
+    {
+        h = (h ^ (unsigned char) s[len]) * UINT64_C(0x100000001b3);
+    }
+    for (i = (d->nslots) ? h & (d->nslots - 1) : 0; d->nslots > 0 && 0 != d->slots[i];
+         i = (i + 1) & (d->nslots - 1))
+    {
+        e = &d->entries[d->slots[i] - 1];
+        if (e->hash == h && 0 == memcmp(e->s, s, len + 1))
+        {
+            return e;
+        }
+    }
+    if (DICT_LIMIT == d->count)
+    {
+        return NULL;
+    }
+    if (2 * (d->count + 1) > d->nslots)
+    {
+        grow_dict(d);
+        for (i = h & (d->nslots - 1); 0 != d->slots[i]; i = (i + 1) & (d->nslots - 1))
+            ;
+    }
+
+    // Measure it once, leaving the multibyte total for each cell to add.
+    memset(&tmp, 0, sizeof(tmp));
+    tmp.spec = sp;
+    tmp.type = C_CHARX;
+    tmp.val.c_charx = copy_string(s, len + 1);
+    before = state->multibyte_excess;
+    measure(&tmp);
+
+    e = &d->entries[d->count];
+    e->hash = h;
+    e->s = tmp.val.c_charx;
+    e->width = tmp.original_field_width;
+    e->is_multibyte = tmp.is_multibyte;
+    e->excess = state->multibyte_excess - before;
+    state->multibyte_excess = before;
+    d->slots[i] = ++d->count;
+    return e;
+}
+
+// Store v as a's value and measure it, copying strings unless borrowed.
+static void store_value(struct atom *a, const value *v)
+{
+    struct dict_entry *e;
+
+    a->type = a->spec->type;
+    a->val = *v;
+    if (C_INT_PTR == a->type)    // This is a writeback
+    {
+        a->original_field_width = 0;
+        return;
+    }
+    if (C_CHARX == a->type && NULL != (e = intern_string(a->spec, a->val.c_charx)))
+    {
+        a->val.c_charx = e->s;
+        a->original_field_width = e->width;
+        a->is_multibyte = e->is_multibyte;
+        a->is_deferred = false;
+        state->multibyte_excess += e->excess;
+        return;
+    }
+    keep_string(a);
+    measure(a);
+}
+
+static void calc_actual_width(struct atom *a)
+{
+    value v;
+
+    if (a->is_dummy)
+    {
+        // Return early if this is a dummy atom. TODO: This isn't great fix it.
+        return;
+    }
+
+    // The type was resolved by resolve_type() when the format was parsed.
+    fetch_value(a->spec->type, a->pargs, &v);
+    store_value(a, &v);
+}
+
+// Copy one value of the type sp describes out of memory at p. Used by the
+// bulk entry points, where values are read in place rather than through
+// va_arg(), so hh, h and plain %c read a char or short rather than an int.
+static void load_value(const struct spec *sp, const char *p, value *v)
+{
+    switch (sp->type)
+    {
+        case C_INT:
+            if (sp->mem_size == 1)
+            {
+                if (sp->is_signed)
+                {
+                    signed char x;
+                    memcpy(&x, p, sizeof(x));
+                    v->c_int = x;
+                }
+                else
+                {
+                    unsigned char x;
+                    memcpy(&x, p, sizeof(x));
+                    v->c_int = x;
+                }
+            }
+            else if (sp->mem_size == 2)
+            {
+                if (sp->is_signed)
+                {
+                    short x;
+                    memcpy(&x, p, sizeof(x));
+                    v->c_int = x;
+                }
+                else
+                {
+                    unsigned short x;
+                    memcpy(&x, p, sizeof(x));
+                    v->c_int = x;
+                }
+            }
+            else
+            {
+                memcpy(&v->c_int, p, sizeof(int));
+            }
+            break;
+        case C_WINT_T:
+        {
+            wchar_t x;
+            memcpy(&x, p, sizeof(x));
+            v->c_wint_t = x;
+            break;
+        }
+        default:
+            // Everything else is stored in memory as the type printf() expects.
+            memcpy(v, p, sp->mem_size);
+            break;
+    }
+}
+
+// Count a cell of width w in column k's histogram of widths.
+void hist_add(struct column *k, size_t w)
+{
+    if (w >= k->hist_cap)
+    {
+        size_t n = (k->hist_cap) ? k->hist_cap : 16;
+        while (n <= w)
+        {
+            n *= 2;
+        }
+        size_t *h = realloc(k->hist, n * sizeof(size_t));
+        if (NULL == h)
+        {
+            cprintf_error("Memory allocation failed.", EXIT_FAILURE);
+        }
+        memset(h + k->hist_cap, 0, (n - k->hist_cap) * sizeof(size_t));
+        k->hist = h;
+        k->hist_cap = n;
+    }
+    k->hist[w]++;
+}
+
+// Take a cell of width w back out, narrowing the column if it was the
+// last of the widest.
+void hist_remove(struct column *k, size_t w)
+{
+    k->hist[w]--;
+    if (w == k->max_width)
+    {
+        while (k->max_width > 0 && (k->max_width >= k->hist_cap || 0 == k->hist[k->max_width]))
+        {
+            k->max_width--;
+        }
+    }
+}
+
+// The totals of column i, making room for them if need be.
+static struct column *column_at(size_t i)
+{
+    struct column *k;
+
+    if (i >= state->ncolumns)
+    {
+        size_t n = (state->ncolumns) ? state->ncolumns * 2 : 16;
+        while (n <= i)
+        {
+            n *= 2;
+        }
+        k = realloc(state->columns, n * sizeof(struct column));
+        if (NULL == k)
+        {
+            cprintf_error("Memory allocation failed.", EXIT_FAILURE);
+        }
+        memset(k + state->ncolumns, 0, (n - state->ncolumns) * sizeof(struct column));
+        state->columns = k;
+        state->ncolumns = n;
+    }
+    if (i >= state->used_columns)
+    {
+        state->used_columns = i + 1;
+    }
+    return &state->columns[i];
+}
+
+// Fold a freshly captured atom into its column's running totals.
+void account_atom(struct atom *a)
+{
+    struct column *k = column_at(a->column);
+
+    if (a->spec->is_hidden)
+    {
+        return;
+    }
+
+    // Only the first atom of a column decides whether it gets justified.
+    if (a->up->is_dummy)
+    {
+        k->is_conversion_specification = a->is_conversion_specification;
+    }
+
+    if (a->is_conversion_specification)
+    {
+        if (a->original_field_width > k->max_width)
+        {
+            k->max_width = a->original_field_width;
+        }
+        if (state->indexed)
+        {
+            hist_add(k, a->original_field_width);
+        }
+        if (nfooters > 0 && !adding_footers)
+        {
+            accumulate(a);
+        }
+        if (a->type != C_INT_PTR)    // %n doesn't print anything
+        {
+            k->width_sum += a->original_field_width;
+            k->count++;
+        }
+    }
+    else
+    {
+        state->text_bytes += a->spec->text_len;
+    }
+}
+
+// Undo account_atom(a) before a is changed or removed.
+void unaccount_atom(struct atom *a)
+{
+    struct column *k = &state->columns[a->column];
+    size_t cells;
+
+    if (a->spec->is_hidden)
+    {
+        return;
+    }
+    if (a->is_conversion_specification)
+    {
+        if (a->is_multibyte)
+        {
+            state->multibyte_excess -= multibyte_excess_of(a, &cells);
+        }
+        if (a->spec->conversion < nfooters && footers[a->spec->conversion].ops)
+        {
+            footer_dirty = true;    // A minimum or maximum can't be taken back.
+        }
+        if (a->type != C_INT_PTR)
+        {
+            k->width_sum -= a->original_field_width;
+            k->count--;
+        }
+        hist_remove(k, a->original_field_width);
+    }
+    else
+    {
+        state->text_bytes -= a->spec->text_len;
+    }
+}
+
+// Number of bytes cflush() will write for the table captured so far.
+size_t rendered_size(void)
+{
+    merge_tables();
+    size_t n = state->text_bytes + state->multibyte_excess + state->repeat_bytes;
+    for (size_t i = 0; i < state->ncolumns; i++)
+    {
+        struct column *k = &state->columns[i];
+        if (do_tabulate && k->is_conversion_specification)
+        {
+            n += k->max_width * k->count;
+        }
+        else
+        {
+            n += k->width_sum;
+        }
+    }
+    return n;
+}
+
+static int compare_widths(const void *a, const void *b)
+{
+    size_t x = *(const size_t *) a, y = *(const size_t *) b;
+    return (x > y) - (x < y);
+}
+
+// Width of the column that starts at a once caps are applied. Truncated or
+// wrapped conversions count for no more than their cap; conversions under a
+// percentile policy only count up to that percentile of their widths.
+static size_t capped_width(struct atom *a, size_t max)
+{
+    size_t w = 0, n = 0, cap = 0;
+    size_t *widths = NULL;
+    double percentile = 0;
+    bool capped = false;
+
+    for (struct atom *c = a; c->is_dummy == false; c = c->down)
+    {
+        const struct cap *cp;
+        size_t cw = c->original_field_width;
+
+        if (!c->is_conversion_specification || c->spec->is_hidden)
+        {
+            continue;
+        }
+        cp = cap_for(c);
+        if (NULL == cp)
+        {
+            w = (cw > w) ? cw : w;
+            continue;
+        }
+        capped = true;
+        if (CPRINTF_CAP_PERCENTILE == cp->policy)
+        {
+            if (n == cap)
+            {
+                cap = (cap) ? cap * 2 : 256;
+                widths = realloc(widths, cap * sizeof(size_t));
+                if (NULL == widths)
+                {
+                    cprintf_error("Memory allocation failed.", EXIT_FAILURE);
+                }
+            }
+            widths[n++] = cw;
+            percentile = (cp->percentile > percentile) ? cp->percentile : percentile;
+        }
+        else
+        {
+            cw = (cw < cp->width) ? cw : cp->width;
+            w = (cw > w) ? cw : w;
+        }
+    }
+    if (n > 0)
+    {
+        size_t k = (size_t)(percentile / 100.0 * n + 0.999999);
+        qsort(widths, n, sizeof(size_t), compare_widths);
+        k = (k > n) ? n : (k < 1) ? 1 : k;
+        w = (widths[k - 1] > w) ? widths[k - 1] : w;
+    }
+    free(widths);
+    return (capped) ? w : max;
+}
+
+void calc_max_width()
+{
+    // Really can't remember why I put this here but it can't hurt
+    if (NULL == state)
+    {
+        cprintf_error("Error in calc_max_width: state/empty is null.", EXIT_FAILURE);
+    }
+    struct atom *aiter = state->origin, *citer, *diter; //A is the top dummy
+    if (NULL == aiter)
+    {
+        cprintf_error("Error in calc_max_width: origin is null.", EXIT_FAILURE);
+    }
+    diter = top_left_finder_safe();
+
+    // The widest atom of each column was tracked by account_atom() as the
+    // table was captured, so one walk down each column is enough.
+    while (NULL != diter)
+    {
+        aiter = diter->down;
+        if (aiter->is_dummy)
+        {
+            diter = diter->right;    // Every row with this column was dropped.
+            continue;
+        }
+        bool justify = state->columns[aiter->column].is_conversion_specification;
+        size_t w = state->columns[aiter->column].max_width;
+
+        if (justify && caps_set)
+        {
+            w = capped_width(aiter, w);
+        }
+
+        citer = aiter;
+        while (citer->is_dummy == false)  // makes clean up easier
+        {
+            // Conversions in columns headed by ordinary text keep their own width.
+            citer->new_field_width = (justify) ? w : citer->original_field_width;
+            citer = citer->down;
+        }
+        diter = diter->right;
+    }
+}
+
+// Build the specification conversion c prints with at its new field width.
+static void respecify(struct atom *c)
+{
+    char buf[4099];
+    int rc;
+
+    rc = snprintf(buf, 4099, "%%%s%zu%s%s%s", c->spec->flags, c->new_field_width,
+                  c->spec->precision, c->spec->length_modifier,
+                  c->spec->conversion_specifier);
+    if (rc > 4099)
+    {
+        cprintf_error("Error in generate_new_specs: snprintf truncated.", EXIT_FAILURE);
+    }
+    if (NULL != c->new_specification && strlen(c->new_specification) >= (size_t) rc)
+    {
+        memcpy(c->new_specification, buf, rc + 1);    // Retained atom.
+    }
+    else
+    {
+        free(c->new_specification);
+        archive(buf, rc, &(c->new_specification));
+    }
+}
+
+void generate_new_specs()
+{
+    struct atom *a = top_left_finder_safe(), *c; //A is the top dummy row.
+    if (NULL == a)
+    {
+        cprintf_error("Error in generate_new_specs: origin is null.", EXIT_FAILURE);
+    }
+    while (NULL != a)
+    {
+        c = a;
+        while (NULL != c)
+        {
+            if (c->is_conversion_specification && !c->spec->is_hidden)
+            {
+                respecify(c);
+            }
+            c = c->down;
+        }
+        a = a->right;
+    }
+}
+
+// What calc_max_width() and generate_new_specs() do for the whole table,
+// for just the row starting at a. Widths mustn't be capped.
+static void justify_row(struct atom *a)
+{
+    for (struct atom *c = a; NULL != c; c = c->right)
+    {
+        if (c->is_conversion_specification)
+        {
+            const struct column *k = &state->columns[c->column];
+
+            c->new_field_width = (k->is_conversion_specification) ? k->max_width :
+                                 c->original_field_width;
+            if (!c->spec->is_hidden)
+            {
+                respecify(c);
+            }
+        }
+    }
+}
+
+void calculate_writeback(struct atom *a)
+{
+    // Calculate writeback handles %n specifiers traversing right to left summing up the field widths
+    // and then writing back the total to the pointer
+    int sum = 0;
+    for (struct atom *c = a; NULL != c; c = c->left)
+    {
+        if (c->spec->is_hidden)
+        {
+            continue;
+        }
+        if (c->is_conversion_specification)
+        {
+            sum += c->new_field_width;
+        }
+        else if (c->spec && c->spec->ordinary_text)
+        {
+            sum += c->spec->text_len;
+        }
+        else
+        {
+            cprintf_error("Error in calculate_writeback: atom is neither conversion specification nor ordinary text.",
+                          EXIT_FAILURE);
+        }
+    }
+    if (a->val.c_intp != NULL)
+    {
+        *a->val.c_intp = sum; //Writeback
+    }
+    else
+    {
+        // handle error
+        fprintf(stderr, "Error: a->val.c_intp is NULL\n");
+    }
+}
+
+// Hand rendered bytes to wherever this table is going.
+void emit(const char *buf, size_t len)
+{
+    if (state->to_buffer)
+    {
+        // Behave like snprintf(): keep counting past the end of the buffer.
+        if (state->dest_len + 1 < state->dest_size)
+        {
+            size_t room = state->dest_size - state->dest_len - 1;
+            memcpy(state->dest_str + state->dest_len, buf, (len < room) ? len : room);
+        }
+        state->dest_len += len;
+    }
+    else if (pwrite_fd >= 0)
+    {
+        // Batch rows up so we aren't making a system call per row.
+        sb_append(&state->pending, buf, len);
+        if (state->pending.len >= (1 << 20))
+        {
+            write_pending();
+        }
+    }
+    else if (NULL != sink_fn)
+    {
+        sink_fn(buf, len, sink_ctx);
+    }
+    else
+    {
+        fwrite(buf, 1, len, state->dest);
+    }
+
+    // The row is only rendered once however many copies are wanted.
+    for (size_t i = 0; i < noutputs; i++)
+    {
+        if (CPRINTF_TEXT == outputs[i].kind)
+        {
+            fwrite(buf, 1, len, outputs[i].stream);
+        }
+    }
+}
+
+void write_pending(void)
+{
+    size_t done = 0;
+    ssize_t rc;
+
+    while (done < state->pending.len)
+    {
+        rc = pwrite(pwrite_fd, state->pending.buf + done, state->pending.len - done,
+                    pwrite_offset + state->dest_len + done);
+        if (rc < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (rc <= 0)
+        {
+            cprintf_error("Error in %s: pwrite failed: %s", __PRETTY_FUNCTION__, strerror(errno));
+        }
+        done += rc;
+    }
+    state->dest_len += done;
+    state->pending.len = 0;
+}
+
+const struct cap *cap_for(const struct atom *a)
+{
+    if (a->spec->conversion < ncaps && CPRINTF_CAP_NONE != caps[a->spec->conversion].policy)
+    {
+        return &caps[a->spec->conversion];
+    }
+    return (CPRINTF_CAP_NONE != global_cap.policy) ? &global_cap : NULL;
+}
+
+// Whether c is wider than its column and has to be cut to fit.
+static bool is_cut(const struct atom *c)
+{
+    const struct cap *cp;
+
+    if (!caps_set || do_tabulate == false || !c->is_conversion_specification ||
+        c->original_field_width <= c->new_field_width)
+    {
+        return false;
+    }
+    cp = cap_for(c);
+    return NULL != cp && (CPRINTF_CAP_TRUNCATE == cp->policy || CPRINTF_CAP_WRAP == cp->policy);
+}
+
+// Append line (counting from 0) of c cut to its column's width: the first
+// line with an ellipsis when truncating, or successive slices of the text
+// when wrapping. Returns true if wrapped text continues on another line.
+bool render_piece(struct atom *c, size_t line, struct strbuf *sb)
+{
+    struct strbuf *text = &piece_scratch;
+    bool wrap = (CPRINTF_CAP_WRAP == cap_for(c)->policy);
+    size_t width = c->new_field_width, cells = 0, off = 0, n = 0, pad;
+    char spec[64];
+
+    text->len = 0;
+    unpadded_specification(c, spec, sizeof(spec));
+    render_value(c, spec, text);
+
+    if (wrap)
+    {
+        for (size_t i = 0; i <= line && off < text->len; i++)
+        {
+            off += n;
+            n = fit_cells(text->buf + off, text->len - off, width, &cells);
+            if (0 == n && off < text->len)
+            {
+                n = next_char((const unsigned char *) text->buf, text->len, off, &cells);
+            }
+        }
+        if (off >= text->len)
+        {
+            n = 0;
+            cells = 0;
+        }
+    }
+    else if (0 == line)
+    {
+        n = fit_cells(text->buf, text->len, (width > 3) ? width - 3 : width, &cells);
+    }
+
+    pad = (width > cells) ? width - cells : 0;
+    if (!wrap && 0 == line && width > 3)
+    {
+        pad -= 3;
+    }
+    if (NULL == strchr(c->spec->flags, '-'))
+    {
+        sb_reserve(sb, pad);
+        memset(sb->buf + sb->len, ' ', pad);
+        sb->len += pad;
+        pad = 0;
+    }
+    sb_append(sb, text->buf + off, n);
+    if (!wrap && 0 == line && width > 3)
+    {
+        sb_append(sb, "...", 3);
+    }
+    sb_reserve(sb, pad);
+    memset(sb->buf + sb->len, ' ', pad);
+    sb->len += pad;
+    sb->buf[sb->len] = '\0';
+
+    return wrap && off + n < text->len;
+}
+
+// Append the rendered text of the atom c to sb.
+void render_cell(struct atom *c, struct strbuf *sb)
+{
+    if (c->spec->is_hidden)
+    {
+        return;
+    }
+    if (is_cut(c))
+    {
+        render_piece(c, 0, sb);
+    }
+    else if (c->is_conversion_specification)
+    {
+        if (c->is_multibyte)
+        {
+            render_padded_by_cells(c, (do_tabulate) ? c->new_field_width :
+                                   c->original_field_width, sb);
+        }
+        else
+        {
+            render_value(c, (do_tabulate) ? c->new_specification :
+                         c->spec->original_specification, sb);
+        }
+    }
+    else if (c->is_dummy == false)
+    {
+        sb_append(sb, c->spec->ordinary_text, c->spec->text_len);
+    }
+}
+
+// Append the rendered text of the row starting at a to sb.
+void render_row(struct atom *a, struct strbuf *sb)
+{
+    struct atom *c = a;
+    bool more = false;
+    size_t start = sb->len;
+
+    while (NULL != c)
+    {
+        if (is_cut(c))
+        {
+            more |= render_piece(c, 0, sb);
+        }
+        else
+        {
+            render_cell(c, sb);
+        }
+        c = c->right;
+    }
+
+    // A collapsed row says how many copies it stands for at the end of its
+    // first line.
+    if (a->repeats > 0)
+    {
+        char note[32];
+        size_t n = repeat_note(a->repeats + 1, note, sizeof(note));
+        bool newline = sb->len > start && '\n' == sb->buf[sb->len - 1];
+
+        sb->len -= newline;
+        sb_append(sb, note, n);
+        if (newline)
+        {
+            sb_append(sb, "\n", 1);
+        }
+    }
+
+    // Wrapped cells continue on lines of their own, with everything else in
+    // the row left blank.
+    for (size_t line = 1; more; line++)
+    {
+        more = false;
+        for (c = a; NULL != c; c = c->right)
+        {
+            size_t blank;
+
+            if (c->spec->is_hidden)
+            {
+                continue;
+            }
+            if (is_cut(c))
+            {
+                more |= render_piece(c, line, sb);
+                continue;
+            }
+            if (c->is_conversion_specification)
+            {
+                blank = (do_tabulate && c->new_field_width > c->original_field_width) ?
+                        c->new_field_width : c->original_field_width;
+            }
+            else
+            {
+                blank = display_width(c->spec->ordinary_text, strcspn(c->spec->ordinary_text, "\n"));
+            }
+            sb_reserve(sb, blank);
+            memset(sb->buf + sb->len, ' ', blank);
+            sb->len += blank;
+            if (!c->is_conversion_specification && NULL != strchr(c->spec->ordinary_text, '\n'))
+            {
+                sb_append(sb, "\n", 1);
+            }
+        }
+    }
+}
+
+// Whether rows of f can be kept by pack_row(): every conversion prints an
+// integer, a double or a string the table keeps, and none is hidden.
+static bool is_packable(const struct format *f)
+{
+    for (size_t i = 0; i < f->nspecs; i++)
+    {
+        const struct spec *sp = &f->specs[i];
+
+        if (sp->is_hidden)
+        {
+            return false;
+        }
+        if (!sp->is_conversion_specification)
+        {
+            continue;
+        }
+        switch (sp->type)
+        {
+            case C_INT:
+            case C_LONG:
+            case C_LONG_LONG:
+            case C_INTMAX_T:
+            case C_SSIZE_T:
+            case C_PTRDIFF_T:
+            case C_UNSIGNED_INT:
+            case C_UNSIGNED_LONG:
+            case C_UNSIGNED_LONG_LONG:
+            case C_UINTMAX_T:
+            case C_SIZE_T:
+            case C_DOUBLE:
+                break;
+            case C_CHARX:
+                if (NULL == sp->dict || borrow_strings)
+                {
+                    return false;
+                }
+                break;
+            default:
+                return false;
+        }
+    }
+    return true;
+}
+
+// An integer value as 64 bits, sign extended.
+static uint64_t integer_bits(type_t t, const value *v)
+{
+    switch (t)
+    {
+        case C_INT:
+            return (uint64_t) (int64_t) v->c_int;
+        case C_LONG:
+            return (uint64_t) (int64_t) v->c_long;
+        case C_LONG_LONG:
+            return (uint64_t) (int64_t) v->c_long_long;
+        case C_INTMAX_T:
+            return (uint64_t) (int64_t) v->c_intmax_t;
+        case C_SSIZE_T:
+            return (uint64_t) (int64_t) v->c_ssize_t;
+        case C_PTRDIFF_T:
+            return (uint64_t) (int64_t) v->c_ptrdiff_t;
+        case C_UNSIGNED_INT:
+            return v->c_unsigned_int;
+        case C_UNSIGNED_LONG:
+            return v->c_unsigned_long;
+        case C_UNSIGNED_LONG_LONG:
+            return v->c_unsigned_long_long;
+        case C_UINTMAX_T:
+            return v->c_uintmax_t;
+        case C_SIZE_T:
+            return v->c_size_t;
+        default:
+            return 0;
+    }
+}
+
+// The inverse of integer_bits().
+static void set_integer(type_t t, uint64_t u, value *v)
+{
+    switch (t)
+    {
+        case C_INT:
+            v->c_int = (int) (int64_t) u;
+            break;
+        case C_LONG:
+            v->c_long = (long) (int64_t) u;
+            break;
+        case C_LONG_LONG:
+            v->c_long_long = (long long) (int64_t) u;
+            break;
+        case C_INTMAX_T:
+            v->c_intmax_t = (intmax_t) (int64_t) u;
+            break;
+        case C_SSIZE_T:
+            v->c_ssize_t = (ssize_t) (int64_t) u;
+            break;
+        case C_PTRDIFF_T:
+            v->c_ptrdiff_t = (ptrdiff_t) (int64_t) u;
+            break;
+        case C_UNSIGNED_INT:
+            v->c_unsigned_int = (unsigned int) u;
+            break;
+        case C_UNSIGNED_LONG:
+            v->c_unsigned_long = (unsigned long) u;
+            break;
+        case C_UNSIGNED_LONG_LONG:
+            v->c_unsigned_long_long = u;
+            break;
+        case C_UINTMAX_T:
+            v->c_uintmax_t = u;
+            break;
+        case C_SIZE_T:
+            v->c_size_t = (size_t) u;
+            break;
+        default:
+            break;
+    }
+}
+
+// Append the low n bits of v to pc, most significant first.
+static void put_bits(struct packed_column *pc, uint64_t v, unsigned n)
+{
+    while (n > 0)
+    {
+        unsigned room, take;
+
+        if (0 == pc->bits)
+        {
+            sb_append(&pc->bytes, "", 1);
+        }
+        room = 8 - pc->bits;
+        take = (n < room) ? n : room;
+        pc->bytes.buf[pc->bytes.len - 1] |= ((v >> (n - take)) & ((1u << take) - 1)) << (room - take);
+        pc->bits = (pc->bits + take) & 7;
+        n -= take;
+    }
+}
+
+static uint64_t get_bits(const struct packed_column *pc, struct packed_reader *r, unsigned n)
+{
+    uint64_t v = 0;
+
+    while (n > 0)
+    {
+        unsigned room = 8 - (r->bit & 7);
+        unsigned take = (n < room) ? n : room;
+        unsigned char byte = (unsigned char) pc->bytes.buf[r->bit >> 3];
+
+        v = (v << take) | ((byte >> (room - take)) & ((1u << take) - 1));
+        r->bit += take;
+        n -= take;
+    }
+    return v;
+}
+
+static void put_varint(struct packed_column *pc, uint64_t d)
+{
+    while (d >= 0x80)
+    {
+        put_bits(pc, 0x80 | (d & 0x7f), 8);
+        d >>= 7;
+    }
+    put_bits(pc, d, 8);
+}
+
+static uint64_t get_varint(const struct packed_column *pc, struct packed_reader *r)
+{
+    uint64_t d = 0;
+
+    for (unsigned shift = 0; ; shift += 7)
+    {
+        uint64_t byte = get_bits(pc, r, 8);
+        d |= (byte & 0x7f) << shift;
+        if (byte < 0x80)
+        {
+            return d;
+        }
+    }
+}
+
+// Add one value to pc; a string by its code in sp's dictionary.
+static void encode_value(struct packed_column *pc, const struct spec *sp, const value *v,
+                         uint32_t code)
+{
+    uint64_t x, d;
+    unsigned lead, trail;
+
+    if (C_CHARX == sp->type)
+    {
+        put_varint(pc, code);
+        return;
+    }
+    if (C_DOUBLE != sp->type)
+    {
+        x = integer_bits(sp->type, v);
+        d = x - pc->last;
+        d = (d << 1) ^ (uint64_t) ((int64_t) d >> 63);    // Zigzag: small either way.
+        pc->last = x;
+        put_varint(pc, d);
+        return;
+    }
+
+    memcpy(&x, &v->c_double, sizeof(x));
+    d = x ^ pc->last;
+    pc->last = x;
+    if (0 == d)
+    {
+        put_bits(pc, 0, 1);    // Same as the previous value.
+        return;
+    }
+    lead = __builtin_clzll(d);
+    trail = __builtin_ctzll(d);
+    lead = (lead > 31) ? 31 : lead;
+    if (pc->lead + pc->trail > 0 && lead >= pc->lead && trail >= pc->trail)
+    {
+        put_bits(pc, 2, 2);    // Fits the previous window.
+        put_bits(pc, d >> pc->trail, 64 - pc->lead - pc->trail);
+        return;
+    }
+    put_bits(pc, 3, 2);
+    put_bits(pc, lead, 5);
+    put_bits(pc, 63 - lead - trail, 6);    // Length less one.
+    put_bits(pc, d >> trail, 64 - lead - trail);
+    pc->lead = lead;
+    pc->trail = trail;
+}
+
+// Read the next value from pc.
+static void decode_value(const struct packed_column *pc, struct packed_reader *r,
+                         const struct spec *sp, value *v)
+{
+    uint64_t d = 0;
+
+    if (C_CHARX == sp->type)
+    {
+        v->c_charx = sp->dict->entries[get_varint(pc, r)].s;
+        return;
+    }
+    if (C_DOUBLE != sp->type)
+    {
+        d = get_varint(pc, r);
+        r->last += (d >> 1) ^ (0 - (d & 1));
+        set_integer(sp->type, r->last, v);
+        return;
+    }
+
+    if (0 != get_bits(pc, r, 1))
+    {
+        if (0 != get_bits(pc, r, 1))
+        {
+            r->lead = get_bits(pc, r, 5);
+            r->trail = 63 - r->lead - get_bits(pc, r, 6);
+        }
+        d = get_bits(pc, r, 64 - r->lead - r->trail) << r->trail;
+    }
+    r->last ^= d;
+    memcpy(&v->c_double, &r->last, sizeof(double));
+}
+
+// Count a packed row of f into the column totals, as account_atom() would
+// for its atoms. Strings were measured when they were interned.
+static void account_packed(const struct format *f, const value *vals, const uint32_t *codes)
+{
+    size_t used = state->used_columns;
+    struct atom tmp;    // measure() only looks at the spec and the value.
+
+    memset(&tmp, 0, sizeof(tmp));
+    tmp.spec = NULL;
+    state->nrows++;
+    for (size_t i = 0; i < f->nspecs; i++)
+    {
+        const struct spec *sp = &f->specs[i];
+        struct column *k = column_at(i);
+
+        if (i >= used)
+        {
+            k->is_conversion_specification = sp->is_conversion_specification;
+        }
+        if (!sp->is_conversion_specification)
+        {
+            state->text_bytes += sp->text_len;
+            continue;
+        }
+        tmp.spec = sp;
+        tmp.type = sp->type;
+        tmp.is_conversion_specification = true;
+        tmp.val = vals[sp->conversion];
+        if (C_CHARX == sp->type)
+        {
+            tmp.original_field_width = sp->dict->entries[codes[sp->conversion]].width;
+        }
+        else
+        {
+            measure(&tmp);
+        }
+        if (tmp.original_field_width > k->max_width)
+        {
+            k->max_width = tmp.original_field_width;
+        }
+        k->width_sum += tmp.original_field_width;
+        k->count++;
+        if (nfooters > 0)
+        {
+            accumulate(&tmp);
+        }
+    }
+}
+
+// In compact mode, keep a row of f holding vals encoded instead of building
+// its atoms, if nothing needs them until cflush().
+static bool pack_row(struct format *f, const value *vals)
+{
+    struct packed *p = state->packed;
+
+    if (!compact_rows || collapse_rows || retain_mode || NULL != state->cursor ||
+        state->indexed || !is_packable(f))
+    {
+        return false;
+    }
+
+    // Strings have to be in their dictionaries, and line up by bytes.
+    if (f->nconversions > 0)
+    {
+        uint32_t *codes = realloc(state->row_codes, f->nconversions * sizeof(uint32_t));
+        if (NULL == codes)
+        {
+            cprintf_error("Memory allocation failed.", EXIT_FAILURE);
+        }
+        state->row_codes = codes;
+    }
+    for (size_t j = 0; j < f->nconversions; j++)
+    {
+        const struct spec *sp = &f->specs[f->conversions[j]];
+        struct dict_entry *e;
+
+        state->row_codes[j] = 0;
+        if (C_CHARX != sp->type)
+        {
+            continue;
+        }
+        e = intern_string(sp, vals[j].c_charx);
+        if (NULL == e || e->is_multibyte)
+        {
+            return false;
+        }
+        state->row_codes[j] = e - sp->dict->entries;
+    }
+    if (NULL != p && p->f != f)
+    {
+        unpack_rows();
+        p = NULL;
+    }
+    if (NULL == p)
+    {
+        p = calloc(1, sizeof(struct packed));
+        if (NULL == p || NULL == (p->columns = calloc(f->nconversions + 1, sizeof(struct packed_column))))
+        {
+            cprintf_error("Memory allocation failed.", EXIT_FAILURE);
+        }
+        p->f = f;
+        state->packed = p;
+    }
+    for (size_t j = 0; j < f->nconversions; j++)
+    {
+        encode_value(&p->columns[j], &f->specs[f->conversions[j]], &vals[j], state->row_codes[j]);
+    }
+    p->nrows++;
+    account_packed(f, vals, state->row_codes);
+    return true;
+}
+
+void free_packed(struct packed *p)
+{
+    if (NULL == p)
+    {
+        return;
+    }
+    for (size_t j = 0; j < p->f->nconversions; j++)
+    {
+        free(p->columns[j].bytes.buf);
+    }
+    free(p->columns);
+    free(p);
+}
+
+// Turn the packed rows into atoms at the bottom of the graph, for code that
+// needs them. They were accounted when they were captured.
+void unpack_rows(void)
+{
+    struct packed *p = state->packed;
+    struct packed_reader *readers;
+    struct format *f;
+
+    if (NULL == p)
+    {
+        return;
+    }
+    f = p->f;
+    state->packed = NULL;
+    state->nrows -= p->nrows;    // create_atom() counts them again.
+    readers = calloc(f->nconversions + 1, sizeof(struct packed_reader));
+    if (NULL == readers)
+    {
+        cprintf_error("Memory allocation failed.", EXIT_FAILURE);
+    }
+    for (size_t r = 0; r < p->nrows; r++)
+    {
+        struct atom *row = NULL;
+
+        for (size_t i = 0; i < f->nspecs; i++)
+        {
+            struct atom *a = create_atom(i == 0);
+            row = (0 == i) ? a : row;
+            a->spec = &f->specs[i];
+            a->is_conversion_specification = a->spec->is_conversion_specification;
+            if (a->is_conversion_specification)
+            {
+                size_t j = a->spec->conversion;
+                value v;
+
+                decode_value(&p->columns[j], &readers[j], a->spec, &v);
+                store_value(a, &v);
+            }
+        }
+        if (NULL != row)
+        {
+            note_sort_key(f, row);
+        }
+    }
+    free(readers);
+    free_packed(p);
+}
+
+// Whether cflush() can print the packed rows as they are: nothing it is
+// going to do needs their atoms.
+static bool packed_printable(void)
+{
+    return sort_column < 0 && 0 == noutputs && 0 == nfooters && !live_mode && !caps_set &&
+           !retain_mode && is_packable(state->packed->f);
+}
+
+// The specification each conversion of the packed rows prints with: the
+// width calc_max_width() would have given it, or NULL for the original.
+static char **packed_specs(const struct format *f)
+{
+    char **specs = calloc(f->nconversions + 1, sizeof(char *));
+
+    if (NULL == specs)
+    {
+        cprintf_error("Memory allocation failed.", EXIT_FAILURE);
+    }
+    for (size_t j = 0; j < f->nconversions; j++)
+    {
+        const struct spec *sp = &f->specs[f->conversions[j]];
+        const struct column *k = &state->columns[f->conversions[j]];
+        char buf[4099];
+        int rc;
+
+        if (do_tabulate && k->is_conversion_specification)
+        {
+            rc = snprintf(buf, sizeof(buf), "%%%s%zu%s%s%s", sp->flags, k->max_width,
+                          sp->precision, sp->length_modifier, sp->conversion_specifier);
+            archive(buf, rc, &specs[j]);
+        }
+    }
+    return specs;
+}
+
+static void free_packed_specs(const struct format *f, char **specs)
+{
+    for (size_t j = 0; j < f->nconversions; j++)
+    {
+        free(specs[j]);
+    }
+    free(specs);
+}
+
+// Append the text of a row of f holding vals to sb, each conversion printed
+// with its entry in specs or, if that is NULL, its original specification.
+static void render_values(const struct format *f, const value *vals, char *const *specs,
+                          struct strbuf *sb)
+{
+    struct atom tmp;    // render_value() only looks at the spec and the value.
+
+    memset(&tmp, 0, sizeof(tmp));
+    for (size_t i = 0; i < f->nspecs; i++)
+    {
+        const struct spec *sp = &f->specs[i];
+
+        if (!sp->is_conversion_specification)
+        {
+            sb_append(sb, sp->ordinary_text, sp->text_len);
+            continue;
+        }
+        tmp.spec = sp;
+        tmp.type = sp->type;
+        tmp.val = vals[sp->conversion];
+        render_value(&tmp, (NULL != specs[sp->conversion]) ? specs[sp->conversion] :
+                     sp->original_specification, sb);
+    }
+}
+
+// Decode the next packed row with readers into vals.
+static void decode_row(const struct packed *p, struct packed_reader *readers, value *vals)
+{
+    const struct format *f = p->f;
+
+    for (size_t j = 0; j < f->nconversions; j++)
+    {
+        decode_value(&p->columns[j], &readers[j], &f->specs[f->conversions[j]], &vals[j]);
+    }
+}
+
+// Decode the next packed row with readers into vals and append its text to sb.
+static void render_packed_row(const struct packed *p, struct packed_reader *readers, value *vals,
+                              char *const *specs, struct strbuf *sb)
+{
+    decode_row(p, readers, vals);
+    render_values(p->f, vals, specs, sb);
+}
+
+// The text and blanks every row of a format prints as once the column
+// widths are fixed, with a slot of known offset and width per conversion.
+// A row is rendered by copying the text and writing each cell into its
+// slot, instead of piece by piece.
+struct row_template
+{
+    const struct format *f;      // The format whose rows it renders.
+    char *text;                  // NULL if they can't be rendered this way.
+    size_t len;
+    size_t *slots;               // Offset of each conversion's slot.
+    size_t *widths;
+    unsigned char *kinds;        // SLOT_*: how each conversion is written.
+    char **specs;                // What each conversion prints with.
+    struct row_template *next;
+};
+
+enum
+{
+    SLOT_FORMAT,     // Formatted aside and copied in.
+    SLOT_INTEGER,    // Digits written in place.
+    SLOT_STRING      // Copied in as it is.
+};
+
+// The template for rows of f. It has no text unless every cell of those
+// rows takes the width of its column: the table is justified, and no cell
+// of f is hidden, cut short or written back.
+static struct row_template *build_template(const struct format *f)
+{
+    struct row_template *t = calloc(1, sizeof(struct row_template));
+    size_t len = 0;
+
+    if (NULL == t)
+    {
+        cprintf_error("Memory allocation failed.", EXIT_FAILURE);
+    }
+    t->f = f;
+    if (!do_tabulate || caps_set || f->nspecs > state->ncolumns)
+    {
+        return t;
+    }
+    for (size_t i = 0; i < f->nspecs; i++)
+    {
+        const struct spec *sp = &f->specs[i];
+
+        if (sp->is_hidden || (sp->is_conversion_specification &&
+            (!state->columns[i].is_conversion_specification || C_INT_PTR == sp->type)))
+        {
+            return t;
+        }
+        len += (sp->is_conversion_specification) ? state->columns[i].max_width : sp->text_len;
+    }
+
+    t->text = malloc(len + 1);
+    t->specs = packed_specs(f);
+    t->slots = calloc(f->nconversions + 1, sizeof(size_t));
+    t->widths = calloc(f->nconversions + 1, sizeof(size_t));
+    t->kinds = calloc(f->nconversions + 1, 1);
+    if (NULL == t->text || NULL == t->slots || NULL == t->widths || NULL == t->kinds)
+    {
+        cprintf_error("Memory allocation failed.", EXIT_FAILURE);
+    }
+    for (size_t i = 0; i < f->nspecs; i++)
+    {
+        const struct spec *sp = &f->specs[i];
+        size_t j = sp->conversion;
+
+        if (!sp->is_conversion_specification)
+        {
+            memcpy(t->text + t->len, sp->ordinary_text, sp->text_len);
+            t->len += sp->text_len;
+            continue;
+        }
+        t->slots[j] = t->len;
+        t->widths[j] = state->columns[i].max_width;
+        memset(t->text + t->len, ' ', t->widths[j]);
+        t->len += t->widths[j];
+        if (NULL != sp->custom)
+        {
+            t->kinds[j] = SLOT_FORMAT;
+        }
+        else if (sp->is_simple)
+        {
+            t->kinds[j] = SLOT_INTEGER;
+        }
+        else if (C_CHARX == sp->type && is(sp->precision, "") &&
+                 strspn(sp->flags, "-") == strlen(sp->flags))
+        {
+            t->kinds[j] = SLOT_STRING;
+        }
+    }
+    t->text[t->len] = '\0';
+    return t;
+}
+
+static void free_templates(struct row_template *t)
+{
+    struct row_template *next;
+
+    for (; NULL != t; t = next)
+    {
+        next = t->next;
+        free(t->text);
+        free(t->slots);
+        free(t->widths);
+        free(t->kinds);
+        if (NULL != t->specs)
+        {
+            free_packed_specs(t->f, t->specs);
+        }
+        free(t);
+    }
+}
+
+// Write v as the simple integer conversion sp into the width blanks at
+// slot, padded as printf() would pad it. Returns false if it doesn't fit.
+static bool blit_integer(char *slot, size_t width, const struct spec *sp, const value *v)
+{
+    static const char lower[] = "0123456789abcdef", upper[] = "0123456789ABCDEF";
+    char digits[24], *d = digits + sizeof(digits), sign = 0;
+    bool neg;
+    uint64_t u = integer_magnitude(sp, v, &neg);
+    size_t n;
+
+    switch (sp->conversion_specifier[0])
+    {
+        case 'x':
+        case 'X':
+            do
+            {
+                *--d = ('x' == sp->conversion_specifier[0]) ? lower[u & 15] : upper[u & 15];
+            } while (u >>= 4);
+            break;
+        case 'o':
+            do
+            {
+                *--d = '0' + (u & 7);
+            } while (u >>= 3);
+            break;
+        default:
+            do
+            {
+                *--d = '0' + u % 10;
+            } while (u /= 10);
+            if (neg)
+            {
+                sign = '-';
+            }
+            else if (sp->is_signed && NULL != strchr(sp->flags, '+'))
+            {
+                sign = '+';
+            }
+            else if (sp->is_signed && NULL != strchr(sp->flags, ' '))
+            {
+                sign = ' ';
+            }
+            break;
+    }
+    n = digits + sizeof(digits) - d;
+    if (n + (0 != sign) > width)
+    {
+        return false;
+    }
+
+    if (NULL != strchr(sp->flags, '-'))
+    {
+        if (sign)
+        {
+            *slot++ = sign;
+        }
+        memcpy(slot, d, n);
+    }
+    else if (NULL != strchr(sp->flags, '0'))
+    {
+        if (sign)
+        {
+            slot[0] = sign;
+        }
+        memset(slot + (0 != sign), '0', width - n - (0 != sign));
+        memcpy(slot + width - n, d, n);
+    }
+    else
+    {
+        memcpy(slot + width - n, d, n);
+        if (sign)
+        {
+            slot[width - n - 1] = sign;
+        }
+    }
+    return true;
+}
+
+// Write cell c into slot j of the row at row. Returns false if its text
+// doesn't take exactly the slot's width.
+static bool fill_slot(const struct row_template *t, size_t j, char *row, struct atom *c,
+                      struct strbuf *scratch)
+{
+    char *slot = row + t->slots[j];
+    size_t width = t->widths[j], n;
+
+    if (SLOT_INTEGER == t->kinds[j])
+    {
+        return blit_integer(slot, width, c->spec, &c->val);
+    }
+    if (SLOT_STRING == t->kinds[j] && NULL != c->val.c_charx)
+    {
+        n = strlen(c->val.c_charx);
+        if (n > width)
+        {
+            return false;
+        }
+        memcpy((NULL != strchr(c->spec->flags, '-')) ? slot : slot + width - n, c->val.c_charx, n);
+        return true;
+    }
+    scratch->len = 0;
+    render_value(c, t->specs[j], scratch);
+    if (scratch->len != width)
+    {
+        return false;
+    }
+    memcpy(slot, scratch->buf, width);
+    return true;
+}
+
+// Append the row starting at a to sb, rendered from its template. Returns
+// false, leaving sb as it was, if the row has to be rendered piece by piece.
+static bool blit_row(const struct row_template *t, struct atom *a, struct strbuf *sb,
+                     struct strbuf *scratch)
+{
+    char *row;
+
+    if (NULL == t->text || a->repeats > 0)
+    {
+        return false;
+    }
+    sb_reserve(sb, t->len);
+    row = sb->buf + sb->len;
+    memcpy(row, t->text, t->len);
+    for (struct atom *c = a; NULL != c; c = c->right)
+    {
+        // Cells padded by display cells are longer than their column.
+        if (c->is_conversion_specification &&
+            (c->is_multibyte || !fill_slot(t, c->spec->conversion, row, c, scratch)))
+        {
+            return false;
+        }
+    }
+    sb->len += t->len;
+    sb->buf[sb->len] = '\0';
+    return true;
+}
+
+// Like blit_row(), for a row of f holding vals.
+static bool blit_values(const struct row_template *t, const struct format *f, const value *vals,
+                        struct strbuf *sb, struct strbuf *scratch)
+{
+    struct atom tmp;
+    char *row;
+
+    if (NULL == t->text)
+    {
+        return false;
+    }
+    memset(&tmp, 0, sizeof(tmp));
+    sb_reserve(sb, t->len);
+    row = sb->buf + sb->len;
+    memcpy(row, t->text, t->len);
+    for (size_t j = 0; j < f->nconversions; j++)
+    {
+        tmp.spec = &f->specs[f->conversions[j]];
+        tmp.type = tmp.spec->type;
+        tmp.val = vals[j];
+        if (!fill_slot(t, j, row, &tmp, scratch))
+        {
+            return false;
+        }
+    }
+    sb->len += t->len;
+    sb->buf[sb->len] = '\0';
+    return true;
+}
+
+// Render the packed rows, decoding them one at a time.
+static void print_packed(struct strbuf *sb, struct strbuf *scratch)
+{
+    struct packed *p = state->packed;
+    struct packed_reader *readers = calloc(p->f->nconversions + 1, sizeof(struct packed_reader));
+    value *vals = calloc(p->f->nconversions + 1, sizeof(value));
+    char **specs = packed_specs(p->f);
+    struct row_template *t = build_template(p->f);
+
+    if (NULL == readers || NULL == vals)
+    {
+        cprintf_error("Memory allocation failed.", EXIT_FAILURE);
+    }
+    for (size_t r = 0; r < p->nrows; r++)
+    {
+        sb->len = 0;
+        decode_row(p, readers, vals);
+        if (!blit_values(t, p->f, vals, sb, scratch))
+        {
+            sb->len = 0;
+            render_values(p->f, vals, specs, sb);
+        }
+        emit(sb->buf, sb->len);
+    }
+    free_templates(t);
+    free_packed_specs(p->f, specs);
+    free(vals);
+    free(readers);
+}
+
+// A row's sort key with its position in capture order.
+struct sort_entry
+{
+    uint64_t key;
+    size_t row;
+};
+
+// A key whose unsigned order is the order of a's value. Strings are keyed
+// on their first few characters and long doubles through double; ties are
+// settled by compare_cells().
+static uint64_t sort_key(const struct atom *a)
+{
+    const uint64_t sign = UINT64_C(1) << 63;
+    uint64_t k = 0;
+    double x;
+
+    switch (a->type)
+    {
+        case C_INT:
+            return (uint64_t) (int64_t) a->val.c_int ^ sign;
+        case C_WINT_T:
+            return (uint64_t) (int64_t) a->val.c_wint_t ^ sign;
+        case C_LONG:
+            return (uint64_t) (int64_t) a->val.c_long ^ sign;
+        case C_LONG_LONG:
+            return (uint64_t) (int64_t) a->val.c_long_long ^ sign;
+        case C_INTMAX_T:
+            return (uint64_t) (int64_t) a->val.c_intmax_t ^ sign;
+        case C_SSIZE_T:
+            return (uint64_t) (int64_t) a->val.c_ssize_t ^ sign;
+        case C_PTRDIFF_T:
+            return (uint64_t) (int64_t) a->val.c_ptrdiff_t ^ sign;
+        case C_UNSIGNED_INT:
+            return a->val.c_unsigned_int;
+        case C_UNSIGNED_LONG:
+            return a->val.c_unsigned_long;
+        case C_UNSIGNED_LONG_LONG:
+            return a->val.c_unsigned_long_long;
+        case C_UINTMAX_T:
+            return a->val.c_uintmax_t;
+        case C_SIZE_T:
+            return a->val.c_size_t;
+        case C_DOUBLE:
+        case C_LONG_DOUBLE:
+            // Flip negative numbers end to end and put them below the rest.
+            x = (C_DOUBLE == a->type) ? a->val.c_double : (double) a->val.c_long_double;
+            memcpy(&k, &x, sizeof(k));
+            return (k & sign) ? ~k : k | sign;
+        case C_CHARX:
+            for (size_t i = 0; NULL != a->val.c_charx && i < 8 && '\0' != a->val.c_charx[i]; i++)
+            {
+                k |= (uint64_t) (unsigned char) a->val.c_charx[i] << (56 - 8 * i);
+            }
+            return k;
+        case C_WCHAR_TX:
+            for (size_t i = 0; NULL != a->val.c_wchar_tx && i < 2 && L'\0' != a->val.c_wchar_tx[i]; i++)
+            {
+                k |= (uint64_t) (uint32_t) a->val.c_wchar_tx[i] << (32 - 32 * i);
+            }
+            return k;
+        case C_VOIDX:
+            return (uintptr_t) a->val.c_voidx;
+        default:
+            return 0;
+    }
+}
+
+// Sort n entries by key, keeping entries with equal keys in order: one
+// counting pass per byte of the key, skipping bytes every key shares.
+static void radix_sort(struct sort_entry *e, struct sort_entry *tmp, size_t n)
+{
+    static size_t count[8][256];
+    struct sort_entry *from = e, *to = tmp, *swap;
+
+    memset(count, 0, sizeof(count));
+    for (size_t i = 0; i < n; i++)
+    {
+        for (unsigned d = 0; d < 8; d++)
+        {
+            count[d][(e[i].key >> (8 * d)) & 0xff]++;
+        }
+    }
+    for (unsigned d = 0; d < 8 && n > 0; d++)
+    {
+        size_t at = 0;
+
+        if (count[d][(e[0].key >> (8 * d)) & 0xff] == n)
+        {
+            continue;
+        }
+        for (unsigned b = 0; b < 256; b++)
+        {
+            size_t c = count[d][b];
+            count[d][b] = at;
+            at += c;
+        }
+        for (size_t i = 0; i < n; i++)
+        {
+            to[count[d][(from[i].key >> (8 * d)) & 0xff]++] = from[i];
+        }
+        swap = from;
+        from = to;
+        to = swap;
+    }
+    if (from != e)
+    {
+        memcpy(e, from, n * sizeof(struct sort_entry));
+    }
+}
+
+// Sort n words by bits lo to hi, as radix_sort() sorts keys but up to 11
+// bits a pass. The bits outside them stay with their word, and words that
+// tie keep their order.
+static void radix_words(uint64_t *w, uint64_t *tmp, size_t n, unsigned lo, unsigned hi)
+{
+    size_t count[2048];
+    uint64_t *from = w, *to = tmp, *swap;
+    unsigned digits = (hi - lo + 10) / 11;
+    unsigned width = (digits > 0) ? (hi - lo + digits - 1) / digits : 0;
+    size_t mask = ((size_t) 1 << width) - 1;
+
+    for (unsigned d = 0; d < digits && n > 0; d++)
+    {
+        unsigned shift = lo + width * d;
+        size_t at = 0;
+
+        memset(count, 0, (mask + 1) * sizeof(size_t));
+        for (size_t i = 0; i < n; i++)
+        {
+            count[(from[i] >> shift) & mask]++;
+        }
+        if (count[(from[0] >> shift) & mask] == n)
+        {
+            continue;
+        }
+        for (size_t b = 0; b <= mask; b++)
+        {
+            size_t c = count[b];
+            count[b] = at;
+            at += c;
+        }
+        for (size_t i = 0; i < n; i++)
+        {
+            to[count[(from[i] >> shift) & mask]++] = from[i];
+        }
+        swap = from;
+        from = to;
+        to = swap;
+    }
+    if (from != w)
+    {
+        memcpy(w, from, n * sizeof(uint64_t));
+    }
+}
+
+// radix_words() for more words than fit in cache: one pass spreads them
+// out by their top 11 bits, and each of the runs that leaves is sorted by
+// the rest while it is still in cache.
+static void sort_words(uint64_t *w, uint64_t *tmp, size_t n, unsigned lo, unsigned hi)
+{
+    static size_t count[2048], start[2049];
+    unsigned width = (hi - lo < 11) ? hi - lo : 11, shift = hi - width;
+    size_t mask = ((size_t) 1 << width) - 1, at = 0;
+
+    if (n < 65536 || width < 11)
+    {
+        radix_words(w, tmp, n, lo, hi);
+        return;
+    }
+    memset(count, 0, sizeof(count));
+    for (size_t i = 0; i < n; i++)
+    {
+        count[(w[i] >> shift) & mask]++;
+    }
+    for (size_t b = 0; b <= mask; b++)
+    {
+        size_t c = count[b];
+        start[b] = count[b] = at;
+        at += c;
+    }
+    start[mask + 1] = n;
+    for (size_t i = 0; i < n; i++)
+    {
+        tmp[count[(w[i] >> shift) & mask]++] = w[i];
+    }
+    for (size_t b = 0; b <= mask; b++)
+    {
+        size_t first = start[b], len = start[b + 1] - first;
+
+        radix_words(tmp + first, w + first, len, lo, shift);
+        memcpy(w + first, tmp + first, len * sizeof(uint64_t));
+    }
+}
+
+// Sort m entries for k rows by key, keeping entries with equal keys in
+// order. Above the low bits they all share, keys usually span a small
+// enough range to share a word with their row, even when they differ in
+// their top bit as signed numbers do: those words are sorted in the first
+// half of e, with the second half to spare, so each pass moves half as
+// much and nothing is allocated.
+static void sort_entries(struct sort_entry *e, size_t m, size_t k)
+{
+    uint64_t *w = (uint64_t *) e;
+    uint64_t first = (m > 0) ? e[0].key : 0, diff = 0, least = first, most = first;
+    unsigned shift, bits, row_bits = 0;
+    struct sort_entry *tmp;
+
+    for (size_t i = 0; i < m; i++)
+    {
+        diff |= e[i].key ^ first;
+        least = (e[i].key < least) ? e[i].key : least;
+        most = (e[i].key > most) ? e[i].key : most;
+    }
+    if (0 == diff)
+    {
+        return;    // Every key is the same, so the entries are in order.
+    }
+    shift = (unsigned) __builtin_ctzll(diff);
+    least >>= shift;
+    bits = 64 - (unsigned) __builtin_clzll((most >> shift) - least);
+    while ((UINT64_C(1) << row_bits) < k)
+    {
+        row_bits++;
+    }
+    if (bits + row_bits <= 64)
+    {
+        // How far each key is above the least, above the row.
+        uint64_t low = first & ((UINT64_C(1) << shift) - 1);
+        uint64_t row_mask = (UINT64_C(1) << row_bits) - 1;
+
+        // Word i only overwrites entries before i, which have been read.
+        for (size_t i = 0; i < m; i++)
+        {
+            w[i] = (((e[i].key >> shift) - least) << row_bits) | e[i].row;
+        }
+        sort_words(w, w + m, m, row_bits, row_bits + bits);
+
+        // Going backwards, entry i only overwrites words from i on.
+        for (size_t i = m; i-- > 0;)
+        {
+            uint64_t x = w[i];
+            e[i].key = (((x >> row_bits) + least) << shift) | low;
+            e[i].row = x & row_mask;
+        }
+        return;
+    }
+    tmp = malloc(m * sizeof(struct sort_entry));
+    if (NULL == tmp)
+    {
+        cprintf_error("Memory allocation failed.", EXIT_FAILURE);
+    }
+    radix_sort(e, tmp, m);
+    free(tmp);
+}
+
+// sort_entries() for keys that are a word each, one for each of the k
+// rows in capture order, with room for as many again after them: leaves
+// the rows themselves in w, in the order they go. Rows never need to be
+// written next to their keys, or read back out of them. Returns false,
+// with w as it was, if a key doesn't fit in a word with its row.
+static bool sort_keys(uint64_t *w, size_t k, struct atom *const *rows)
+{
+    struct atom **order = (struct atom **) w;
+    uint64_t first = (k > 0) ? w[0] : 0, diff = 0, least = first, most = first;
+    unsigned shift, bits, row_bits = 0;
+
+    for (size_t i = 0; i < k; i++)
+    {
+        diff |= w[i] ^ first;
+        least = (w[i] < least) ? w[i] : least;
+        most = (w[i] > most) ? w[i] : most;
+    }
+    while ((UINT64_C(1) << row_bits) < k)
+    {
+        row_bits++;
+    }
+    if (0 == diff)
+    {
+        memcpy(order, rows, k * sizeof(struct atom *));
+        return true;
+    }
+    shift = (unsigned) __builtin_ctzll(diff);
+    least >>= shift;
+    bits = 64 - (unsigned) __builtin_clzll((most >> shift) - least);
+    if (bits + row_bits > 64)
+    {
+        return false;
+    }
+    for (size_t i = 0; i < k; i++)
+    {
+        w[i] = (((w[i] >> shift) - least) << row_bits) | i;
+    }
+    sort_words(w, w + k, k, row_bits, row_bits + bits);
+    for (size_t i = 0; i < k; i++)
+    {
+        order[i] = rows[w[i] & ((UINT64_C(1) << row_bits) - 1)];
+    }
+    return true;
+}
+
+// Turn the keys of rows 0 to m - 1 at the front of e, a word each, into
+// entries. Going backwards, entry i only overwrites words from i on.
+static void key_entries(struct sort_entry *e, size_t m)
+{
+    const uint64_t *w = (const uint64_t *) e;
+
+    for (size_t i = m; i-- > 0;)
+    {
+        uint64_t key = w[i];
+
+        e[i].key = key;
+        e[i].row = i;
+    }
+}
+
+// Ask for huge pages under the part of an array of size bytes from p that
+// is whole huge pages. Sorting reads and writes these arrays all over, and
+// with small pages every row can cost a TLB miss.
+static void want_huge_pages(void *p, size_t size)
+{
+#ifdef MADV_HUGEPAGE
+    const uintptr_t huge = (uintptr_t) 2 << 20;
+    uintptr_t from = ((uintptr_t) p + huge - 1) & ~(huge - 1);
+    uintptr_t to = ((uintptr_t) p + size) & ~(huge - 1);
+
+    if (to > from)
+    {
+        madvise((void *) from, to - from, MADV_HUGEPAGE);
+    }
+#else
+    (void) p;
+    (void) size;
+#endif
+}
+
+// Cells being sorted, for compare_cells().
+static struct atom **sort_cells = NULL;
+
+// Order two entries whose keys tie by their whole values, then by capture
+// order.
+static int compare_cells(const void *p, const void *q)
+{
+    const struct sort_entry *x = p, *y = q;
+    const struct atom *a = sort_cells[x->row], *b = sort_cells[y->row];
+    int r = 0;
+
+    if (C_CHARX == a->type && C_CHARX == b->type &&
+        NULL != a->val.c_charx && NULL != b->val.c_charx)
+    {
+        r = strcmp(a->val.c_charx, b->val.c_charx);
+    }
+    else if (C_WCHAR_TX == a->type && C_WCHAR_TX == b->type &&
+             NULL != a->val.c_wchar_tx && NULL != b->val.c_wchar_tx)
+    {
+        r = wcscmp(a->val.c_wchar_tx, b->val.c_wchar_tx);
+    }
+    else if (C_LONG_DOUBLE == a->type && C_LONG_DOUBLE == b->type)
+    {
+        r = (a->val.c_long_double > b->val.c_long_double) -
+            (a->val.c_long_double < b->val.c_long_double);
+    }
+    if (0 != r)
+    {
+        return (sort_ascending) ? r : -r;
+    }
+    return (x->row > y->row) - (x->row < y->row);
+}
+
+// Whether cells of type t can tie on their key yet differ.
+static bool partial_key(type_t t)
+{
+    return C_CHARX == t || C_WCHAR_TX == t || C_LONG_DOUBLE == t;
+}
+
+// Remember a row just captured and, under cprintf_sort(), the key of its
+// cell in the sort column, while its atoms are still in cache. Keys are
+// only kept if the column was set before the first row.
+void note_sort_key(const struct format *f, struct atom *row)
+{
+    size_t n = state->nkeyed;
+    struct atom *c = row;
+    size_t pos;
+
+    if (state->keys_stale)
+    {
+        return;
+    }
+    if (n != state->nrows - 1)
+    {
+        // Rows came from somewhere else.
+        forget_sort_keys();
+        state->keys_stale = true;
+        return;
+    }
+    if (0 == n)
+    {
+        state->keyed_column = sort_column;
+    }
+    else if (state->keyed_column >= 0 && sort_column != state->keyed_column)
+    {
+        // The sort column changed: the rows are still good.
+        free(state->keyed_cells);
+        free(state->keys);
+        state->keyed_cells = NULL;
+        state->keys = NULL;
+        state->nkeys = 0;
+        state->keyed_column = -1;
+        state->keyed_ties = false;
+    }
+    if (n == state->keyed_cap)
+    {
+        size_t cap = (0 == n) ? 1024 : 2 * n;
+        struct atom **rows = realloc(state->keyed_rows, cap * sizeof(struct atom *));
+
+        if (NULL == rows)
+        {
+            cprintf_error("Memory allocation failed.", EXIT_FAILURE);
+        }
+        state->keyed_rows = rows;
+        want_huge_pages(rows, cap * sizeof(struct atom *));
+        if (state->keyed_column >= 0)
+        {
+            struct atom **cells = realloc(state->keyed_cells, cap * sizeof(struct atom *));
+            struct sort_entry *keys = (NULL == cells) ? NULL : realloc(state->keys, cap * sizeof(struct sort_entry));
+
+            if (NULL == keys)
+            {
+                cprintf_error("Memory allocation failed.", EXIT_FAILURE);
+            }
+            state->keyed_cells = cells;
+            state->keys = keys;
+            want_huge_pages(cells, cap * sizeof(struct atom *));
+            want_huge_pages(keys, cap * sizeof(struct sort_entry));
+        }
+        state->keyed_cap = cap;
+    }
+    state->keyed_rows[n] = row;
+    state->nkeyed++;
+    if (state->keyed_column < 0)
+    {
+        return;
+    }
+
+    pos = ((size_t) sort_column < f->nconversions) ? f->conversions[sort_column] : SIZE_MAX;
+    for (size_t i = 0; NULL != c && i < pos; i++)
+    {
+        c = c->right;
+    }
+    state->keyed_cells[n] = (SIZE_MAX == pos) ? NULL : c;
+    if (NULL != state->keyed_cells[n])
+    {
+        state->keys[state->nkeys].key = sort_key(c);
+        state->keys[state->nkeys].row = n;
+        state->keyed_ties |= partial_key(c->type);
+        state->nkeys++;
+    }
+}
+
+// Stop keeping rows and keys for the rows captured so far: they were
+// printed, or have changed since.
+void forget_sort_keys(void)
+{
+    free(state->keyed_rows);
+    free(state->keyed_cells);
+    free(state->keys);
+    state->keyed_rows = NULL;
+    state->keyed_cells = NULL;
+    state->keys = NULL;
+    state->nkeyed = state->nkeys = state->keyed_cap = 0;
+    state->keyed_column = -1;
+    state->keyed_ties = false;
+    state->keys_stale = false;
+}
+
+// Whether cells in the sort column of some row can tie on their key yet
+// differ. Every cell has its conversion's type.
+static bool sort_column_ties(void)
+{
+    for (struct format *f = state->formats; NULL != f; f = f->next)
+    {
+        if ((size_t) sort_column < f->nconversions &&
+            partial_key(f->specs[f->conversions[sort_column]].type))
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Work out the order cflush() prints the captured rows in: by the value of
+// conversion sort_column, then by capture order. Rows that don't have that
+// conversion go last. The graph itself isn't touched. If note_sort_key()
+// kept keys for every row, its arrays are sorted in place; otherwise the
+// keys are read in one pass over the rows it kept, or over the index, and
+// only rows that came from elsewhere are found by walking down the graph.
+static void sort_rows(void)
+{
+    size_t n = state->nrows, m = 0, k = 0, pos = 0;
+    bool listed = !state->keys_stale && state->nkeyed == n;
+    bool keyed = listed && state->keyed_column == sort_column;
+    bool ties = (keyed) ? state->keyed_ties : sort_column_ties();
+    struct atom **rows = (listed) ? state->keyed_rows : malloc(n * sizeof(struct atom *));
+    struct sort_entry *e = (keyed) ? state->keys : malloc(n * sizeof(struct sort_entry));
+    struct atom **cells = NULL, **order;
+    const size_t *index = (state->indexed) ? state->row_first : NULL;
+    struct atom *const *cells_of = state->cells;
+    const struct spec *first = NULL;
+    uint64_t *w = (uint64_t *) e;
+
+    // Keys that can't tie go a word each for as long as every row has one.
+    bool words = !ties;
+
+    // Cells are only looked at again to break ties.
+    if (keyed || ties)
+    {
+        cells = (keyed) ? state->keyed_cells : malloc(n * sizeof(struct atom *));
+    }
+    if (NULL == rows || NULL == e || (ties && NULL == cells))
+    {
+        cprintf_error("Memory allocation failed.", EXIT_FAILURE);
+    }
+    if (!keyed)
+    {
+        want_huge_pages(e, n * sizeof(struct sort_entry));
+    }
+    if (!listed)
+    {
+        want_huge_pages(rows, n * sizeof(struct atom *));
+    }
+
+    if (keyed)
+    {
+        k = n;
+        m = state->nkeys;
+        words = words && m == k;
+
+        // Word i only overwrites entries before i, which have been read.
+        for (size_t i = 0; i < m; i++)
+        {
+            uint64_t key = (sort_ascending) ? e[i].key : ~e[i].key;
+
+            if (words)
+            {
+                w[i] = key;
+            }
+            else
+            {
+                e[i].key = key;
+            }
+        }
+        state->keys = NULL;    // Becomes state->order.
+    }
+    else if (listed || state->indexed)
+    {
+        k = n;
+    }
+    else
+    {
+        for (struct atom *row = state->origin; row != state->bot_left && k < n; row = row->down)
+        {
+            rows[k++] = row;
+        }
+    }
+    for (size_t r = 0; !keyed && r < k; r++)
+    {
+        struct atom *row = (NULL != index) ? cells_of[index[r]] : rows[r];
+        struct atom *c = row;
+
+        // Rows of one format keep the conversion at the same position.
+        if (row->spec != first)
+        {
+            struct format *f = format_of(row->spec);
+            first = row->spec;
+            pos = ((size_t) sort_column < f->nconversions) ? f->conversions[sort_column] : SIZE_MAX;
+        }
+        if (NULL != index)
+        {
+            rows[r] = row;
+        }
+        if (SIZE_MAX == pos)
+        {
+            c = NULL;
+        }
+        else if (NULL != index)
+        {
+            c = cells_of[index[r] + pos];
+        }
+        for (size_t i = 0; NULL == index && NULL != c && i < pos; i++)
+        {
+            c = c->right;
+        }
+        if (NULL == c)
+        {
+            // From here on, keys need their rows beside them.
+            if (words)
+            {
+                key_entries(e, m);
+                words = false;
+            }
+            continue;
+        }
+        if (NULL != cells)
+        {
+            cells[r] = c;
+        }
+        if (words)
+        {
+            w[m++] = (sort_ascending) ? sort_key(c) : ~sort_key(c);
+            continue;
+        }
+        e[m].key = (sort_ascending) ? sort_key(c) : ~sort_key(c);
+        e[m].row = r;
+        m++;
+    }
+
+    // Each row goes over the front of the word or entry it came from,
+    // which has been read by then.
+    order = (struct atom **) e;
+    if (!words || !sort_keys(w, k, rows))
+    {
+        if (words)
+        {
+            key_entries(e, k);
+        }
+
+        // The rows without the conversion follow, in capture order. e has
+        // room for every row, and sorting leaves the entries after m alone.
+        for (size_t i = 0, r = 0, j = m; j < k; r++)
+        {
+            if (i < m && e[i].row == r)
+            {
+                i++;
+            }
+            else
+            {
+                e[j++].row = r;
+            }
+        }
+        sort_entries(e, m, k);
+
+        // Strings and long doubles that share a key aren't in order yet.
+        if (ties)
+        {
+            sort_cells = cells;
+            for (size_t i = 0, j; i < m; i = j)
+            {
+                for (j = i + 1; j < m && e[j].key == e[i].key; j++)
+                    ;
+                if (j - i > 1)
+                {
+                    qsort(&e[i], j - i, sizeof(struct sort_entry), compare_cells);
+                }
+            }
+            sort_cells = NULL;
+        }
+        for (size_t i = 0; i < k; i++)
+        {
+            order[i] = rows[e[i].row];
+        }
+    }
+    free(state->order);
+    state->order = realloc(order, k * sizeof(struct atom *));
+    state->order = (NULL == state->order) ? order : state->order;
+    state->norder = k;
+    state->order_tail = (k > 0) ? rows[k - 1] : NULL;
+    if (listed)
+    {
+        forget_sort_keys();    // Rows captured from now on start a new list.
+    }
+    else
+    {
+        free(rows);
+    }
+    if (!keyed)
+    {
+        free(cells);
+    }
+}
+
+// The k-th row to print, given the one before it: rows placed by
+// sort_rows() first, then any appended since, such as footers.
+static struct atom *row_at(size_t k, struct atom *prev)
+{
+    if (k < state->norder)
+    {
+        return state->order[k];
+    }
+    if (k > 0 && k == state->norder)
+    {
+        return state->order_tail->down;
+    }
+    return (0 == k) ? state->origin : prev->down;
+}
+
+void print_something_already()
+{
+    // bunch of checks to see if Something horrible happened... No dummies.
+    // TODO: make this use find_top_left_safe
+    if (NULL == state || ((NULL == state->origin || NULL == state->origin->up ||
+        NULL == state->origin->down || NULL == state->bot_left) && NULL == state->packed))
+    {
+        cprintf_error("Warning in %s: Graph is not initialized.", __PRETTY_FUNCTION__);
+    }
+    struct atom *a = row_at(0, NULL);
+    struct strbuf *sb = &state->row_buf;
+    struct strbuf scratch = { NULL, 0, 0 };
+    struct row_template *templates = NULL, *t = NULL;
+
+    // Rows printed from a template take their widths from the columns; the
+    // rest are justified as they come, unless capped columns are involved.
+    if (do_tabulate != false && NULL != state->origin && caps_set)
+    {
+        calc_max_width();
+        generate_new_specs();
+    }
+
+    // Each row is rendered into memory and handed over as a single chunk.
+    for (size_t k = 0; NULL != a && a != state->bot_left; a = row_at(++k, a))
+    {
+        if (NULL == t || &t->f->specs[0] != a->spec)
+        {
+            for (t = templates; NULL != t && &t->f->specs[0] != a->spec; t = t->next)
+                ;
+            if (NULL == t)
+            {
+                t = build_template(format_of(a->spec));
+                t->next = templates;
+                templates = t;
+            }
+        }
+        sb->len = 0;
+        if (!blit_row(t, a, sb, &scratch))
+        {
+            if (do_tabulate != false && !caps_set)
+            {
+                justify_row(a);
+            }
+            render_row(a, sb);
+        }
+        emit(sb->buf, sb->len);
+    }
+    free_templates(templates);
+    if (NULL != state->packed)
+    {
+        print_packed(sb, &scratch);
+    }
+    free(scratch.buf);
+
+    if (pwrite_fd >= 0 && !state->to_buffer)
+    {
+        write_pending();
+    }
+
+    if (state->to_buffer && state->dest_size > 0)
+    {
+        size_t end = (state->dest_len < state->dest_size) ? state->dest_len : state->dest_size - 1;
+        state->dest_str[end] = '\0';
+    }
+}
+
+static void push_live_row(struct live_frame *fr)
+{
+    if (fr->nrows + 1 >= fr->rows_cap)
+    {
+        size_t n = (fr->rows_cap) ? fr->rows_cap * 2 : 64;
+        size_t *p = realloc(fr->rows, n * sizeof(size_t));
+        if (NULL == p)
+        {
+            cprintf_error("Memory allocation failed.", EXIT_FAILURE);
+        }
+        fr->rows = p;
+        fr->rows_cap = n;
+    }
+    fr->rows[fr->nrows++] = fr->ncells;
+}
+
+static struct live_cell *push_live_cell(struct live_frame *fr)
+{
+    if (fr->ncells == fr->cells_cap)
+    {
+        size_t n = (fr->cells_cap) ? fr->cells_cap * 2 : 256;
+        struct live_cell *p = realloc(fr->cells, n * sizeof(struct live_cell));
+        if (NULL == p)
+        {
+            cprintf_error("Memory allocation failed.", EXIT_FAILURE);
+        }
+        fr->cells = p;
+        fr->cells_cap = n;
+    }
+    return &fr->cells[fr->ncells++];
+}
+
+// Render the table into fr, remembering where every cell landed.
+static void build_live_frame(struct live_frame *fr)
+{
+    size_t k = 0;
+
+    fr->text.len = 0;
+    fr->ncells = 0;
+    fr->nrows = 0;
+    fr->nlines = 0;
+    fr->simple = true;
+
+    for (struct atom *row = row_at(0, NULL); row != state->bot_left; row = row_at(++k, row))
+    {
+        size_t col = 0;
+        bool ended = false;
+
+        push_live_row(fr);
+        for (struct atom *c = row; NULL != c; c = c->right)
+        {
+            struct live_cell *cell = push_live_cell(fr);
+            const char *p, *nl;
+
+            cell->off = fr->text.len;
+            render_cell(c, &fr->text);
+            cell->len = fr->text.len - cell->off;
+            p = fr->text.buf + cell->off;
+            while (NULL != (nl = memchr(p, '\n', fr->text.buf + fr->text.len - p)))
+            {
+                fr->nlines++;
+                if (NULL != c->right || nl != fr->text.buf + fr->text.len - 1)
+                {
+                    fr->simple = false;    // A newline inside the row.
+                }
+                p = nl + 1;
+            }
+            if (NULL == c->right && cell->len > 0 && '\n' == fr->text.buf[fr->text.len - 1])
+            {
+                cell->len--;
+                ended = true;
+            }
+            cell->col = col;
+            cell->width = display_width(fr->text.buf + cell->off, cell->len);
+            col += cell->width;
+        }
+        if (!ended)
+        {
+            fr->simple = false;    // The next row continues this line.
+        }
+        if (row->repeats > 0)
+        {
+            struct live_cell *cell = push_live_cell(fr);
+            char note[32];
+            size_t n = repeat_note(row->repeats + 1, note, sizeof(note));
+
+            fr->text.len -= ended;
+            cell->off = fr->text.len;
+            sb_append(&fr->text, note, n);
+            cell->len = n;
+            cell->col = col;
+            cell->width = display_width(note, n);
+            if (ended)
+            {
+                sb_append(&fr->text, "\n", 1);
+            }
+        }
+    }
+    fr->rows[fr->nrows] = fr->ncells;
+}
+
+// Move the terminal cursor from (*row, *col) to (r, c), relative to the top
+// left corner of the frame on screen.
+static void live_move(struct strbuf *out, size_t *row, size_t *col, size_t r, size_t c)
+{
+    if (r < *row)
+    {
+        sb_printf(out, "\033[%zuA", *row - r);
+    }
+    else if (r > *row)
+    {
+        sb_printf(out, "\033[%zuB", r - *row);
+    }
+    if (0 == c && c != *col)
+    {
+        sb_append(out, "\r", 1);
+    }
+    else if (c > *col)
+    {
+        sb_printf(out, "\033[%zuC", c - *col);
+    }
+    else if (c < *col)
+    {
+        sb_printf(out, "\033[%zuD", *col - c);
+    }
+    *row = r;
+    *col = c;
+}
+
+static size_t live_row_end(const struct live_frame *fr, size_t r)
+{
+    if (fr->rows[r] == fr->rows[r + 1])
+    {
+        return 0;
+    }
+    const struct live_cell *last = &fr->cells[fr->rows[r + 1] - 1];
+    return last->col + last->width;
+}
+
+// Redraw the table over the one the last flush left on the terminal,
+// writing only the cells whose text or position changed.
+void print_live(void)
+{
+    struct live_frame *prev = &live_frames[live_current];
+    struct live_frame *cur = &live_frames[!live_current];
+    struct strbuf *out = &state->row_buf;
+    size_t row, col = 0;
+
+    build_live_frame(cur);
+    out->len = 0;
+
+    if (!live_shown || !prev->simple || !cur->simple)
+    {
+        // Without one line per row we can't address cells; start over.
+        if (live_shown && prev->nlines > 0)
+        {
+            sb_printf(out, "\033[%zuA", prev->nlines);
+        }
+        sb_append(out, "\r\033[J", 4);
+        sb_append(out, cur->text.buf, cur->text.len);
+    }
+    else
+    {
+        row = prev->nrows;    // The cursor sits below the old frame.
+        for (size_t r = 0; r < prev->nrows && r < cur->nrows; r++)
+        {
+            size_t np = prev->rows[r + 1] - prev->rows[r];
+            size_t prev_end = live_row_end(prev, r), cur_end = live_row_end(cur, r);
+
+            for (size_t j = 0; cur->rows[r] + j < cur->rows[r + 1]; j++)
+            {
+                const struct live_cell *cc = &cur->cells[cur->rows[r] + j];
+                const struct live_cell *pc = (j < np) ? &prev->cells[prev->rows[r] + j] : NULL;
+
+                if (NULL != pc && pc->col == cc->col && pc->len == cc->len &&
+                    0 == memcmp(prev->text.buf + pc->off, cur->text.buf + cc->off, cc->len))
+                {
+                    continue;
+                }
+                live_move(out, &row, &col, r, cc->col);
+                sb_append(out, cur->text.buf + cc->off, cc->len);
+                col += cc->width;
+            }
+            if (cur_end < prev_end)
+            {
+                live_move(out, &row, &col, r, cur_end);
+                sb_append(out, "\033[K", 3);
+            }
+        }
+        if (cur->nrows > prev->nrows)
+        {
+            // New rows go below the old frame, scrolling if they have to.
+            size_t off = cur->cells[cur->rows[prev->nrows]].off;
+            live_move(out, &row, &col, prev->nrows, 0);
+            sb_append(out, cur->text.buf + off, cur->text.len - off);
+            row = cur->nrows;
+        }
+        else if (cur->nrows < prev->nrows)
+        {
+            live_move(out, &row, &col, cur->nrows, 0);
+            sb_append(out, "\033[J", 3);
+        }
+        live_move(out, &row, &col, cur->nrows, 0);
+    }
+
+    emit(out->buf, out->len);
+    if (NULL == sink_fn)
+    {
+        fflush(state->dest);
+    }
+    live_current = !live_current;
+    live_shown = true;
+}
+
+void _cprintf(FILE *stream, const char *fmt, va_list *args)
+{
+    //static bool exit_callback_constructed = false;
+
+    if (fileno(stream) == -1)
+    {
+        cprintf_error("Error: Invalid stream\n", EXIT_FAILURE);
+    }
+    if (fmt == NULL)
+    {
+        cprintf_error("Error: Invalid format string\n", EXIT_FAILURE);
+        exit_nice();
+    }
+    if (args == NULL)
+    {
+        cprintf_error("Error: Invalid args\n", EXIT_FAILURE);
+    }
+
+    bind_stream(stream);
+    if (pipeline_mode)
+    {
+        pipeline_row(lookup_format(fmt), args);
+        return;
+    }
+    _capture(fmt, args);
+}
+
+// Start a table on stream, or check that the current one is going there.
+void bind_stream(FILE *stream)
+{
+    if (is_initialized == false || state == NULL)
+    {
+        setup(stream);
+        is_initialized = true;
+    }
+    if (state->iterating)
+    {
+        cprintf_error("Error: No rows can be captured while a table is iterated.", EXIT_FAILURE);
+    }
+
+    if (state->dest != stream && 0 == state->nrows && NULL != state->cursor)
+    {
+        state->dest = stream;    // A retained table may move between flushes.
+    }
+    else if (state->dest != stream)
+    {
+        cprintf_error("Error: Multiple streams not supported.", EXIT_FAILURE);
+    }
+}
+
+int _csnprintf(char *str, size_t size, const char *fmt, va_list *args)
+{
+    size_t n;
+
+    finish_pipeline();
+    if (NULL == str && size > 0)
+    {
+        cprintf_error("Error: Invalid buffer\n", EXIT_FAILURE);
+    }
+    if (fmt != NULL && args == NULL)
+    {
+        cprintf_error("Error: Invalid args\n", EXIT_FAILURE);
+    }
+
+    if (is_initialized == false || state == NULL)
+    {
+        setup(NULL);
+        is_initialized = true;
+        state->to_buffer = true;
+    }
+
+    if (state->to_buffer == false)
+    {
+        cprintf_error("Error: Multiple streams not supported.", EXIT_FAILURE);
+    }
+    if (state->iterating && fmt != NULL)
+    {
+        cprintf_error("Error: No rows can be captured while a table is iterated.", EXIT_FAILURE);
+    }
+
+    // The most recent buffer wins, so callers can size it from our return
+    // value and hand over a bigger one before calling cflush().
+    state->dest_str = str;
+    state->dest_size = size;
+
+    if (fmt != NULL)
+    {
+        _capture(fmt, args);
+    }
+
+    n = rendered_size();
+    return (n > INT_MAX) ? -1 : (int) n;
+}
+
+// Space to read the values of a row of f into before it gets atoms.
+static value *row_values(const struct format *f)
+{
+    if (f->nconversions > state->row_values_cap)
+    {
+        value *p = realloc(state->row_values, f->nconversions * sizeof(value));
+        if (NULL == p)
+        {
+            cprintf_error("Memory allocation failed.", EXIT_FAILURE);
+        }
+        state->row_values = p;
+        state->row_values_cap = f->nconversions;
+    }
+    return state->row_values;
+}
+
+// Whether a holds the value v, so that both print the same.
+static bool same_value(const struct atom *a, const value *v)
+{
+    switch (a->type)
+    {
+        case C_INT:
+            return a->val.c_int == v->c_int;
+        case C_WINT_T:
+            return a->val.c_wint_t == v->c_wint_t;
+        case C_CHARX:
+            if (NULL == a->val.c_charx || NULL == v->c_charx)
+            {
+                return a->val.c_charx == v->c_charx;
+            }
+            return 0 == strcmp(a->val.c_charx, v->c_charx);
+        case C_WCHAR_TX:
+            if (NULL == a->val.c_wchar_tx || NULL == v->c_wchar_tx)
+            {
+                return a->val.c_wchar_tx == v->c_wchar_tx;
+            }
+            return 0 == wcscmp(a->val.c_wchar_tx, v->c_wchar_tx);
+        case C_LONG:
+            return a->val.c_long == v->c_long;
+        case C_LONG_LONG:
+            return a->val.c_long_long == v->c_long_long;
+        case C_INTMAX_T:
+            return a->val.c_intmax_t == v->c_intmax_t;
+        case C_SSIZE_T:
+            return a->val.c_ssize_t == v->c_ssize_t;
+        case C_PTRDIFF_T:
+            return a->val.c_ptrdiff_t == v->c_ptrdiff_t;
+        case C_UNSIGNED_INT:
+            return a->val.c_unsigned_int == v->c_unsigned_int;
+        case C_UNSIGNED_LONG:
+            return a->val.c_unsigned_long == v->c_unsigned_long;
+        case C_UNSIGNED_LONG_LONG:
+            return a->val.c_unsigned_long_long == v->c_unsigned_long_long;
+        case C_UINTMAX_T:
+            return a->val.c_uintmax_t == v->c_uintmax_t;
+        case C_SIZE_T:
+            return a->val.c_size_t == v->c_size_t;
+        case C_DOUBLE:
+            // Bit for bit, so 0.0 and -0.0 differ and a NaN repeats.
+            return 0 == memcmp(&a->val.c_double, &v->c_double, sizeof(double));
+        case C_LONG_DOUBLE:
+            return a->val.c_long_double == v->c_long_double &&
+                   signbit(a->val.c_long_double) == signbit(v->c_long_double);
+        case C_VOIDX:
+            return a->val.c_voidx == v->c_voidx;
+        default:
+            return false;    // Every %n has to be written back.
+    }
+}
+
+// The note printed after a row that stands for n copies, " (×n)", written
+// to buf. Returns its length in bytes; a row printed once has no note.
+size_t repeat_note(size_t n, char *buf, size_t size)
+{
+    int len;
+
+    if (n < 2)
+    {
+        buf[0] = '\0';
+        return 0;
+    }
+    len = snprintf(buf, size, " (\xc3\x97%zu)", n);    // U+00D7 in UTF-8
+    return (len > 0) ? (size_t) len : 0;
+}
+
+// In collapsing mode, count a row of f holding vals as one more copy of the
+// row captured just before it, if that row is the same.
+static bool collapse_row(const struct format *f, const value *vals)
+{
+    struct atom *row = state->last_row;
+    char note[32];
+
+    if (NULL == row || row->spec != &f->specs[0])
+    {
+        return false;
+    }
+    for (struct atom *c = row; NULL != c; c = c->right)
+    {
+        if (c->is_conversion_specification && !same_value(c, &vals[c->spec->conversion]))
+        {
+            return false;
+        }
+    }
+
+    state->repeat_bytes -= repeat_note(row->repeats + 1, note, sizeof(note));
+    row->repeats++;
+    state->repeat_bytes += repeat_note(row->repeats + 1, note, sizeof(note));
+    if (nfooters > 0)
+    {
+        for (struct atom *c = row; NULL != c; c = c->right)
+        {
+            if (c->is_conversion_specification)
+            {
+                accumulate(c);
+            }
+        }
+    }
+    return true;
+}
+
+// Add a row of f holding vals, which have already been read from the
+// caller's arguments.
+static void capture_values(struct format *f, const value *vals)
+{
+    struct atom *a = NULL;
+    struct atom *row;
+
+    if (f->tabulate == false)
+    {
+        do_tabulate = false;
+    }
+    if (collapse_rows && collapse_row(f, vals))
+    {
+        return;
+    }
+    note_row_format(f);
+    if (compact_rows && pack_row(f, vals))
+    {
+        return;
+    }
+    row = reuse_row(f);
+
+    for (size_t i = 0; i < f->nspecs; i++)
+    {
+        a = (NULL == row) ? create_atom(i == 0) : (i == 0) ? row : a->right;
+        a->spec = &f->specs[i];
+        a->is_conversion_specification = a->spec->is_conversion_specification;
+        if (a->is_conversion_specification)
+        {
+            store_value(a, &vals[a->spec->conversion]);
+        }
+        account_atom(a);
+    }
+    if (collapse_rows && f->nspecs > 0)
+    {
+        state->last_row = (NULL != row) ? row : state->bot_left->up;
+    }
+    if (f->nspecs > 0)
+    {
+        note_sort_key(f, (NULL != row) ? row : state->bot_left->up);
+    }
+}
+
+// Parse fmt into a new row of atoms, consuming one argument per conversion.
+void _capture(const char *fmt, va_list *args)
+{
+    struct atom *a = NULL;
+    struct format *f = lookup_format(fmt);
+    struct atom *row;
+    value *vals;
+
+    if (collapse_rows || compact_rows)
+    {
+        // Read the whole row first: a repeat never gets atoms, and a packed
+        // row doesn't get them until they're needed.
+        vals = row_values(f);
+        for (size_t j = 0; j < f->nconversions; j++)
+        {
+            fetch_value(f->specs[f->conversions[j]].type, args, &vals[j]);
+        }
+        capture_values(f, vals);
+        return;
+    }
+    if (f->tabulate == false)
+    {
+        do_tabulate = false;
+    }
+    note_row_format(f);
+    row = reuse_row(f);
+
+    /* There's a reasonable argument that newlines should be indicated by
+       '\n' in the ordinary text, which would allow successive calls to
+       cprintf() to populate a single line.  This raises, however, the
+       question of what to do with cprintf("\n\n") and similar.  For now,
+       keep parsing easy.
+    */
+    for (size_t i = 0; i < f->nspecs; i++)
+    {
+        a = (NULL == row) ? create_atom(i == 0) : (i == 0) ? row : a->right;
+        a->spec = &f->specs[i];
+        a->is_conversion_specification = a->spec->is_conversion_specification;
+        if (a->is_conversion_specification)
+        {
+            a->pargs = args;
+            calc_actual_width(a);
+            a->pargs = NULL;    // cleanup
+        }
+        account_atom(a);
+    }
+    if (f->nspecs > 0)
+    {
+        note_sort_key(f, (NULL != row) ? row : state->bot_left->up);
+    }
+}
+
+// Convert arg to the type sp's conversion expects, or stop if it can't be
+// converted to that type.
+static void typed_value(const struct spec *sp, const struct cprintf_arg *arg, value *v)
+{
+    int t = arg->type;
+    bool integer = (CPRINTF_ARG_SIGNED == t || CPRINTF_ARG_UNSIGNED == t);
+    bool floating = (CPRINTF_ARG_DOUBLE == t || CPRINTF_ARG_LONG_DOUBLE == t);
+    bool pointer = (CPRINTF_ARG_STRING == t || CPRINTF_ARG_INT_POINTER == t || CPRINTF_ARG_POINTER == t);
+    bool ok;
+    long long i = (CPRINTF_ARG_SIGNED == t) ? arg->value.i : (long long) arg->value.u;
+    long double x = arg->value.d;
+
+    if (CPRINTF_ARG_LONG_DOUBLE == t)
+    {
+        memcpy(&x, arg->value.ld, sizeof(x));
+    }
+
+    switch (sp->type)
+    {
+        case C_DOUBLE:
+        case C_LONG_DOUBLE:
+            ok = floating;
+            break;
+        case C_CHARX:
+            ok = (CPRINTF_ARG_STRING == t);
+            break;
+        case C_WCHAR_TX:
+            ok = (CPRINTF_ARG_INT_POINTER == t || CPRINTF_ARG_POINTER == t);
+            break;
+        case C_VOIDX:
+            ok = pointer;
+            break;
+        case C_INT_PTR:
+            ok = (CPRINTF_ARG_INT_POINTER == t);
+            break;
+        default:
+            ok = integer;
+            break;
+    }
+    if (!ok)
+    {
+        cprintf_error("Error in %s: Argument %zu doesn't match %s.", __PRETTY_FUNCTION__,
+                      sp->conversion + 1, sp->original_specification);
+    }
+
+    switch (sp->type)
+    {
+        case C_INT:
+            v->c_int = (int) i;
+            break;
+        case C_WINT_T:
+            v->c_wint_t = (wint_t) i;
+            break;
+        case C_LONG:
+            v->c_long = (long) i;
+            break;
+        case C_LONG_LONG:
+            v->c_long_long = i;
+            break;
+        case C_INTMAX_T:
+            v->c_intmax_t = i;
+            break;
+        case C_SSIZE_T:
+            v->c_ssize_t = (ssize_t) i;
+            break;
+        case C_PTRDIFF_T:
+            v->c_ptrdiff_t = (ptrdiff_t) i;
+            break;
+        case C_UNSIGNED_INT:
+            v->c_unsigned_int = (unsigned int) i;
+            break;
+        case C_UNSIGNED_LONG:
+            v->c_unsigned_long = (unsigned long) i;
+            break;
+        case C_UNSIGNED_LONG_LONG:
+            v->c_unsigned_long_long = (unsigned long long) i;
+            break;
+        case C_UINTMAX_T:
+            v->c_uintmax_t = (uintmax_t) i;
+            break;
+        case C_SIZE_T:
+            v->c_size_t = (size_t) i;
+            break;
+        case C_DOUBLE:
+            v->c_double = (CPRINTF_ARG_DOUBLE == t) ? arg->value.d : (double) x;
+            break;
+        case C_LONG_DOUBLE:
+            v->c_long_double = x;
+            break;
+        case C_CHARX:
+            v->c_charx = (char *) arg->value.p;
+            break;
+        case C_WCHAR_TX:
+            v->c_wchar_tx = (wchar_t *) arg->value.p;
+            break;
+        case C_VOIDX:
+            v->c_voidx = (void *) arg->value.p;
+            break;
+        case C_INT_PTR:
+            v->c_intp = (int *) arg->value.p;
+            break;
+        default:
+            break;
+    }
+}
+
+// Capture a row like _capture(), from arguments the CPRINTF() macros have
+// tagged with their types instead of a va_list.
+void _capture_typed(const char *fmt, size_t nargs, const struct cprintf_arg *args)
+{
+    struct format *f = lookup_format(fmt);
+    value *vals;
+
+    if (nargs != f->nconversions)
+    {
+        cprintf_error("Error in %s: %s takes %zu arguments, not %zu.", __PRETTY_FUNCTION__,
+                      fmt, f->nconversions, nargs);
+    }
+    vals = row_values(f);
+    for (size_t j = 0; j < f->nconversions; j++)
+    {
+        typed_value(&f->specs[f->conversions[j]], &args[j], &vals[j]);
+    }
+    capture_values(f, vals);
+}
+
+// Remember whether every row so far came from the same format string.
+void note_row_format(struct format *f)
+{
+    if (NULL == state->row_format)
+    {
+        state->row_format = f;
+    }
+    else if (state->row_format != f)
+    {
+        state->mixed_formats = true;
+    }
+}
+
+// Round n up so that whatever follows it in the ring is suitably aligned.
+static size_t ring_round(size_t n)
+{
+    size_t align = _Alignof(max_align_t);
+    return (n + align - 1) / align * align;
+}
+
+// Bytes of the string v holds that the table needs a copy of, or 0 if it
+// keeps the caller's pointer.
+static size_t string_copy_bytes(const struct spec *sp, const value *v)
+{
+    if (borrow_strings || sp->is_borrowed)
+    {
+        return 0;
+    }
+    if (C_CHARX == sp->type && NULL != v->c_charx)
+    {
+        return strlen(v->c_charx) + 1;
+    }
+    if (C_WCHAR_TX == sp->type && NULL != v->c_wchar_tx)
+    {
+        return (wcslen(v->c_wchar_tx) + 1) * sizeof(wchar_t);
+    }
+    return 0;
+}
+
+// Wait until the ring holds more than tail. Returns false once cprintf()
+// is done with the pipeline and every row in it has been captured.
+static bool wait_for_rows(struct pipeline *p, size_t tail)
+{
+    bool more;
+
+    for (int i = 0; i < PIPELINE_SPINS; i++)
+    {
+        if (atomic_load(&p->head) != tail)
+        {
+            return true;
+        }
+        if (atomic_load(&p->done))
+        {
+            return atomic_load(&p->head) != tail;
+        }
+        sched_yield();
+    }
+
+    // cprintf() checks sleeping after it moves head, so either it sees the
+    // flag and signals, or this sees the new head before waiting.
+    pthread_mutex_lock(&p->lock);
+    atomic_store(&p->sleeping, true);
+    while (atomic_load(&p->head) == tail && !atomic_load(&p->done))
+    {
+        pthread_cond_wait(&p->wake, &p->lock);
+    }
+    atomic_store(&p->sleeping, false);
+    more = (atomic_load(&p->head) != tail);
+    pthread_mutex_unlock(&p->lock);
+    return more;
+}
+
+// The formatter thread: capture the rows in the ring in the order they came.
+static void *run_pipeline(void *arg)
+{
+    struct pipeline *p = arg;
+    size_t tail = atomic_load_explicit(&p->tail, memory_order_relaxed);
+    size_t head;
+    struct record *rec;
+
+    for (;;)
+    {
+        head = atomic_load_explicit(&p->head, memory_order_acquire);
+        if (head == tail)
+        {
+            if (!wait_for_rows(p, tail))
+            {
+                // Its scratch space goes with the thread.
+                free(measure_scratch.buf);
+                free(excess_scratch.buf);
+                free(piece_scratch.buf);
+                return NULL;
+            }
+            continue;
+        }
+        while (tail != head)
+        {
+            rec = (struct record *) (p->ring + tail % PIPELINE_BYTES);
+            if (NULL != rec->f)
+            {
+                capture_values(rec->f, (value *) ((char *) rec + ring_round(sizeof(*rec))));
+            }
+            tail += rec->size;
+            // The row's strings have been copied, so cprintf() may reuse it.
+            atomic_store_explicit(&p->tail, tail, memory_order_release);
+        }
+    }
+}
+
+// Start the formatter thread for the current table. Returns false if it
+// can't be started, and rows are then captured by cprintf() as before.
+static bool start_pipeline(void)
+{
+    struct pipeline *p = &formatter;
+
+    p->ring = malloc(PIPELINE_BYTES);
+    if (NULL == p->ring)
+    {
+        cprintf_error("Memory allocation failed.", EXIT_FAILURE);
+    }
+    atomic_store(&p->head, 0);
+    atomic_store(&p->tail, 0);
+    atomic_store(&p->done, false);
+    atomic_store(&p->sleeping, false);
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->wake, NULL);
+    if (0 != pthread_create(&p->thread, NULL, run_pipeline, p))
+    {
+        cprintf_warning("Warning in %s: Unable to start the formatter thread.", __PRETTY_FUNCTION__);
+        pthread_cond_destroy(&p->wake);
+        pthread_mutex_destroy(&p->lock);
+        free(p->ring);
+        p->ring = NULL;
+        pipeline_mode = false;
+        return false;
+    }
+    p->running = true;
+    return true;
+}
+
+// Hand a row of f to the formatter thread, reading its arguments from args.
+// Strings go into the ring along with the row, so the caller may reuse them
+// as soon as cprintf() returns.
+void pipeline_row(struct format *f, va_list *args)
+{
+    struct pipeline *p = &formatter;
+    size_t n = f->nconversions;
+    size_t head, pad, size;
+    struct record *rec;
+    value *vals;
+    char *s;
+
+    if (n > p->vals_cap)
+    {
+        value *v = realloc(p->vals, n * sizeof(value));
+        size_t *l = (NULL == v) ? NULL : realloc(p->lens, n * sizeof(size_t));
+        if (NULL == l)
+        {
+            cprintf_error("Memory allocation failed.", EXIT_FAILURE);
+        }
+        p->vals = v;
+        p->lens = l;
+        p->vals_cap = n;
+    }
+
+    size = ring_round(sizeof(struct record)) + ring_round(n * sizeof(value));
+    for (size_t j = 0; j < n; j++)
+    {
+        const struct spec *sp = &f->specs[f->conversions[j]];
+        fetch_value(sp->type, args, &p->vals[j]);
+        p->lens[j] = string_copy_bytes(sp, &p->vals[j]);
+        size += (p->lens[j] + _Alignof(wchar_t) - 1) / _Alignof(wchar_t) * _Alignof(wchar_t);
+    }
+    size = ring_round(size);
+
+    if (size > PIPELINE_BYTES / 2 || (!p->running && !start_pipeline()))
+    {
+        // Too big to share the ring; catch up and capture it here.
+        finish_pipeline();
+        capture_values(f, p->vals);
+        return;
+    }
+
+    // A record never wraps; skip the rest of the ring if it doesn't fit.
+    head = atomic_load_explicit(&p->head, memory_order_relaxed);
+    pad = PIPELINE_BYTES - head % PIPELINE_BYTES;
+    pad = (pad < size) ? pad : 0;
+    while (PIPELINE_BYTES - (head - atomic_load_explicit(&p->tail, memory_order_acquire)) < pad + size)
+    {
+        sched_yield();
+    }
+    if (pad > 0)
+    {
+        rec = (struct record *) (p->ring + head % PIPELINE_BYTES);
+        rec->size = pad;
+        rec->f = NULL;
+        head += pad;
+    }
+
+    rec = (struct record *) (p->ring + head % PIPELINE_BYTES);
+    rec->size = size;
+    rec->f = f;
+    vals = (value *) ((char *) rec + ring_round(sizeof(*rec)));
+    memcpy(vals, p->vals, n * sizeof(value));
+    s = (char *) vals + ring_round(n * sizeof(value));
+    for (size_t j = 0; j < n; j++)
+    {
+        if (0 == p->lens[j])
+        {
+            continue;
+        }
+        if (C_CHARX == f->specs[f->conversions[j]].type)
+        {
+            memcpy(s, vals[j].c_charx, p->lens[j]);
+            vals[j].c_charx = s;
+        }
+        else
+        {
+            memcpy(s, vals[j].c_wchar_tx, p->lens[j]);
+            vals[j].c_wchar_tx = (wchar_t *) s;
+        }
+        s += (p->lens[j] + _Alignof(wchar_t) - 1) / _Alignof(wchar_t) * _Alignof(wchar_t);
+    }
+
+    atomic_store(&p->head, head + size);
+    if (atomic_load(&p->sleeping))
+    {
+        pthread_mutex_lock(&p->lock);
+        pthread_cond_signal(&p->wake);
+        pthread_mutex_unlock(&p->lock);
+    }
+}
+
+// Wait for the formatter thread to capture every row handed to it, then
+// stop it. Everything other than cprintf() calls this before it looks at or
+// changes the table.
+void finish_pipeline(void)
+{
+    struct pipeline *p = &formatter;
+
+    if (!p->running)
+    {
+        return;
+    }
+    atomic_store(&p->done, true);
+    pthread_mutex_lock(&p->lock);
+    pthread_cond_signal(&p->wake);
+    pthread_mutex_unlock(&p->lock);
+    pthread_join(p->thread, NULL);
+
+    pthread_cond_destroy(&p->wake);
+    pthread_mutex_destroy(&p->lock);
+    free(p->ring);
+    p->ring = NULL;
+    p->running = false;
+}
+
+// Rows handled per pass of _ingest(); bounds the scratch space it needs.
+#define INGEST_BLOCK 1024
+
+// Capture n rows of fmt whose j-th conversion reads its value for row i
+// from bases[j] + i * strides[j].
+void _ingest(const char *fmt, size_t n, const char *const bases[], const size_t strides[])
+{
+    struct format *f = lookup_format(fmt);
+    size_t k = f->nconversions;
+    value *vals;
+    size_t *widths;
+    struct atom *a = NULL;
+
+    if (f->tabulate == false)
+    {
+        do_tabulate = false;
+    }
+    note_row_format(f);
+    for (size_t i = 0; i < f->nspecs; i++)
+    {
+        if (f->specs[i].type == C_INT_PTR && f->specs[i].is_conversion_specification)
+        {
+            cprintf_error("Error in %s: %%n is not supported for bulk rows.", __PRETTY_FUNCTION__);
+        }
+    }
+    if (0 == k)
+    {
+        // Nothing to read, but the rows still have to exist.
+        for (size_t r = 0; r < n; r++)
+        {
+            _capture(fmt, NULL);
+        }
+        return;
+    }
+
+    vals = calloc(k * INGEST_BLOCK, sizeof(value));
+    widths = calloc(k * INGEST_BLOCK, sizeof(size_t));
+    if (NULL == vals || NULL == widths)
+    {
+        cprintf_error("Memory allocation failed.", EXIT_FAILURE);
+    }
+
+    for (size_t first = 0; first < n; first += INGEST_BLOCK)
+    {
+        size_t m = (n - first < INGEST_BLOCK) ? n - first : INGEST_BLOCK;
+
+        // Column at a time: load the values and, where no formatting is
+        // needed to know the answer, their widths.
+        for (size_t i = 0, j = 0; i < f->nspecs; i++)
+        {
+            const struct spec *sp = &f->specs[i];
+            if (!sp->is_conversion_specification)
+            {
+                continue;
+            }
+            const char *src = bases[j] + first * strides[j];
+            value *v = &vals[j * INGEST_BLOCK];
+            size_t *w = &widths[j * INGEST_BLOCK];
+
+            for (size_t r = 0; r < m; r++)
+            {
+                load_value(sp, src + r * strides[j], &v[r]);
+            }
+            if (sp->is_simple)
+            {
+                for (size_t r = 0; r < m; r++)
+                {
+                    w[r] = integer_width(sp, &v[r]);
+                }
+            }
+            j++;
+        }
+
+        // Row at a time: link the atoms into the graph.
+        for (size_t r = 0; r < m; r++)
+        {
+            struct atom *row = reuse_row(f);
+
+            for (size_t i = 0, j = 0; i < f->nspecs; i++)
+            {
+                a = (NULL == row) ? create_atom(i == 0) : (i == 0) ? row : a->right;
+                a->spec = &f->specs[i];
+                a->is_conversion_specification = a->spec->is_conversion_specification;
+                if (a->is_conversion_specification)
+                {
+                    a->type = a->spec->type;
+                    a->val = vals[j * INGEST_BLOCK + r];
+                    if (a->spec->is_simple)
+                    {
+                        a->original_field_width = widths[j * INGEST_BLOCK + r];
+                    }
+                    else
+                    {
+                        // Strings are kept just as cprintf() would keep them.
+                        keep_string(a);
+                        measure(a);
+                    }
+                    j++;
+                }
+                account_atom(a);
+            }
+        }
+    }
+
+    free(widths);
+    free(vals);
+}
+
+// Shared-memory publishing. Instead of printing, cflush() copies the typed
+// values of the table into a POSIX shared-memory object. A viewer process
+// (cprintf_view(), justify-view) rebuilds the table from the copy and pays
+// for the formatting. The region is guarded by a sequence lock: seq is odd
+// while the producer is writing, so a reader that sees the same even value
+// before and after its copy knows the copy is consistent.
+#define PUBLISH_MAGIC   0x6a757374u    // "just"
+#define PUBLISH_VERSION 2
+#define PUBLISH_MIN     (64 * 1024)
+#define PUBLISH_NULL    UINT64_MAX     // Length of a NULL string.
+
+struct published
+{
+    uint32_t magic;
+    uint32_t version;
+    _Atomic uint64_t seq;
+    uint64_t size;          // Bytes mapped, header included. Only grows.
+    uint64_t used;          // Payload bytes of the current table.
+    uint64_t nformats;
+    uint64_t ncolumns;
+    uint64_t nrows;
+    char payload[];
+};
+
+// Payload, every item padded to 8 bytes:
+//   nformats x { u64 length, format string }
+//   ncolumns x u64 width
+//   nrows x { u64 format index, per conversion: value or { u64 length, string } }
+// A NULL string is just its length, PUBLISH_NULL.
+
+static char *publish_name          = NULL;
+static int publish_fd              = -1;
+static struct published *published = NULL;
+static struct strbuf publish_buf   = { NULL, 0, 0 };
+
+static void put_u64(struct strbuf *sb, uint64_t v)
+{
+    sb_append(sb, (const char *) &v, sizeof(v));
+}
+
+static void put_bytes(struct strbuf *sb, const void *p, size_t n)
+{
+    static const char zeros[8] = { 0 };
+
+    if (NULL == p)
+    {
+        put_u64(sb, PUBLISH_NULL);
+        return;
+    }
+    put_u64(sb, n);
+    sb_append(sb, p, n);
+    sb_append(sb, zeros, (8 - n % 8) % 8);
+}
+
+static bool map_published(uint64_t size)
+{
+    if (NULL != published)
+    {
+        munmap(published, published->size);
+    }
+    if (ftruncate(publish_fd, size) != 0)
+    {
+        published = NULL;
+        return false;
+    }
+    published = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, publish_fd, 0);
+    if (MAP_FAILED == published)
+    {
+        published = NULL;
+        return false;
+    }
+    published->size = size;
+    return true;
+}
+
+// Index of the format spec belongs to, in state->formats order.
+static uint64_t format_index(const struct spec *sp)
+{
+    uint64_t i = 0;
+
+    for (struct format *f = state->formats; NULL != f; f = f->next, i++)
+    {
+        if (sp >= f->specs && sp < f->specs + f->nspecs)
+        {
+            break;
+        }
+    }
+    return i;
+}
+
+void publish_table(void)
+{
+    struct strbuf *sb = &publish_buf;
+    uint64_t nformats = 0, nrows = 0, size;
+
+    sb->len = 0;
+    for (struct format *f = state->formats; NULL != f; f = f->next)
+    {
+        put_bytes(sb, f->fmt, strlen(f->fmt));
+        nformats++;
+    }
+    for (size_t i = 0; i < state->used_columns; i++)
+    {
+        put_u64(sb, state->columns[i].is_conversion_specification ?
+                state->columns[i].max_width : 0);
+    }
+    for (struct atom *row = row_at(0, NULL); row != state->bot_left; row = row_at(++nrows, row))
+    {
+        put_u64(sb, format_index(row->spec));
+        for (struct atom *c = row; NULL != c; c = c->right)
+        {
+            if (!c->is_conversion_specification)
+            {
+                continue;
+            }
+            if (C_CHARX == c->type)
+            {
+                put_bytes(sb, c->val.c_charx,
+                          (NULL == c->val.c_charx) ? 0 : strlen(c->val.c_charx));
+            }
+            else if (C_WCHAR_TX == c->type)
+            {
+                put_bytes(sb, c->val.c_wchar_tx,
+                          (NULL == c->val.c_wchar_tx) ? 0 :
+                          wcslen(c->val.c_wchar_tx) * sizeof(wchar_t));
+            }
+            else
+            {
+                sb_append(sb, (const char *) &c->val, sizeof(value));
+            }
+        }
+    }
+
+    size = sizeof(struct published) + sb->len;
+    if (size > published->size)
+    {
+        uint64_t n = published->size;
+        while (n < size)
+        {
+            n *= 2;
+        }
+        if (!map_published(n))
+        {
+            cprintf_warning("Warning in %s: Unable to grow %s: %s", __PRETTY_FUNCTION__,
+                            publish_name, strerror(errno));
+            return;
+        }
+    }
+
+    uint64_t seq = atomic_load_explicit(&published->seq, memory_order_relaxed);
+    atomic_store_explicit(&published->seq, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    published->used = sb->len;
+    published->nformats = nformats;
+    published->ncolumns = state->used_columns;
+    published->nrows = nrows;
+    memcpy(published->payload, sb->buf, sb->len);
+    atomic_store_explicit(&published->seq, seq + 2, memory_order_release);
+}
+
+// Copy a consistent snapshot of the region name into malloc()ed memory.
+static struct published *snapshot(const char *name)
+{
+    int fd = shm_open(name, O_RDONLY, 0);
+    struct published *p = NULL, *copy = NULL;
+    struct stat st;
+    size_t mapped = 0;
+
+    if (fd < 0)
+    {
+        return NULL;
+    }
+    for (int tries = 0; tries < 10000 && NULL == copy; tries++)
+    {
+        if (fstat(fd, &st) != 0 || (size_t) st.st_size < sizeof(struct published))
+        {
+            break;
+        }
+        if ((size_t) st.st_size != mapped)
+        {
+            // The producer grew the region since we last looked.
+            if (NULL != p)
+            {
+                munmap(p, mapped);
+            }
+            mapped = st.st_size;
+            p = mmap(NULL, mapped, PROT_READ, MAP_SHARED, fd, 0);
+            if (MAP_FAILED == p)
+            {
+                p = NULL;
+                break;
+            }
+            if (p->magic != PUBLISH_MAGIC || p->version != PUBLISH_VERSION)
+            {
+                break;
+            }
+        }
+
+        uint64_t seq = atomic_load_explicit(&p->seq, memory_order_acquire);
+        uint64_t used = p->used;
+        if ((seq & 1) || sizeof(struct published) + used > mapped)
+        {
+            sched_yield();
+            continue;
+        }
+        copy = malloc(sizeof(struct published) + used);
+        if (NULL == copy)
+        {
+            cprintf_error("Memory allocation failed.", EXIT_FAILURE);
+        }
+        memcpy(copy, p, sizeof(struct published) + used);
+        atomic_thread_fence(memory_order_acquire);
+        if (atomic_load_explicit(&p->seq, memory_order_relaxed) != seq || copy->used != used)
+        {
+            free(copy);
+            copy = NULL;
+        }
+    }
+    if (NULL != p)
+    {
+        munmap(p, mapped);
+    }
+    close(fd);
+    return copy;
+}
+
+// Returns NULL for a NULL string.
+static const char *get_bytes(const char **p, uint64_t *n)
+{
+    const char *s;
+
+    memcpy(n, *p, sizeof(uint64_t));
+    s = *p + sizeof(uint64_t);
+    if (PUBLISH_NULL == *n)
+    {
+        *p = s;
+        return NULL;
+    }
+    *p = s + *n + (8 - *n % 8) % 8;
+    return s;
+}
+
+int cprintf_publish(const char *name)
+{
+    finish_pipeline();
+    if (NULL != published)
+    {
+        munmap(published, published->size);
+        published = NULL;
+    }
+    if (publish_fd >= 0)
+    {
+        close(publish_fd);
+        shm_unlink(publish_name);
+        publish_fd = -1;
+    }
+    free(publish_name);
+    publish_name = NULL;
+    if (NULL == name)
+    {
+        free(publish_buf.buf);
+        publish_buf.buf = NULL;
+        publish_buf.len = publish_buf.cap = 0;
+        return 0;
+    }
+
+    publish_fd = shm_open(name, O_CREAT | O_RDWR, 0644);
+    if (publish_fd < 0 || !map_published(PUBLISH_MIN))
+    {
+        cprintf_warning("Warning in %s: Unable to publish to %s: %s", __PRETTY_FUNCTION__,
+                        name, strerror(errno));
+        if (publish_fd >= 0)
+        {
+            close(publish_fd);
+            publish_fd = -1;
+        }
+        return -1;
+    }
+    publish_name = strdup(name);
+    published->magic = PUBLISH_MAGIC;
+    published->version = PUBLISH_VERSION;
+    published->used = 0;
+    published->nformats = 0;
+    published->ncolumns = 0;
+    published->nrows = 0;
+    atomic_store_explicit(&published->seq, 0, memory_order_release);
+    return 0;
+}
+
+int cprintf_view(const char *name, FILE *stream)
+{
+    static int ignored;    // Target for %n; the viewer has nowhere to write back.
+    struct published *copy = snapshot(name);
+    struct format **formats;
+    size_t *widths;
+    const char *p;
+    struct atom *a = NULL;
+    uint64_t n;
+
+    if (NULL == copy)
+    {
+        return -1;
+    }
+    if (0 == copy->nrows)
+    {
+        free(copy);
+        return 0;
+    }
+
+    bind_stream(stream);
+    formats = calloc(copy->nformats, sizeof(struct format *));
+    widths = calloc(copy->ncolumns + 1, sizeof(size_t));
+    if (NULL == formats || NULL == widths)
+    {
+        cprintf_error("Memory allocation failed.", EXIT_FAILURE);
+    }
+
+    p = copy->payload;
+    for (uint64_t i = 0; i < copy->nformats; i++)
+    {
+        const char *s = get_bytes(&p, &n);
+        char *fmt = (NULL == s) ? NULL : strndup(s, n);
+
+        if (NULL == fmt)
+        {
+            cprintf_error("Error in %s: %s is corrupt.", __PRETTY_FUNCTION__, name);
+        }
+        formats[i] = lookup_format(fmt);
+        free(fmt);
+    }
+    for (uint64_t i = 0; i < copy->ncolumns; i++)
+    {
+        memcpy(&n, p, sizeof(n));
+        widths[i] = n;
+        p += sizeof(n);
+    }
+    for (uint64_t r = 0; r < copy->nrows; r++)
+    {
+        memcpy(&n, p, sizeof(n));
+        p += sizeof(n);
+        if (n >= copy->nformats)
+        {
+            cprintf_error("Error in %s: %s is corrupt.", __PRETTY_FUNCTION__, name);
+        }
+        struct format *f = formats[n];
+        if (f->tabulate == false)
+        {
+            do_tabulate = false;
+        }
+        note_row_format(f);
+
+        // Rebuild the row as _capture() would have, reading values from the copy.
+        for (size_t i = 0; i < f->nspecs; i++)
+        {
+            a = create_atom(i == 0);
+            a->spec = &f->specs[i];
+            a->is_conversion_specification = a->spec->is_conversion_specification;
+            if (a->is_conversion_specification)
+            {
+                a->type = a->spec->type;
+                if (C_CHARX == a->type)
+                {
+                    const char *s = get_bytes(&p, &n);
+                    a->val.c_charx = NULL;
+                    if (NULL != s)
+                    {
+                        a->val.c_charx = copy_string(s, n + 1);
+                        a->val.c_charx[n] = '\0';
+                    }
+                }
+                else if (C_WCHAR_TX == a->type)
+                {
+                    const char *s = get_bytes(&p, &n);
+                    a->val.c_wchar_tx = NULL;
+                    if (NULL != s)
+                    {
+                        a->val.c_wchar_tx = copy_string(s, n + sizeof(wchar_t));
+                        a->val.c_wchar_tx[n / sizeof(wchar_t)] = L'\0';
+                    }
+                }
+                else
+                {
+                    memcpy(&a->val, p, sizeof(value));
+                    p += sizeof(value);
+                }
+                if (C_INT_PTR == a->type)
+                {
+                    a->val.c_intp = &ignored;
+                    a->original_field_width = 0;
+                }
+                else
+                {
+                    measure(a);
+                }
+            }
+            account_atom(a);
+        }
+    }
+
+    // The producer's widths were taken over the same values, but keep them
+    // as a floor in case this side measures something narrower.
+    cprintf_set_widths(widths, copy->ncolumns);
+    free(widths);
+    free(formats);
+    free(copy);
+    cflush();
+    return 0;
+}
+
+// The value of a as a number, if it is one.
+static bool numeric_value(const struct atom *a, long double *x)
+{
+    switch (a->type)
+    {
+        case C_INT:
+            if ('c' == a->spec->conversion_specifier[0])
+            {
+                return false;
+            }
+            *x = a->val.c_int;
+            return true;
+        case C_LONG:
+            *x = a->val.c_long;
+            return true;
+        case C_LONG_LONG:
+            *x = a->val.c_long_long;
+            return true;
+        case C_INTMAX_T:
+            *x = a->val.c_intmax_t;
+            return true;
+        case C_SSIZE_T:
+            *x = a->val.c_ssize_t;
+            return true;
+        case C_PTRDIFF_T:
+            *x = a->val.c_ptrdiff_t;
+            return true;
+        case C_UNSIGNED_INT:
+            *x = a->val.c_unsigned_int;
+            return true;
+        case C_UNSIGNED_LONG:
+            *x = a->val.c_unsigned_long;
+            return true;
+        case C_UNSIGNED_LONG_LONG:
+            *x = a->val.c_unsigned_long_long;
+            return true;
+        case C_UINTMAX_T:
+            *x = a->val.c_uintmax_t;
+            return true;
+        case C_SIZE_T:
+            *x = a->val.c_size_t;
+            return true;
+        case C_DOUBLE:
+            *x = a->val.c_double;
+            return true;
+        case C_LONG_DOUBLE:
+            *x = a->val.c_long_double;
+            return true;
+        default:
+            return false;
+    }
+}
+
+// Fold the conversion a into its footer's totals.
+void accumulate(struct atom *a)
+{
+    struct footer *fo;
+    long double x;
+
+    if (a->spec->conversion >= nfooters || 0 == footers[a->spec->conversion].ops ||
+        !numeric_value(a, &x))
+    {
+        return;
+    }
+    fo = &footers[a->spec->conversion];
+    fo->count++;
+    fo->sum += x;
+    if (x < fo->min)
+    {
+        fo->min = x;
+    }
+    if (x > fo->max)
+    {
+        fo->max = x;
+    }
+}
+
+void reset_footers(void)
+{
+    for (size_t i = 0; i < nfooters; i++)
+    {
+        footers[i].count = 0;
+        footers[i].sum = 0;
+        footers[i].min = LDBL_MAX;
+        footers[i].max = -LDBL_MAX;
+    }
+    footer_dirty = false;
+}
+
+static bool is_floating(const struct spec *sp)
+{
+    return C_DOUBLE == sp->type || C_LONG_DOUBLE == sp->type;
+}
+
+// Append one footer row per requested reduction, laid out like the last
+// row of the table: reduced conversions get their result, the first other
+// string conversion gets the reduction's name, the rest are left blank.
+void append_footers(void)
+{
+    static const char *names[] = { "sum", "min", "max", "mean", "count" };
+    struct format *f = format_of(state->bot_left->up->spec);
+    struct strbuf fmt = { NULL, 0, 0 };
+    value *vals;
+    unsigned ops = 0;
+
+    if (footer_dirty)
+    {
+        reset_footers();
+        for (struct atom *row = state->origin; row != state->bot_left; row = row->down)
+        {
+            for (struct atom *c = row; NULL != c; c = c->right)
+            {
+                for (size_t k = 0; c->is_conversion_specification && k <= row->repeats; k++)
+                {
+                    accumulate(c);
+                }
+            }
+        }
+    }
+    for (size_t i = 0; i < nfooters; i++)
+    {
+        ops |= footers[i].ops;
+    }
+    vals = calloc(f->nconversions + 1, sizeof(value));
+    if (NULL == vals)
+    {
+        cprintf_error("Memory allocation failed.", EXIT_FAILURE);
+    }
+
+    adding_footers = true;
+    for (unsigned k = 0; k < 5; k++)
+    {
+        unsigned op = 1u << k;
+        bool labeled = false;
+
+        if (!(ops & op))
+        {
+            continue;
+        }
+        fmt.len = 0;
+        for (size_t i = 0; i < f->nspecs; i++)
+        {
+            const struct spec *sp = &f->specs[i];
+            const struct footer *fo = (sp->conversion < nfooters) ? &footers[sp->conversion] : NULL;
+            const char *dash = (sp->is_conversion_specification && strchr(sp->flags, '-')) ? "-" : "";
+            value *v = &vals[sp->conversion];
+
+            if (!sp->is_conversion_specification)
+            {
+                sb_append(&fmt, sp->ordinary_text, sp->text_len);
+            }
+            else if (NULL != fo && (fo->ops & op) && CPRINTF_REDUCE_COUNT == op)
+            {
+                sb_printf(&fmt, "%%%s%szu", dash, sp->field_width);
+                v->c_size_t = fo->count;
+            }
+            else if (NULL != fo && (fo->ops & op) && fo->count > 0)
+            {
+                long double x = (CPRINTF_REDUCE_SUM == op) ? fo->sum :
+                                (CPRINTF_REDUCE_MIN == op) ? fo->min :
+                                (CPRINTF_REDUCE_MAX == op) ? fo->max : fo->sum / fo->count;
+
+                if (NULL != sp->custom)
+                {
+                    // Printed by the same callbacks as the values.
+                    sb_printf(&fmt, "%%%s%s%s%s", sp->flags, sp->field_width, sp->precision,
+                              sp->conversion_specifier);
+                    switch (sp->type)
+                    {
+                        case C_LONG_LONG:
+                            v->c_long_long = (long long) x;
+                            break;
+                        case C_UNSIGNED_LONG_LONG:
+                            v->c_unsigned_long_long = (unsigned long long) x;
+                            break;
+                        case C_DOUBLE:
+                            v->c_double = (double) x;
+                            break;
+                        default:
+                            v->c_long_double = x;
+                            break;
+                    }
+                }
+                else if (is_floating(sp))
+                {
+                    sb_printf(&fmt, "%%%s%s%sL%s", sp->flags, sp->field_width, sp->precision,
+                              sp->conversion_specifier);
+                    v->c_long_double = x;
+                }
+                else if (CPRINTF_REDUCE_MEAN == op)
+                {
+                    sb_printf(&fmt, "%%%s%s.2Lf", sp->flags, sp->field_width);
+                    v->c_long_double = x;
+                }
+                else if (sp->is_signed)
+                {
+                    sb_printf(&fmt, "%%%s%s%sj%s", sp->flags, sp->field_width, sp->precision,
+                              sp->conversion_specifier);
+                    v->c_intmax_t = (intmax_t) x;
+                }
+                else
+                {
+                    sb_printf(&fmt, "%%%s%s%sj%s", sp->flags, sp->field_width, sp->precision,
+                              sp->conversion_specifier);
+                    v->c_uintmax_t = (uintmax_t) x;
+                }
+            }
+            else
+            {
+                sb_printf(&fmt, "%%%s%ss", dash, sp->field_width);
+                v->c_charx = (!labeled && C_CHARX == sp->type) ? (char *) names[k] : "";
+                labeled = labeled || C_CHARX == sp->type;
+            }
+        }
+
+        // Capture the row as _capture() would, from vals.
+        struct format *g = lookup_format(fmt.buf);
+        if (g->tabulate == false)
+        {
+            do_tabulate = false;
+        }
+        note_row_format(g);
+        for (size_t i = 0; i < g->nspecs; i++)
+        {
+            struct atom *a = create_atom(i == 0);
+            a->spec = &g->specs[i];
+            a->is_conversion_specification = a->spec->is_conversion_specification;
+            if (a->is_conversion_specification)
+            {
+                a->type = a->spec->type;
+                // Labels are string literals, so they can always be borrowed.
+                a->val = vals[a->spec->conversion];
+                measure(a);
+            }
+            account_atom(a);
+        }
+    }
+    adding_footers = false;
+    free(fmt.buf);
+    free(vals);
+}
+
+// Append a's value to sb as plain text: integers in decimal, floating point
+// with enough digits to read back the same value, text as printf() has it.
+// Returns false for values that have no text (%n).
+static bool datum_text(struct atom *a, struct strbuf *sb, bool *is_text)
+{
+    char spec[64];
+
+    *is_text = false;
+    switch (a->type)
+    {
+        case C_INT:
+            if ('c' == a->spec->conversion_specifier[0])
+            {
+                break;
+            }
+            sb_printf(sb, "%d", a->val.c_int);
+            return true;
+        case C_LONG:
+            sb_printf(sb, "%ld", a->val.c_long);
+            return true;
+        case C_LONG_LONG:
+            sb_printf(sb, "%lld", a->val.c_long_long);
+            return true;
+        case C_INTMAX_T:
+            sb_printf(sb, "%jd", a->val.c_intmax_t);
+            return true;
+        case C_SSIZE_T:
+            sb_printf(sb, "%zd", a->val.c_ssize_t);
+            return true;
+        case C_PTRDIFF_T:
+            sb_printf(sb, "%td", a->val.c_ptrdiff_t);
+            return true;
+        case C_UNSIGNED_INT:
+            sb_printf(sb, "%u", a->val.c_unsigned_int);
+            return true;
+        case C_UNSIGNED_LONG:
+            sb_printf(sb, "%lu", a->val.c_unsigned_long);
+            return true;
+        case C_UNSIGNED_LONG_LONG:
+            sb_printf(sb, "%llu", a->val.c_unsigned_long_long);
+            return true;
+        case C_UINTMAX_T:
+            sb_printf(sb, "%ju", a->val.c_uintmax_t);
+            return true;
+        case C_SIZE_T:
+            sb_printf(sb, "%zu", a->val.c_size_t);
+            return true;
+        case C_DOUBLE:
+            sb_printf(sb, "%.17g", a->val.c_double);
+            return true;
+        case C_LONG_DOUBLE:
+            sb_printf(sb, "%.21Lg", a->val.c_long_double);
+            return true;
+        case C_INT_PTR:
+            return false;
+        default:
+            break;
+    }
+    // Strings, characters and pointers, without padding.
+    *is_text = true;
+    unpadded_specification(a, spec, sizeof(spec));
+    render_value(a, spec, sb);
+    return true;
+}
+
+// Append the text at s to sb escaped for the given kind of output.
+static void escape_datum(const char *s, size_t len, int kind, struct strbuf *sb)
+{
+    bool quote = (CPRINTF_JSONL == kind) ||
+                 (CPRINTF_CSV == kind && len != strcspn(s, ",\"\r\n"));
+
+    if (quote)
+    {
+        sb_append(sb, "\"", 1);
+    }
+    for (size_t i = 0; i < len; i++)
+    {
+        unsigned char ch = s[i];
+        if (CPRINTF_CSV == kind && '"' == ch)
+        {
+            sb_append(sb, "\"\"", 2);
+        }
+        else if (CPRINTF_CSV == kind)
+        {
+            sb_append(sb, s + i, 1);
+        }
+        else if ('\\' == ch)
+        {
+            sb_append(sb, "\\\\", 2);
+        }
+        else if ('\t' == ch)
+        {
+            sb_append(sb, "\\t", 2);
+        }
+        else if ('\n' == ch)
+        {
+            sb_append(sb, "\\n", 2);
+        }
+        else if ('\r' == ch)
+        {
+            sb_append(sb, "\\r", 2);
+        }
+        else if (CPRINTF_JSONL == kind && '"' == ch)
+        {
+            sb_append(sb, "\\\"", 2);
+        }
+        else if (CPRINTF_JSONL == kind && ch < 0x20)
+        {
+            sb_printf(sb, "\\u%04x", ch);
+        }
+        else
+        {
+            sb_append(sb, s + i, 1);
+        }
+    }
+    if (quote)
+    {
+        sb_append(sb, "\"", 1);
+    }
+}
+
+// One line per row holding only the values, as CSV, TSV or a JSON array.
+static void write_delimited(FILE *stream, int kind, struct strbuf *sb, struct strbuf *tmp)
+{
+    const char *sep = (CPRINTF_CSV == kind) ? "," : (CPRINTF_TSV == kind) ? "\t" : ",";
+
+    size_t k = 0;
+
+    for (struct atom *row = row_at(0, NULL); row != state->bot_left; row = row_at(++k, row))
+    {
+        bool first = true, is_text;
+
+        sb->len = 0;
+        if (CPRINTF_JSONL == kind)
+        {
+            sb_append(sb, "[", 1);
+        }
+        for (struct atom *c = row; NULL != c; c = c->right)
+        {
+            if (!c->is_conversion_specification || c->spec->is_hidden)
+            {
+                continue;
+            }
+            if (!first)
+            {
+                sb_append(sb, sep, 1);
+            }
+            first = false;
+
+            tmp->len = 0;
+            if (!datum_text(c, tmp, &is_text))
+            {
+                if (CPRINTF_JSONL == kind)
+                {
+                    sb_append(sb, "null", 4);
+                }
+            }
+            else if (is_text)
+            {
+                escape_datum(tmp->buf, tmp->len, kind, sb);
+            }
+            else if (CPRINTF_JSONL == kind && tmp->len != strspn(tmp->buf, "0123456789+-.eE"))
+            {
+                sb_append(sb, "null", 4);    // JSON has no inf or nan.
+            }
+            else
+            {
+                sb_append(sb, tmp->buf, tmp->len);
+            }
+        }
+        if (CPRINTF_JSONL == kind)
+        {
+            sb_append(sb, "]", 1);
+        }
+        sb_append(sb, "\n", 1);
+        for (size_t k = 0; k <= row->repeats; k++)
+        {
+            fwrite(sb->buf, 1, sb->len, stream);    // Collapsed rows are written out again.
+        }
+    }
+}
+
+// An integer value as intmax_t; unsigned values come back unchanged when
+// converted to uintmax_t.
+static intmax_t widen_integer(const struct atom *a)
+{
+    switch (a->type)
+    {
+        case C_INT:
+            return a->val.c_int;
+        case C_LONG:
+            return a->val.c_long;
+        case C_LONG_LONG:
+            return a->val.c_long_long;
+        case C_INTMAX_T:
+            return a->val.c_intmax_t;
+        case C_SSIZE_T:
+            return a->val.c_ssize_t;
+        case C_PTRDIFF_T:
+            return a->val.c_ptrdiff_t;
+        case C_UNSIGNED_INT:
+            return (intmax_t) a->val.c_unsigned_int;
+        case C_UNSIGNED_LONG:
+            return (intmax_t) a->val.c_unsigned_long;
+        case C_UNSIGNED_LONG_LONG:
+            return (intmax_t) a->val.c_unsigned_long_long;
+        case C_UINTMAX_T:
+            return (intmax_t) a->val.c_uintmax_t;
+        case C_SIZE_T:
+            return (intmax_t) a->val.c_size_t;
+        default:
+            return 0;
+    }
+}
+
+// Kind and size of a column in the binary output.
+static void binary_type(const struct spec *sp, char *kind, uint8_t *size)
+{
+    switch (sp->type)
+    {
+        case C_DOUBLE:
+            *kind = 'f';
+            *size = sizeof(double);
+            break;
+        case C_LONG_DOUBLE:
+            *kind = 'f';
+            *size = sizeof(long double);
+            break;
+        case C_INT_PTR:
+            *kind = 'n';
+            *size = 0;
+            break;
+        case C_CHARX:
+        case C_WCHAR_TX:
+        case C_WINT_T:
+        case C_VOIDX:
+            *kind = 's';
+            *size = 0;
+            break;
+        default:
+            if ('c' == sp->conversion_specifier[0])
+            {
+                *kind = 's';
+                *size = 0;
+            }
+            else
+            {
+                *kind = (sp->is_signed) ? 'i' : 'u';
+                *size = sizeof(intmax_t);
+            }
+            break;
+    }
+}
+
+// Column-major blocks, one per run of rows sharing a format. Each block is
+// "JSTB", u32 version, u64 rows, u32 columns, a (kind, size) byte pair per
+// column, then every column's values in turn. Kinds are 'i' and 'u'
+// (8-byte integers), 'f' (double or long double, by size), 's' (u32 length
+// and bytes) and 'n' (%n, no data). Everything is in native byte order.
+static void write_binary(FILE *stream, struct strbuf *sb, struct strbuf *tmp)
+{
+    struct atom *row = row_at(0, NULL), *end, *r, *c;
+    size_t k = 0, kend, kr;
+
+    while (row != state->bot_left)
+    {
+        struct format *f = format_of(row->spec);
+        uint64_t n = 0;
+        uint32_t u32;
+        bool is_text;
+
+        for (end = row, kend = k; end != state->bot_left && end->spec == row->spec; end = row_at(++kend, end))
+        {
+            n += 1 + end->repeats;
+        }
+
+        sb->len = 0;
+        sb_append(sb, "JSTB", 4);
+        u32 = 1;
+        sb_append(sb, (const char *) &u32, sizeof(u32));
+        sb_append(sb, (const char *) &n, sizeof(n));
+        u32 = 0;
+        for (size_t j = 0; j < f->nconversions; j++)
+        {
+            u32 += !f->specs[f->conversions[j]].is_hidden;
+        }
+        sb_append(sb, (const char *) &u32, sizeof(u32));
+        for (size_t j = 0; j < f->nconversions; j++)
+        {
+            char kind;
+            uint8_t size;
+            if (f->specs[f->conversions[j]].is_hidden)
+            {
+                continue;
+            }
+            binary_type(&f->specs[f->conversions[j]], &kind, &size);
+            sb_append(sb, &kind, 1);
+            sb_append(sb, (const char *) &size, 1);
+        }
+
+        for (size_t j = 0; j < f->nconversions; j++)
+        {
+            char kind;
+            uint8_t size;
+            if (f->specs[f->conversions[j]].is_hidden)
+            {
+                continue;
+            }
+            binary_type(&f->specs[f->conversions[j]], &kind, &size);
+            for (r = row, kr = k; kr < kend; r = row_at(++kr, r))
+            {
+                size_t at = sb->len, len;
+
+                c = r;
+                for (size_t i = 0; i < f->conversions[j]; i++)
+                {
+                    c = c->right;
+                }
+                if ('f' == kind && sizeof(double) == size)
+                {
+                    sb_append(sb, (const char *) &c->val.c_double, size);
+                }
+                else if ('f' == kind)
+                {
+                    sb_append(sb, (const char *) &c->val.c_long_double, size);
+                }
+                else if ('i' == kind)
+                {
+                    intmax_t i = widen_integer(c);
+                    sb_append(sb, (const char *) &i, sizeof(i));
+                }
+                else if ('u' == kind)
+                {
+                    uintmax_t u = (uintmax_t) widen_integer(c);
+                    sb_append(sb, (const char *) &u, sizeof(u));
+                }
+                else if ('s' == kind)
+                {
+                    tmp->len = 0;
+                    datum_text(c, tmp, &is_text);
+                    u32 = tmp->len;
+                    sb_append(sb, (const char *) &u32, sizeof(u32));
+                    sb_append(sb, tmp->buf, tmp->len);
+                }
+
+                // Each copy a collapsed row stands for gets the value again.
+                len = sb->len - at;
+                for (size_t k = 0; k < r->repeats; k++)
+                {
+                    sb_reserve(sb, len);
+                    memcpy(sb->buf + sb->len, sb->buf + at, len);
+                    sb->len += len;
+                }
+            }
+        }
+        fwrite(sb->buf, 1, sb->len, stream);
+        row = end;
+        k = kend;
+    }
+}
+
+void write_data_outputs(void)
+{
+    struct strbuf sb = { NULL, 0, 0 }, tmp = { NULL, 0, 0 };
+
+    for (size_t i = 0; i < noutputs; i++)
+    {
+        switch (outputs[i].kind)
+        {
+            case CPRINTF_CSV:
+            case CPRINTF_TSV:
+            case CPRINTF_JSONL:
+                write_delimited(outputs[i].stream, outputs[i].kind, &sb, &tmp);
+                break;
+            case CPRINTF_BINARY:
+                write_binary(outputs[i].stream, &sb, &tmp);
+                break;
+            default:
+                break;    // Text copies are made as rows are emitted.
+        }
+    }
+    free(tmp.buf);
+    free(sb.buf);
+}
+
+// Callback for exit() to free memory
+void exit_nice(void)
+{
+    if (is_initialized == true)
+    {
+        retain_mode = false;
+        cflush();
+    }
+}
+
+void cprintf(const char *fmt, ...)
+{
+    va_list args;
+    va_start(args, fmt);
+    _cprintf(stdout, fmt, &args);
+    va_end(args);
+}
+
+void cfprintf(FILE *stream, const char *fmt, ...)
+{
+    va_list args;
+    va_start(args, fmt);
+    _cprintf(stream, fmt, &args);
+    va_end(args);
+}
+
+void cvprintf(const char *fmt, va_list args)
+{
+    va_list args2;
+    va_copy(args2, args);
+    _cprintf(stdout, fmt, &args2);
+    va_end(args2);
+}
+
+void cvfprintf(FILE *stream, const char *fmt, va_list args)
+{
+    va_list args2;
+    va_copy(args2, args);
+    _cprintf(stream, fmt, &args2);
+    va_end(args2);
+}
+
+int csnprintf(char *str, size_t size, const char *fmt, ...)
+{
+    int rc;
+    va_list args;
+    va_start(args, fmt);
+    rc = _csnprintf(str, size, fmt, &args);
+    va_end(args);
+    return rc;
+}
+
+int cvsnprintf(char *str, size_t size, const char *fmt, va_list args)
+{
+    int rc;
+    va_list args2;
+    va_copy(args2, args);
+    rc = _csnprintf(str, size, fmt, &args2);
+    va_end(args2);
+    return rc;
+}
+
+void cprintf_typed(const char *fmt, size_t nargs, const struct cprintf_arg *args)
+{
+    cfprintf_typed(stdout, fmt, nargs, args);
+}
+
+void cfprintf_typed(FILE *stream, const char *fmt, size_t nargs, const struct cprintf_arg *args)
+{
+    finish_pipeline();
+    if (fileno(stream) == -1)
+    {
+        cprintf_error("Error: Invalid stream\n", EXIT_FAILURE);
+    }
+    if (fmt == NULL || (nargs > 0 && args == NULL))
+    {
+        cprintf_error("Error: Invalid arguments to %s\n", __PRETTY_FUNCTION__);
+    }
+    bind_stream(stream);
+    _capture_typed(fmt, nargs, args);
+}
+
+struct cprintf_table *cprintf_table_alloc(const char *fmt, size_t nrows)
+{
+    struct cprintf_table *t;
+    struct format *f;
+    struct atom *a = NULL, *row;
+
+    finish_pipeline();
+    if (fmt == NULL)
+    {
+        cprintf_error("Error: Invalid arguments to %s\n", __PRETTY_FUNCTION__);
+    }
+    bind_stream(stdout);
+    f = lookup_format(fmt);
+    for (size_t i = 0; i < f->nspecs; i++)
+    {
+        if (f->specs[i].type == C_INT_PTR && f->specs[i].is_conversion_specification)
+        {
+            cprintf_error("Error in %s: %%n is not supported for bulk rows.", __PRETTY_FUNCTION__);
+        }
+    }
+    if (f->tabulate == false)
+    {
+        do_tabulate = false;
+    }
+
+    t = calloc(1, sizeof(struct cprintf_table));
+    if (NULL == t)
+    {
+        cprintf_error("Memory allocation failed.", EXIT_FAILURE);
+    }
+    t->rows = malloc((nrows + 1) * sizeof(struct atom *));
+    t->filled = calloc(nrows + 1, sizeof(bool));
+    if (NULL == t->rows || NULL == t->filled)
+    {
+        cprintf_error("Memory allocation failed.", EXIT_FAILURE);
+    }
+    t->f = f;
+    t->nrows = nrows;
+    t->merged = false;
+    t->generation = ++table_generation;
+    atomic_init(&t->strings, NULL);
+    atomic_init(&t->multibyte_excess, 0);
+    t->next = tables;
+    tables = t;
+
+    // Link every row now, in order, so filling them needs no shared state.
+    for (size_t r = 0; r < nrows; r++)
+    {
+        note_row_format(f);
+        row = reuse_row(f);
+        for (size_t i = 0; i < f->nspecs; i++)
+        {
+            a = (NULL == row) ? create_atom(i == 0) : (i == 0) ? row : a->right;
+            a->spec = &f->specs[i];
+            a->is_conversion_specification = a->spec->is_conversion_specification;
+            a->type = a->spec->type;
+            memset(&a->val, 0, sizeof(value));
+            if (C_CHARX == a->type)
+            {
+                a->val.c_charx = "";
+            }
+            else if (C_WCHAR_TX == a->type)
+            {
+                a->val.c_wchar_tx = L"";
+            }
+            a->original_field_width = 0;
+            a->is_multibyte = false;
+        }
+        t->rows[r] = (0 == f->nspecs) ? NULL : (NULL == row) ? state->last_atom_on_last_line : row;
+        while (NULL != t->rows[r] && NULL != t->rows[r]->left)
+        {
+            t->rows[r] = t->rows[r]->left;
+        }
+    }
+    return t;
+}
+
+void cprintf_fill_row(struct cprintf_table *table, size_t i, ...)
+{
+    va_list args;
+
+    if (NULL == table || i >= table->nrows)
+    {
+        cprintf_error("Error: Invalid arguments to %s\n", __PRETTY_FUNCTION__);
+    }
+    if (table->merged)
+    {
+        cprintf_error("Error in %s: Rows have to be filled before the table's widths are used.",
+                      __PRETTY_FUNCTION__);
+    }
+
+    filling = table;
+    va_start(args, i);
+    for (struct atom *a = table->rows[i]; NULL != a; a = a->right)
+    {
+        if (a->is_conversion_specification)
+        {
+            a->is_multibyte = false;
+            a->pargs = &args;
+            calc_actual_width(a);
+            a->pargs = NULL;
+        }
+    }
+    va_end(args);
+    filling = NULL;
+    table->filled[i] = true;
+}
+
+// Recompute the column totals from scratch after columns were hidden or
+// shown with rows already captured, measuring the cells that were skipped
+// while their column was hidden.
+static void recount_hidden(void)
+{
+    hidden_changed = false;
+    for (size_t i = 0; i < state->ncolumns; i++)
+    {
+        struct column *k = &state->columns[i];
+        k->is_conversion_specification = false;
+        k->max_width = 0;
+        k->width_sum = 0;
+        k->count = 0;
+        if (NULL != k->hist)
+        {
+            memset(k->hist, 0, k->hist_cap * sizeof(size_t));
+        }
+    }
+    state->text_bytes = 0;
+    state->multibyte_excess = 0;
+    for (struct atom *row = state->origin; NULL != row && row != state->bot_left; row = row->down)
+    {
+        for (struct atom *c = row; NULL != c; c = c->right)
+        {
+            if (c->is_conversion_specification && !c->spec->is_hidden &&
+                (c->is_deferred || c->is_multibyte))
+            {
+                c->is_multibyte = false;
+                measure(c);
+            }
+            account_atom(c);
+        }
+    }
+    footer_dirty = true;
+}
+
+// Account for the rows of every table that hasn't been merged yet. Rows
+// nobody filled are measured as zeros and empty strings.
+void merge_tables(void)
+{
+    for (struct cprintf_table *t = tables; NULL != t && !t->merged; t = t->next)
+    {
+        struct chunk *c = atomic_load(&t->strings), *last = c;
+
+        for (size_t r = 0; r < t->nrows; r++)
+        {
+            for (struct atom *a = t->rows[r]; NULL != a; a = a->right)
+            {
+                if (!t->filled[r] && a->is_conversion_specification)
+                {
+                    measure(a);
+                }
+                account_atom(a);
+            }
+        }
+        state->multibyte_excess += atomic_load(&t->multibyte_excess);
+
+        // The strings now belong to the graph.
+        if (NULL != c)
+        {
+            while (NULL != last->next)
+            {
+                last = last->next;
+            }
+            last->next = state->strings;
+            state->strings = c;
+            if (NULL == state->string_chunk)
+            {
+                state->string_chunk = last;
+            }
+        }
+        t->merged = true;
+    }
+    if (hidden_changed)
+    {
+        unpack_rows();
+        recount_hidden();
+    }
+}
+
+void free_tables(void)
+{
+    while (NULL != tables)
+    {
+        struct cprintf_table *next = tables->next;
+        free(tables->rows);
+        free(tables->filled);
+        free(tables);
+        tables = next;
+    }
+}
+
+void cprintf_rows(const char *fmt, size_t n, const void *base, size_t stride,
+                  const size_t offsets[])
+{
+    const char **bases;
+    size_t *strides;
+    size_t k;
+
+    finish_pipeline();
+    if (fmt == NULL || (n > 0 && (base == NULL || offsets == NULL)))
+    {
+        cprintf_error("Error: Invalid arguments to %s\n", __PRETTY_FUNCTION__);
+    }
+    bind_stream(stdout);
+    k = lookup_format(fmt)->nconversions;
+    bases = malloc((k + 1) * sizeof(char *));
+    strides = malloc((k + 1) * sizeof(size_t));
+    if (NULL == bases || NULL == strides)
+    {
+        cprintf_error("Memory allocation failed.", EXIT_FAILURE);
+    }
+    for (size_t j = 0; j < k; j++)
+    {
+        bases[j] = (const char *) base + offsets[j];
+        strides[j] = stride;
+    }
+    _ingest(fmt, n, bases, strides);
+    free(strides);
+    free(bases);
+}
+
+void cprintf_columns(const char *fmt, size_t n, const void *const column_ptrs[])
+{
+    struct format *f;
+    const char **bases;
+    size_t *strides;
+
+    finish_pipeline();
+    if (fmt == NULL || (n > 0 && column_ptrs == NULL))
+    {
+        cprintf_error("Error: Invalid arguments to %s\n", __PRETTY_FUNCTION__);
+    }
+    bind_stream(stdout);
+    f = lookup_format(fmt);
+    bases = malloc((f->nconversions + 1) * sizeof(char *));
+    strides = malloc((f->nconversions + 1) * sizeof(size_t));
+    if (NULL == bases || NULL == strides)
+    {
+        cprintf_error("Memory allocation failed.", EXIT_FAILURE);
+    }
+    for (size_t i = 0, j = 0; i < f->nspecs; i++)
+    {
+        if (f->specs[i].is_conversion_specification)
+        {
+            bases[j] = column_ptrs[j];
+            strides[j] = f->specs[i].mem_size;
+            j++;
+        }
+    }
+    _ingest(fmt, n, bases, strides);
+    free(strides);
+    free(bases);
+}
+
+size_t cprintf_get_widths(size_t *widths, size_t n)
+{
+    size_t used;
+
+    finish_pipeline();
+    if (NULL != state)
+    {
+        merge_tables();
+    }
+    used = (NULL == state) ? 0 : state->used_columns;
+
+    for (size_t i = 0; i < n; i++)
+    {
+        widths[i] = (i < used) ? state->columns[i].max_width : 0;
+    }
+    return used;
+}
+
+void cprintf_set_widths(const size_t *widths, size_t n)
+{
+    finish_pipeline();
+    if (NULL == state)
+    {
+        return;    // Nothing captured, so nothing to widen.
+    }
+    merge_tables();
+    for (size_t i = 0; i < n && i < state->used_columns; i++)
+    {
+        if (widths[i] > state->columns[i].max_width)
+        {
+            state->columns[i].max_width = widths[i];
+        }
+    }
+}
+
+size_t cprintf_rendered_size(void)
+{
+    finish_pipeline();
+    return (NULL == state) ? 0 : rendered_size();
+}
+
+size_t cprintf_row_bytes(void)
+{
+    finish_pipeline();
+    if (NULL == state || 0 == state->nrows)
+    {
+        return 0;
+    }
+    // Rows built from one format line up byte for byte unless some cell was
+    // padded per display cell, a row was collapsed, or justification is off.
+    if (state->mixed_formats || state->multibyte_excess || state->repeat_bytes ||
+        do_tabulate == false)
+    {
+        return 0;
+    }
+    for (size_t i = 0; i < state->used_columns; i++)
+    {
+        struct column *k = &state->columns[i];
+        if (!k->is_conversion_specification && k->width_sum != k->max_width * k->count)
+        {
+            return 0;    // Unjustified conversions of differing widths.
+        }
+    }
+    return rendered_size() / state->nrows;
+}
+
+off_t cprintf_offset(const size_t *row_counts, size_t rank, size_t row_bytes)
+{
+    off_t offset = 0;
+
+    for (size_t r = 0; r < rank; r++)
+    {
+        offset += (off_t) row_counts[r] * (off_t) row_bytes;
+    }
+    return offset;
+}
+
+void cprintf_set_pwrite(int fd, off_t offset)
+{
+    pwrite_fd = fd;
+    pwrite_offset = offset;
+}
+
+void cprintf_set_retain(int retain)
+{
+    finish_pipeline();
+    retain_mode = (retain != 0);
+}
+
+static bool is_hidden_column(size_t j)
+{
+    return (j < nhidden_columns) ? hidden_columns[j] : hide_others;
+}
+
+// Mark the specs of f that cflush() leaves out: each hidden conversion and
+// the text in front of it that separates it from an earlier shown
+// conversion. Text before the first conversion, after the last one, or
+// holding a newline always stays.
+void apply_hidden(struct format *f)
+{
+    bool shown = false;
+
+    for (size_t i = 0; i < f->nspecs; i++)
+    {
+        f->specs[i].is_hidden = false;
+    }
+    for (size_t j = 0; j < f->nconversions; j++)
+    {
+        bool hide = is_hidden_column(j);
+
+        f->specs[f->conversions[j]].is_hidden = hide;
+        for (size_t i = (j > 0) ? f->conversions[j - 1] + 1 : f->conversions[j]; i < f->conversions[j]; i++)
+        {
+            f->specs[i].is_hidden = (hide || !shown) && NULL == strchr(f->specs[i].ordinary_text, '\n');
+        }
+        shown |= !hide;
+    }
+}
+
+// The hidden columns changed: re-mark every format of the current table.
+static void hidden_columns_changed(void)
+{
+    if (is_initialized == false || NULL == state)
+    {
+        return;
+    }
+    for (struct format *f = state->formats; NULL != f; f = f->next)
+    {
+        apply_hidden(f);
+    }
+    hidden_changed = true;
+}
+
+void cprintf_hide_column(size_t col, int hide)
+{
+    finish_pipeline();
+    if (col >= nhidden_columns)
+    {
+        bool *p = realloc(hidden_columns, (col + 1) * sizeof(bool));
+        if (NULL == p)
+        {
+            cprintf_error("Memory allocation failed.", EXIT_FAILURE);
+        }
+        for (size_t j = nhidden_columns; j <= col; j++)
+        {
+            p[j] = hide_others;
+        }
+        hidden_columns = p;
+        nhidden_columns = col + 1;
+    }
+    hidden_columns[col] = (hide != 0);
+    hidden_columns_changed();
+}
+
+void cprintf_select_columns(const size_t *cols, size_t n)
+{
+    finish_pipeline();
+    free(hidden_columns);
+    hidden_columns = NULL;
+    nhidden_columns = 0;
+    hide_others = (n > 0);
+    for (size_t i = 0; i < n; i++)
+    {
+        cprintf_hide_column(cols[i], 0);
+    }
+    hidden_columns_changed();
+}
+
+void cprintf_set_borrow(int borrow)
+{
+    finish_pipeline();
+    borrow_strings = (borrow != 0);
+}
+
+void cprintf_sort(int col, int ascending)
+{
+    finish_pipeline();
+    sort_column = (col < 0) ? -1 : col;
+    sort_ascending = (ascending != 0);
+}
+
+void cprintf_set_compact(int compact)
+{
+    finish_pipeline();
+    compact_rows = (compact != 0);
+}
+
+void cprintf_set_collapse(int collapse)
+{
+    finish_pipeline();
+    collapse_rows = (collapse != 0);
+    if (NULL != state)
+    {
+        state->last_row = NULL;    // Only rows captured from now on collapse.
+    }
+}
+
+void cprintf_register_conversion(char c, int arg_type, cprintf_width_fn width_fn,
+                                 cprintf_format_fn format_fn)
+{
+    struct conversion *cv = &conversions[(unsigned char) c];
+    type_t t;
+
+    finish_pipeline();
+    if (!isalpha((unsigned char) c) || NULL != strchr("diouxXeEfFgGaAcCsSpnmhlLqjztI", c) ||
+        NULL == format_fn)
+    {
+        cprintf_error("Error: Invalid arguments to %s\n", __PRETTY_FUNCTION__);
+    }
+    switch (arg_type)
+    {
+        case CPRINTF_ARG_SIGNED:
+            t = C_LONG_LONG;
+            break;
+        case CPRINTF_ARG_UNSIGNED:
+            t = C_UNSIGNED_LONG_LONG;
+            break;
+        case CPRINTF_ARG_DOUBLE:
+            t = C_DOUBLE;
+            break;
+        case CPRINTF_ARG_LONG_DOUBLE:
+            t = C_LONG_DOUBLE;
+            break;
+        case CPRINTF_ARG_STRING:
+            t = C_CHARX;
+            break;
+        case CPRINTF_ARG_POINTER:
+            t = C_VOIDX;
+            break;
+        default:
+            cprintf_error("Error: Invalid arguments to %s\n", __PRETTY_FUNCTION__);
+            return;
+    }
+
+    // Formats already parsed point here, so the argument type must stay.
+    if (NULL != cv->format && cv->arg_type != arg_type)
+    {
+        cprintf_error("Error: %%%c is already registered for another argument type.", c);
+    }
+    cv->arg_type = arg_type;
+    cv->type = t;
+    cv->width = width_fn;
+    cv->format = format_fn;
+}
+
+void cprintf_set_pipeline(int pipeline)
+{
+    finish_pipeline();
+    pipeline_mode = (pipeline != 0);
+}
+
+void cprintf_set_live(int live)
+{
+    live_mode = (live != 0);
+    live_shown = false;
+    if (!live_mode)
+    {
+        for (int i = 0; i < 2; i++)
+        {
+            free(live_frames[i].text.buf);
+            free(live_frames[i].cells);
+            free(live_frames[i].rows);
+            memset(&live_frames[i], 0, sizeof(struct live_frame));
+        }
+    }
+}
+
+void cprintf_set_cell(size_t row, size_t col, ...)
+{
+    struct atom *first = row_start(row, __PRETTY_FUNCTION__);
+    struct format *f = format_of(first->spec);
+    struct atom *a;
+    va_list args;
+
+    if (col >= f->nconversions)
+    {
+        cprintf_error("Error in %s: Row %zu has no conversion %zu.", __PRETTY_FUNCTION__, row, col);
+    }
+    a = state->cells[state->row_first[row] + f->conversions[col]];
+
+    forget_sort_keys();
+    state->keys_stale = true;
+    unaccount_atom(a);
+    release_cell(a);
+    a->is_multibyte = false;
+    va_start(args, col);
+    a->pargs = &args;
+    calc_actual_width(a);
+    a->pargs = NULL;
+    va_end(args);
+    account_atom(a);
+}
+
+void cprintf_delete_row(size_t row)
+{
+    struct atom *first = row_start(row, __PRETTY_FUNCTION__);
+    struct atom *c, *next;
+    char note[32];
+
+    forget_sort_keys();
+    state->keys_stale = true;
+    state->repeat_bytes -= repeat_note(first->repeats + 1, note, sizeof(note));
+    if (first == state->last_row)
+    {
+        state->last_row = NULL;
+    }
+    if (first == state->origin && first->down == state->bot_left)
+    {
+        // Last row of the graph; nothing to keep.
+        for (c = first; NULL != c; c = c->right)
+        {
+            unaccount_atom(c);
+        }
+        truncate_rows(first);
+        state->nrows = 0;
+        return;
+    }
+    if (first == state->origin)
+    {
+        state->origin = first->down;
+    }
+    if (first->down == state->bot_left)
+    {
+        for (c = first->up; NULL != c->right; c = c->right)
+            ;
+        state->last_atom_on_last_line = c;
+    }
+
+    for (c = first; NULL != c; c = next)
+    {
+        next = c->right;
+        unaccount_atom(c);
+        if (c->up->is_dummy)
+        {
+            // The next atom down now decides whether the column is justified.
+            state->columns[c->column].is_conversion_specification =
+                !c->down->is_dummy && c->down->is_conversion_specification;
+        }
+        release_cell(c);
+        c->up->down = c->down;
+        c->down->up = c->up;
+        c->right = state->free_atoms;
+        state->free_atoms = c;
+    }
+
+    memmove(&state->row_first[row], &state->row_first[row + 1],
+            (state->nrows - row - 1) * sizeof(size_t));
+    state->nrows--;
+}
+
+void cprintf_set_footer(size_t col, unsigned reductions)
+{
+    finish_pipeline();
+    if (col >= nfooters)
+    {
+        struct footer *p = realloc(footers, (col + 1) * sizeof(struct footer));
+        if (NULL == p)
+        {
+            cprintf_error("Memory allocation failed.", EXIT_FAILURE);
+        }
+        memset(p + nfooters, 0, (col + 1 - nfooters) * sizeof(struct footer));
+        footers = p;
+        nfooters = col + 1;
+        reset_footers();
+    }
+    footers[col].ops = reductions;
+    // Drop the columns that no longer have any, so that a table whose
+    // footers are all removed is captured and printed as if it never had.
+    while (nfooters > 0 && 0 == footers[nfooters - 1].ops)
+    {
+        nfooters--;
+    }
+    if (0 == nfooters)
+    {
+        free(footers);
+        footers = NULL;
+    }
+    // Rows captured before now haven't been counted.
+    footer_dirty = (NULL != state && state->nrows > 0);
+}
+
+void cprintf_add_output(FILE *stream, int kind)
+{
+    struct output *p = realloc(outputs, (noutputs + 1) * sizeof(struct output));
+
+    if (NULL == p)
+    {
+        cprintf_error("Memory allocation failed.", EXIT_FAILURE);
+    }
+    outputs = p;
+    outputs[noutputs].stream = stream;
+    outputs[noutputs].kind = kind;
+    noutputs++;
+}
+
+void cprintf_clear_outputs(void)
+{
+    free(outputs);
+    outputs = NULL;
+    noutputs = 0;
+}
+
+// The cap for conversion col, or for every conversion if col is negative.
+static struct cap *cap_slot(int col)
+{
+    finish_pipeline();
+    if (col < 0)
+    {
+        return &global_cap;
+    }
+    if ((size_t) col >= ncaps)
+    {
+        struct cap *p = realloc(caps, (col + 1) * sizeof(struct cap));
+        if (NULL == p)
+        {
+            cprintf_error("Memory allocation failed.", EXIT_FAILURE);
+        }
+        memset(p + ncaps, 0, (col + 1 - ncaps) * sizeof(struct cap));
+        caps = p;
+        ncaps = col + 1;
+    }
+    return &caps[col];
+}
+
+// Note whether any cap is in force, so that tables without one can be
+// printed from row templates again once the last cap is removed.
+static void recount_caps(void)
+{
+    caps_set = (CPRINTF_CAP_NONE != global_cap.policy);
+    for (size_t i = 0; i < ncaps && !caps_set; i++)
+    {
+        caps_set = (CPRINTF_CAP_NONE != caps[i].policy);
+    }
+}
+
+void cprintf_set_width_cap(int col, size_t width, int policy)
+{
+    struct cap *cp = cap_slot(col);
+
+    cp->policy = (width > 0) ? policy : CPRINTF_CAP_NONE;
+    cp->width = width;
+    recount_caps();
+}
+
+void cprintf_set_width_percentile(int col, double percentile)
+{
+    struct cap *cp = cap_slot(col);
+
+    cp->policy = CPRINTF_CAP_PERCENTILE;
+    cp->percentile = percentile;
+    recount_caps();
+}
+
+void cprintf_set_sink(cprintf_write_fn write_fn, void *ctx)
+{
+    sink_fn = write_fn;
+    sink_ctx = ctx;
+}
+
+// Get the captured rows ready to print: gather them, put them in order and
+// add the footers. Packed rows stay packed if they can be printed as such.
+static void finish_table(void)
+{
+    merge_tables();
+    if (NULL != state->packed && (NULL != published || !packed_printable()))
+    {
+        unpack_rows();
+    }
+    if (NULL != state->cursor)
+    {
+        // A retained table came back shorter than last time.
+        truncate_rows(state->cursor);
+    }
+    if (NULL != state->origin && sort_column >= 0)
+    {
+        sort_rows();
+    }
+    if (NULL != state->origin && noutputs > 0)
+    {
+        write_data_outputs();    // Before footers: these want captured rows only.
+    }
+    if (NULL != state->origin && nfooters > 0)
+    {
+        append_footers();
+    }
+}
+
+static void print_table(void)
+{
+    if (NULL != state->origin && NULL != published)
+    {
+        publish_table();    // Formatting is left to the viewer.
+    }
+    else if (NULL != state->origin || NULL != state->packed)
+    {
+        if (live_mode && !state->to_buffer && pwrite_fd < 0)
+        {
+            if (do_tabulate != false && NULL != state->origin)
+            {
+                calc_max_width();
+                generate_new_specs();
+            }
+            print_live();
+        }
+        else
+        {
+            print_something_already();    // Works out the rows' widths itself.
+        }
+    }
+}
+
+void cprintf_iter_begin(void)
+{
+    finish_pipeline();
+    if (false == is_initialized || NULL == state || state->iterating ||
+        (NULL == state->origin && NULL == state->packed))
+    {
+        return;
+    }
+    finish_table();
+    if (do_tabulate != false && NULL != state->origin)
+    {
+        calc_max_width();
+        generate_new_specs();
+    }
+    state->iterating = true;
+    state->iter_row = row_at(0, NULL);
+    state->iter_k = 0;
+    state->iter_pos = 0;
+    state->row_buf.len = 0;
+    state->iter_packed = 0;
+    if (NULL != state->packed)
+    {
+        state->iter_readers = calloc(state->packed->f->nconversions + 1, sizeof(struct packed_reader));
+        if (NULL == state->iter_readers)
+        {
+            cprintf_error("Memory allocation failed.", EXIT_FAILURE);
+        }
+        state->iter_specs = packed_specs(state->packed->f);
+    }
+}
+
+size_t cprintf_iter_next(char *buf, size_t cap)
+{
+    struct strbuf *sb;
+    const char *line, *nl;
+    size_t n;
+
+    if (false == is_initialized || NULL == state || !state->iterating)
+    {
+        return 0;
+    }
+
+    // Render rows only as their lines are asked for.
+    sb = &state->row_buf;
+    while (state->iter_pos == sb->len)
+    {
+        sb->len = 0;
+        state->iter_pos = 0;
+        if (NULL != state->iter_row && state->iter_row != state->bot_left)
+        {
+            render_row(state->iter_row, sb);
+            state->iter_row = row_at(++state->iter_k, state->iter_row);
+        }
+        else if (NULL != state->packed && state->iter_packed < state->packed->nrows)
+        {
+            render_packed_row(state->packed, state->iter_readers, row_values(state->packed->f),
+                              state->iter_specs, sb);
+            state->iter_packed++;
+        }
+        else
+        {
+            return 0;
+        }
+    }
+
+    line = sb->buf + state->iter_pos;
+    nl = memchr(line, '\n', sb->len - state->iter_pos);
+    n = (NULL != nl) ? (size_t) (nl - line) + 1 : sb->len - state->iter_pos;
+    if (cap > 0)
+    {
+        size_t m = (n < cap) ? n : cap - 1;
+        memcpy(buf, line, m);
+        buf[m] = '\0';
+    }
+    if (n < cap)
+    {
+        state->iter_pos += n;    // A line cut short is handed out again.
+    }
+    return n;
+}
+
+static void end_iteration(void)
+{
+    if (NULL != state->iter_specs)
+    {
+        free_packed_specs(state->packed->f, state->iter_specs);
+    }
+    free(state->iter_readers);
+    state->iter_specs = NULL;
+    state->iter_readers = NULL;
+    state->iter_row = NULL;
+    state->iterating = false;
+}
+
+void cflush()
+{
+    finish_pipeline();
+    if (is_initialized != false && NULL == state->origin && NULL == state->packed)
+    {
+        // Nothing was captured (e.g. csnprintf() was only used to bind a buffer).
+        teardown();
+    }
+    else if (is_initialized != false)
+    {
+        if (state->iterating)
+        {
+            end_iteration();    // The caller has pulled all it wanted.
+        }
+        else
+        {
+            finish_table();
+            print_table();
+        }
+        if (retain_mode && NULL != state->origin)
+        {
+            recycle_graph();
+        }
+        else
+        {
+            if (NULL != state->origin)
+            {
+                free_graph();
+            }
+            else
+            {
+                free_strings();    // Interned for packed rows.
+            }
+            teardown();
         }
-        print_something_already();
-        free_graph();
-        teardown();
     }
+    reset_footers();
+    free_tables();
+    pwrite_fd = -1;
 
     //state = NULL; // Think this is already done but can't hurt.
 }
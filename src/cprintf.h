@@ -8,6 +8,7 @@
 
 #include <stdio.h>
 #include <stdarg.h>
+#include <sys/types.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -21,6 +22,396 @@ void cvprintf(const char *fmt, va_list args);
 
 void cvfprintf(FILE *stream, const char *fmt, va_list args);
 
+// Capture rows destined for caller memory. cflush() renders the table into
+// str, writing at most size bytes including the terminating null. Returns the
+// number of bytes (excluding the null) the table captured so far requires.
+// A NULL fmt captures nothing and only rebinds the buffer.
+int csnprintf(char *str, size_t size, const char *fmt, ...);
+
+int cvsnprintf(char *str, size_t size, const char *fmt, va_list args);
+
+// Capture n rows from an array of structs. The j-th conversion of row i
+// reads from (char *)base + i * stride + offsets[j]. Values are read as the
+// type the conversion names: %hhd reads a signed char, %hd a short, %c a
+// char, %lc a wchar_t, %s a char *. %n is not supported.
+void cprintf_rows(const char *fmt, size_t n, const void *base, size_t stride,
+                  const size_t offsets[]);
+
+// Capture n rows from parallel arrays, one array per conversion.
+void cprintf_columns(const char *fmt, size_t n, const void *const column_ptrs[]);
+
+// A captured argument tagged with its type. The CPRINTF() macros build
+// these, so the library doesn't have to trust the format string to say
+// what was passed.
+enum
+{
+    CPRINTF_ARG_SIGNED,         // Any signed integer type, in i.
+    CPRINTF_ARG_UNSIGNED,       // Any unsigned integer type, in u.
+    CPRINTF_ARG_DOUBLE,         // float or double, in d.
+    CPRINTF_ARG_LONG_DOUBLE,    // The bytes of a long double, in ld.
+    CPRINTF_ARG_STRING,         // char *, in p.
+    CPRINTF_ARG_INT_POINTER,    // int * (and wchar_t * where it is int *), in p.
+    CPRINTF_ARG_POINTER         // Any other pointer, in p.
+};
+
+struct cprintf_arg
+{
+    int type;
+    union
+    {
+        long long i;
+        unsigned long long u;
+        double d;
+        unsigned char ld[sizeof(long double)];  // Not a long double: that
+                                                // changes how it is passed.
+        const void *p;
+    } value;
+};
+
+// Capture a row from nargs typed arguments, one per conversion in fmt.
+// Integers and floating point values are converted to the type their
+// conversion expects; any other mismatch is an error.
+void cprintf_typed(const char *fmt, size_t nargs, const struct cprintf_arg *args);
+
+void cfprintf_typed(FILE *stream, const char *fmt, size_t nargs, const struct cprintf_arg *args);
+
+#if defined(__STDC_VERSION__) && __STDC_VERSION__ >= 201112L && !defined(__cplusplus)
+static inline struct cprintf_arg cprintf_arg_signed(long long x)
+{
+    struct cprintf_arg a = { CPRINTF_ARG_SIGNED, { .i = x } };
+    return a;
+}
+
+static inline struct cprintf_arg cprintf_arg_unsigned(unsigned long long x)
+{
+    struct cprintf_arg a = { CPRINTF_ARG_UNSIGNED, { .u = x } };
+    return a;
+}
+
+static inline struct cprintf_arg cprintf_arg_double(double x)
+{
+    struct cprintf_arg a = { CPRINTF_ARG_DOUBLE, { .d = x } };
+    return a;
+}
+
+static inline struct cprintf_arg cprintf_arg_long_double(long double x)
+{
+    struct cprintf_arg a = { CPRINTF_ARG_LONG_DOUBLE, { .u = 0 } };
+    const unsigned char *p = (const unsigned char *) &x;
+
+    for (size_t i = 0; i < sizeof(long double); i++)
+    {
+        a.value.ld[i] = p[i];
+    }
+    return a;
+}
+
+static inline struct cprintf_arg cprintf_arg_string(const char *x)
+{
+    struct cprintf_arg a = { CPRINTF_ARG_STRING, { .p = x } };
+    return a;
+}
+
+static inline struct cprintf_arg cprintf_arg_int_pointer(int *x)
+{
+    struct cprintf_arg a = { CPRINTF_ARG_INT_POINTER, { .p = x } };
+    return a;
+}
+
+static inline struct cprintf_arg cprintf_arg_pointer(const void *x)
+{
+    struct cprintf_arg a = { CPRINTF_ARG_POINTER, { .p = x } };
+    return a;
+}
+
+#define CPRINTF_ARG(x) _Generic((x), \
+    _Bool: cprintf_arg_signed, \
+    char: cprintf_arg_signed, \
+    signed char: cprintf_arg_signed, \
+    short: cprintf_arg_signed, \
+    int: cprintf_arg_signed, \
+    long: cprintf_arg_signed, \
+    long long: cprintf_arg_signed, \
+    unsigned char: cprintf_arg_unsigned, \
+    unsigned short: cprintf_arg_unsigned, \
+    unsigned int: cprintf_arg_unsigned, \
+    unsigned long: cprintf_arg_unsigned, \
+    unsigned long long: cprintf_arg_unsigned, \
+    float: cprintf_arg_double, \
+    double: cprintf_arg_double, \
+    long double: cprintf_arg_long_double, \
+    char *: cprintf_arg_string, \
+    const char *: cprintf_arg_string, \
+    int *: cprintf_arg_int_pointer, \
+    default: cprintf_arg_pointer)(x)
+
+// CPRINTF(fmt, ...) and CFPRINTF(stream, fmt, ...) work like cprintf() and
+// cfprintf() for up to 16 arguments, tagging each with its type.
+#define CPRINTF(...) cprintf_typed(CPRINTF_TAGS_(__VA_ARGS__))
+#define CFPRINTF(stream, ...) cfprintf_typed(stream, CPRINTF_TAGS_(__VA_ARGS__))
+
+#define CPRINTF_PICK_(_0, _1, _2, _3, _4, _5, _6, _7, _8, _9, _10, _11, _12, \
+                      _13, _14, _15, _16, name, ...) name
+#define CPRINTF_TAGS_(...) CPRINTF_PICK_(__VA_ARGS__, \
+    CPRINTF_TAG16_, CPRINTF_TAG15_, CPRINTF_TAG14_, CPRINTF_TAG13_, \
+    CPRINTF_TAG12_, CPRINTF_TAG11_, CPRINTF_TAG10_, CPRINTF_TAG9_, \
+    CPRINTF_TAG8_, CPRINTF_TAG7_, CPRINTF_TAG6_, CPRINTF_TAG5_, \
+    CPRINTF_TAG4_, CPRINTF_TAG3_, CPRINTF_TAG2_, CPRINTF_TAG1_, \
+    CPRINTF_TAG0_, )(__VA_ARGS__)
+#define CPRINTF_TAG0_(f) f, 0, NULL
+#define CPRINTF_TAG1_(f, a1) \
+    f, 1, (const struct cprintf_arg[]){ CPRINTF_ARG(a1) }
+#define CPRINTF_TAG2_(f, a1, a2) \
+    f, 2, (const struct cprintf_arg[]){ CPRINTF_ARG(a1), CPRINTF_ARG(a2) }
+#define CPRINTF_TAG3_(f, a1, a2, a3) \
+    f, 3, (const struct cprintf_arg[]){ CPRINTF_ARG(a1), CPRINTF_ARG(a2), CPRINTF_ARG(a3) }
+#define CPRINTF_TAG4_(f, a1, a2, a3, a4) \
+    f, 4, (const struct cprintf_arg[]){ \
+        CPRINTF_ARG(a1), CPRINTF_ARG(a2), CPRINTF_ARG(a3), CPRINTF_ARG(a4) }
+#define CPRINTF_TAG5_(f, a1, a2, a3, a4, a5) \
+    f, 5, (const struct cprintf_arg[]){ \
+        CPRINTF_ARG(a1), CPRINTF_ARG(a2), CPRINTF_ARG(a3), CPRINTF_ARG(a4), \
+        CPRINTF_ARG(a5) }
+#define CPRINTF_TAG6_(f, a1, a2, a3, a4, a5, a6) \
+    f, 6, (const struct cprintf_arg[]){ \
+        CPRINTF_ARG(a1), CPRINTF_ARG(a2), CPRINTF_ARG(a3), CPRINTF_ARG(a4), \
+        CPRINTF_ARG(a5), CPRINTF_ARG(a6) }
+#define CPRINTF_TAG7_(f, a1, a2, a3, a4, a5, a6, a7) \
+    f, 7, (const struct cprintf_arg[]){ \
+        CPRINTF_ARG(a1), CPRINTF_ARG(a2), CPRINTF_ARG(a3), CPRINTF_ARG(a4), \
+        CPRINTF_ARG(a5), CPRINTF_ARG(a6), CPRINTF_ARG(a7) }
+#define CPRINTF_TAG8_(f, a1, a2, a3, a4, a5, a6, a7, a8) \
+    f, 8, (const struct cprintf_arg[]){ \
+        CPRINTF_ARG(a1), CPRINTF_ARG(a2), CPRINTF_ARG(a3), CPRINTF_ARG(a4), \
+        CPRINTF_ARG(a5), CPRINTF_ARG(a6), CPRINTF_ARG(a7), CPRINTF_ARG(a8) }
+#define CPRINTF_TAG9_(f, a1, a2, a3, a4, a5, a6, a7, a8, a9) \
+    f, 9, (const struct cprintf_arg[]){ \
+        CPRINTF_ARG(a1), CPRINTF_ARG(a2), CPRINTF_ARG(a3), CPRINTF_ARG(a4), \
+        CPRINTF_ARG(a5), CPRINTF_ARG(a6), CPRINTF_ARG(a7), CPRINTF_ARG(a8), \
+        CPRINTF_ARG(a9) }
+#define CPRINTF_TAG10_(f, a1, a2, a3, a4, a5, a6, a7, a8, a9, a10) \
+    f, 10, (const struct cprintf_arg[]){ \
+        CPRINTF_ARG(a1), CPRINTF_ARG(a2), CPRINTF_ARG(a3), CPRINTF_ARG(a4), \
+        CPRINTF_ARG(a5), CPRINTF_ARG(a6), CPRINTF_ARG(a7), CPRINTF_ARG(a8), \
+        CPRINTF_ARG(a9), CPRINTF_ARG(a10) }
+#define CPRINTF_TAG11_(f, a1, a2, a3, a4, a5, a6, a7, a8, a9, a10, a11) \
+    f, 11, (const struct cprintf_arg[]){ \
+        CPRINTF_ARG(a1), CPRINTF_ARG(a2), CPRINTF_ARG(a3), CPRINTF_ARG(a4), \
+        CPRINTF_ARG(a5), CPRINTF_ARG(a6), CPRINTF_ARG(a7), CPRINTF_ARG(a8), \
+        CPRINTF_ARG(a9), CPRINTF_ARG(a10), CPRINTF_ARG(a11) }
+#define CPRINTF_TAG12_(f, a1, a2, a3, a4, a5, a6, a7, a8, a9, a10, a11, a12) \
+    f, 12, (const struct cprintf_arg[]){ \
+        CPRINTF_ARG(a1), CPRINTF_ARG(a2), CPRINTF_ARG(a3), CPRINTF_ARG(a4), \
+        CPRINTF_ARG(a5), CPRINTF_ARG(a6), CPRINTF_ARG(a7), CPRINTF_ARG(a8), \
+        CPRINTF_ARG(a9), CPRINTF_ARG(a10), CPRINTF_ARG(a11), CPRINTF_ARG(a12) }
+#define CPRINTF_TAG13_(f, a1, a2, a3, a4, a5, a6, a7, a8, a9, a10, a11, a12, a13) \
+    f, 13, (const struct cprintf_arg[]){ \
+        CPRINTF_ARG(a1), CPRINTF_ARG(a2), CPRINTF_ARG(a3), CPRINTF_ARG(a4), \
+        CPRINTF_ARG(a5), CPRINTF_ARG(a6), CPRINTF_ARG(a7), CPRINTF_ARG(a8), \
+        CPRINTF_ARG(a9), CPRINTF_ARG(a10), CPRINTF_ARG(a11), CPRINTF_ARG(a12), \
+        CPRINTF_ARG(a13) }
+#define CPRINTF_TAG14_(f, a1, a2, a3, a4, a5, a6, a7, a8, a9, a10, a11, a12, a13, a14) \
+    f, 14, (const struct cprintf_arg[]){ \
+        CPRINTF_ARG(a1), CPRINTF_ARG(a2), CPRINTF_ARG(a3), CPRINTF_ARG(a4), \
+        CPRINTF_ARG(a5), CPRINTF_ARG(a6), CPRINTF_ARG(a7), CPRINTF_ARG(a8), \
+        CPRINTF_ARG(a9), CPRINTF_ARG(a10), CPRINTF_ARG(a11), CPRINTF_ARG(a12), \
+        CPRINTF_ARG(a13), CPRINTF_ARG(a14) }
+#define CPRINTF_TAG15_(f, a1, a2, a3, a4, a5, a6, a7, a8, a9, a10, a11, a12, a13, a14, a15) \
+    f, 15, (const struct cprintf_arg[]){ \
+        CPRINTF_ARG(a1), CPRINTF_ARG(a2), CPRINTF_ARG(a3), CPRINTF_ARG(a4), \
+        CPRINTF_ARG(a5), CPRINTF_ARG(a6), CPRINTF_ARG(a7), CPRINTF_ARG(a8), \
+        CPRINTF_ARG(a9), CPRINTF_ARG(a10), CPRINTF_ARG(a11), CPRINTF_ARG(a12), \
+        CPRINTF_ARG(a13), CPRINTF_ARG(a14), CPRINTF_ARG(a15) }
+#define CPRINTF_TAG16_(f, a1, a2, a3, a4, a5, a6, a7, a8, a9, a10, a11, a12, a13, a14, a15, a16) \
+    f, 16, (const struct cprintf_arg[]){ \
+        CPRINTF_ARG(a1), CPRINTF_ARG(a2), CPRINTF_ARG(a3), CPRINTF_ARG(a4), \
+        CPRINTF_ARG(a5), CPRINTF_ARG(a6), CPRINTF_ARG(a7), CPRINTF_ARG(a8), \
+        CPRINTF_ARG(a9), CPRINTF_ARG(a10), CPRINTF_ARG(a11), CPRINTF_ARG(a12), \
+        CPRINTF_ARG(a13), CPRINTF_ARG(a14), CPRINTF_ARG(a15), CPRINTF_ARG(a16) }
+#endif
+
+// Allocate nrows rows of fmt at the end of the table, to be filled in by
+// cprintf_fill_row(). The handle is valid until cflush().
+struct cprintf_table *cprintf_table_alloc(const char *fmt, size_t nrows);
+
+// Fill row i of table with the arguments fmt expects. Different rows may be
+// filled from different threads at the same time, but no other cprintf
+// function may run meanwhile. Rows left unfilled print zeros and empty
+// strings; rows can't be filled once the table's widths have been used.
+void cprintf_fill_row(struct cprintf_table *table, size_t i, ...);
+
+// Width agreement between processes that each hold part of one table.
+// cprintf_get_widths() copies the widest cell of each of the first n
+// columns into widths (zero past the last column) and returns the number
+// of columns. After reducing the vectors with max, cprintf_set_widths()
+// widens the local columns to match.
+size_t cprintf_get_widths(size_t *widths, size_t n);
+
+void cprintf_set_widths(const size_t *widths, size_t n);
+
+// Bytes the table captured so far renders to at the current widths.
+size_t cprintf_rendered_size(void);
+
+// Bytes every row renders to, or 0 if the rows are not all the same length.
+size_t cprintf_row_bytes(void);
+
+// Byte offset of rank's first row, given each rank's row count.
+off_t cprintf_offset(const size_t *row_counts, size_t rank, size_t row_bytes);
+
+// Make the next cflush() write with pwrite() to fd, starting at offset.
+void cprintf_set_pwrite(int fd, off_t offset);
+
+// While retain is nonzero, cflush() keeps the table's rows after printing
+// them. The next table overwrites them in place as long as its rows use the
+// same formats, grows if it has more rows and is cut short if it has fewer.
+void cprintf_set_retain(int retain);
+
+// While borrow is nonzero, %s and %ls arguments aren't copied: the caller
+// keeps them alive and unchanged until cflush(). %&s and %&ls borrow a
+// single argument the same way.
+void cprintf_set_borrow(int borrow);
+
+// While compact is nonzero, rows whose conversions all print integers,
+// doubles or often repeated strings are kept encoded, a few bytes per value,
+// instead of as cells; they are decoded as they are printed.
+void cprintf_set_compact(int compact);
+
+// Print the rows of every table flushed from now on ordered by the value of
+// conversion col (counting from 0), ascending unless ascending is 0. Equal
+// values keep their capture order, rows without that conversion go last,
+// and a negative col goes back to capture order.
+void cprintf_sort(int col, int ascending);
+
+// While collapse is nonzero, a row with the same format and values as the
+// row captured just before it isn't stored: that row is printed once, with
+// " (×N)" at the end of its line for the N copies it stands for.
+void cprintf_set_collapse(int collapse);
+
+// Pull the table captured so far a line at a time instead of having
+// cflush() print it. After cprintf_iter_begin(), each cprintf_iter_next()
+// renders only as much of the table as it needs to copy the next line,
+// newline included, into buf as a null-terminated string, and returns the
+// line's length. A line of cap bytes or more is cut short and handed out
+// again by the next call, so it can be fetched with a bigger buf. Returns 0
+// once every line has been handed out. No rows can be captured until
+// cflush(), which then ends the table without printing it.
+void cprintf_iter_begin(void);
+
+size_t cprintf_iter_next(char *buf, size_t cap);
+
+// Callbacks of a custom conversion, given its argument and precision (-1 if
+// the format gives none). A width_fn returns how many characters format_fn
+// would write; a format_fn writes them to buf like snprintf(), returning how
+// many it needed.
+typedef size_t (*cprintf_width_fn)(const struct cprintf_arg *arg, int precision);
+
+typedef int (*cprintf_format_fn)(char *buf, size_t size, const struct cprintf_arg *arg,
+                                 int precision);
+
+// Make %c print its argument with format_fn, in the spirit of glibc's
+// register_printf_function(). c is a letter printf() doesn't use, and
+// arg_type one of the CPRINTF_ARG_* types except CPRINTF_ARG_INT_POINTER:
+// the argument is read as a long long, unsigned long long, double, long
+// double, char * (copied like a %s) or const void *. Cells are measured with
+// width_fn, whose count is taken as bytes and display cells alike; when it
+// is NULL they are formatted instead, which also copes with UTF-8. The
+// library adds the padding. Register conversions before formats that use
+// them are first seen.
+void cprintf_register_conversion(char c, int arg_type, cprintf_width_fn width_fn,
+                                 cprintf_format_fn format_fn);
+
+// While pipeline is nonzero, cprintf(), cfprintf() and their v versions only
+// read their arguments, copying strings the table would copy anyway, and
+// queue the row for a background thread that builds the table from it. The
+// other cprintf functions first wait for that thread to catch up, so the
+// table reads the same as if the rows had been captured in order.
+void cprintf_set_pipeline(int pipeline);
+
+// Publish tables to the POSIX shared-memory object name instead of printing
+// them: cflush() only copies the captured values and column widths there.
+// A NULL name stops publishing and removes the object. Returns 0 on success.
+int cprintf_publish(const char *name);
+
+// Print the table most recently published under name to stream.
+// Returns 0 on success and -1 if nothing readable is published there.
+int cprintf_view(const char *name, FILE *stream);
+
+// While live is nonzero, each cflush() redraws the table the previous one
+// left on the terminal, moving the cursor with ANSI escapes and rewriting
+// only the cells that changed. Nothing else may be written to the stream
+// in between, and the table has to fit on the screen.
+void cprintf_set_live(int live);
+
+// Change conversion col (counting from 0) of captured row to the value
+// passed after it, which must have the type that conversion expects.
+void cprintf_set_cell(size_t row, size_t col, ...);
+
+// Remove a captured row; the rows below it move up.
+void cprintf_delete_row(size_t row);
+
+// Reductions cprintf_set_footer() can print below a column, one row each
+// in this order.
+enum
+{
+    CPRINTF_REDUCE_SUM   = 1 << 0,
+    CPRINTF_REDUCE_MIN   = 1 << 1,
+    CPRINTF_REDUCE_MAX   = 1 << 2,
+    CPRINTF_REDUCE_MEAN  = 1 << 3,
+    CPRINTF_REDUCE_COUNT = 1 << 4
+};
+
+// Print the given reductions of conversion col (counting from 0) below
+// every table. They are computed as rows are captured. 0 removes them.
+void cprintf_set_footer(size_t col, unsigned reductions);
+
+// Kinds of output cprintf_add_output() can attach.
+enum
+{
+    CPRINTF_TEXT,       // Another copy of the justified table.
+    CPRINTF_CSV,        // Values only, comma separated.
+    CPRINTF_TSV,        // Values only, tab separated.
+    CPRINTF_JSONL,      // Values only, a JSON array per row.
+    CPRINTF_BINARY      // Values only, packed by column.
+};
+
+// Also write every table flushed from now on to stream, in the given form.
+// Outputs stay attached until cprintf_clear_outputs().
+void cprintf_add_output(FILE *stream, int kind);
+
+void cprintf_clear_outputs(void);
+
+// What happens to a value wider than its column's cap.
+enum
+{
+    CPRINTF_CAP_NONE,
+    CPRINTF_CAP_TRUNCATE,   // Cut it short and end it with "...".
+    CPRINTF_CAP_WRAP,       // Continue it on following lines.
+    CPRINTF_CAP_PERCENTILE  // Let it overflow; see cprintf_set_width_percentile().
+};
+
+// Keep conversion col (counting from 0), or every conversion if col is -1,
+// from widening its column past width. A width of 0 removes the cap.
+void cprintf_set_width_cap(int col, size_t width, int policy);
+
+// Size conversion col's column (or every column if col is -1) to fit the
+// given percentile of its values; wider values overflow the column.
+void cprintf_set_width_percentile(int col, double percentile);
+
+// Leave conversion col (counting from 0) out of every table from now on,
+// or put it back if hide is 0. Hidden conversions aren't formatted or
+// measured, and the text in front of each goes with it.
+void cprintf_hide_column(size_t col, int hide);
+
+// Show only the n conversions listed in cols, in their original order.
+// n of 0 shows every conversion again.
+void cprintf_select_columns(const size_t *cols, size_t n);
+
+// Receives rendered output, one row at a time.
+typedef void (*cprintf_write_fn)(const char *buf, size_t len, void *ctx);
+
+// Send rendered output to write_fn instead of the stream. NULL restores stdio.
+void cprintf_set_sink(cprintf_write_fn write_fn, void *ctx);
+
 void dump_graph();
 
 void cflush(void);
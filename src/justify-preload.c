@@ -0,0 +1,407 @@
+// Copyright 2023 Lawrence Livermore National Security, LLC and other
+// libjustify Project Developers. See the top-level LICENSE file for details.
+//
+// SPDX-License-Identifier: MIT
+
+// libjustify-preload.so: justify the printf() output of a program that was
+// never written for the library.
+//
+//     LD_PRELOAD=/path/to/libjustify-preload.so ./legacy-code
+//
+// A printf(), fprintf(), vprintf() or vfprintf() call whose format is a
+// single line holding conversions the library understands is captured with
+// cvfprintf() instead of printed. Consecutive rows with the same format on
+// the same stream make up a table. It is printed before anything else is
+// written to that stream, after JUSTIFY_ROWS rows (default 10000), once its
+// first row is JUSTIFY_SECONDS old (default 1), and at exit. Every other
+// call goes straight to the C library.
+
+#undef _FORTIFY_SOURCE    // We define printf() and friends ourselves.
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <cprintf.h>
+
+// The library is built with hidden visibility; these are the functions
+// programs get from us instead of the C library.
+#define INTERPOSE __attribute__((visibility("default")))
+
+// What programs built with _FORTIFY_SOURCE call instead of printf().
+INTERPOSE int __printf_chk(int flag, const char *fmt, ...);
+INTERPOSE int __fprintf_chk(FILE *stream, int flag, const char *fmt, ...);
+INTERPOSE int __vprintf_chk(int flag, const char *fmt, va_list ap);
+INTERPOSE int __vfprintf_chk(FILE *stream, int flag, const char *fmt, va_list ap);
+
+// The C library's versions.
+static int (*real_vfprintf)(FILE *stream, const char *fmt, va_list ap)                 = NULL;
+static int (*real_vfprintf_chk)(FILE *stream, int flag, const char *fmt, va_list ap)   = NULL;
+static int (*real_fputs)(const char *s, FILE *stream)                                   = NULL;
+static int (*real_puts)(const char *s)                                                  = NULL;
+static int (*real_fputc)(int c, FILE *stream)                                           = NULL;
+static int (*real_putc)(int c, FILE *stream)                                            = NULL;
+static int (*real_putchar)(int c)                                                       = NULL;
+static size_t (*real_fwrite)(const void *p, size_t size, size_t n, FILE *stream)       = NULL;
+static pthread_once_t resolved = PTHREAD_ONCE_INIT;
+
+// The table being captured. Only table_stream is read without the lock, so
+// that output to other streams needn't take it.
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static _Atomic(FILE *) table_stream;    // NULL while there is no table.
+static char *table_format = NULL;
+static size_t table_rows;
+static struct timespec table_start;
+
+static size_t row_budget = 10000;
+static double time_budget = 1.0;
+static bool started = false;    // The flusher thread and exit handler exist.
+static bool exiting = false;
+
+// Set while this thread is inside the library, whose own output mustn't be
+// captured.
+static _Thread_local bool inside = false;
+
+static void resolve(void)
+{
+    const char *s;
+
+    real_vfprintf     = dlsym(RTLD_NEXT, "vfprintf");
+    real_vfprintf_chk = dlsym(RTLD_NEXT, "__vfprintf_chk");
+    real_fputs        = dlsym(RTLD_NEXT, "fputs");
+    real_puts         = dlsym(RTLD_NEXT, "puts");
+    real_fputc        = dlsym(RTLD_NEXT, "fputc");
+    real_putc         = dlsym(RTLD_NEXT, "putc");
+    real_putchar      = dlsym(RTLD_NEXT, "putchar");
+    real_fwrite       = dlsym(RTLD_NEXT, "fwrite");
+
+    if (NULL != (s = getenv("JUSTIFY_ROWS")) && strtoul(s, NULL, 10) > 0)
+    {
+        row_budget = strtoul(s, NULL, 10);
+    }
+    if (NULL != (s = getenv("JUSTIFY_SECONDS")) && strtod(s, NULL) > 0)
+    {
+        time_budget = strtod(s, NULL);
+    }
+}
+
+// Whether fmt is a row the library can capture: one line, ending with its
+// newline, with at least one conversion and only conversions the parser
+// takes. That rules out %% and %m, which print no argument, %n, which
+// writes one, * and $, and letters right after a conversion that the
+// parser would read as part of it.
+static bool is_row(const char *fmt)
+{
+    const char *p = strchr(fmt, '%');
+    const char *nl;
+
+    if (NULL == p)
+    {
+        return false;
+    }
+    nl = strchr(fmt, '\n');
+    if (NULL == nl || '\0' != nl[1])
+    {
+        return false;
+    }
+    for (; NULL != p; p = strchr(p, '%'))
+    {
+        size_t lm;
+        char cs;
+
+        p++;
+        p += strspn(p, "#0- +'I");
+        p += strspn(p, "0123456789");
+        if ('.' == *p)
+        {
+            p++;
+            p += strspn(p, "0123456789");
+        }
+        lm = strspn(p, "hlLqjzt");
+        cs = p[lm];
+        if ('\0' == cs || NULL != strchr("diouxXeEfFgGaAcCsSpnm", p[lm + 1]))
+        {
+            return false;
+        }
+        if (NULL != strchr("diouxX", cs))
+        {
+            if (lm > 2 || (2 == lm && strncmp(p, "hh", 2) != 0 && strncmp(p, "ll", 2) != 0) ||
+                (1 == lm && NULL == strchr("hljzt", *p)))
+            {
+                return false;
+            }
+        }
+        else if (NULL != strchr("eEfFgGaA", cs))
+        {
+            if (lm > 1 || (1 == lm && 'l' != *p && 'L' != *p))
+            {
+                return false;
+            }
+        }
+        else if ('c' == cs || 's' == cs)
+        {
+            if (lm > 1 || (1 == lm && 'l' != *p))
+            {
+                return false;
+            }
+        }
+        else if ('p' != cs || lm > 0)
+        {
+            return false;
+        }
+        p += lm + 1;
+    }
+    return true;
+}
+
+static double seconds_since(const struct timespec *t)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double)(now.tv_sec - t->tv_sec) + (now.tv_nsec - t->tv_nsec) * 1e-9;
+}
+
+// Print the table, if there is one. Called with the lock held.
+static void flush_table(void)
+{
+    if (NULL == atomic_load(&table_stream))
+    {
+        return;
+    }
+    atomic_store(&table_stream, NULL);
+    inside = true;
+    cflush();
+    inside = false;
+    free(table_format);
+    table_format = NULL;
+    table_rows = 0;
+}
+
+// Print the table before anything else reaches its stream.
+static void flush_before(FILE *stream)
+{
+    if (stream == atomic_load_explicit(&table_stream, memory_order_relaxed) && !inside)
+    {
+        pthread_mutex_lock(&lock);
+        if (stream == atomic_load(&table_stream))
+        {
+            flush_table();
+        }
+        pthread_mutex_unlock(&lock);
+    }
+}
+
+static void flush_at_exit(void)
+{
+    if (inside)
+    {
+        return;    // The library is exiting on an error of its own.
+    }
+    pthread_mutex_lock(&lock);
+    flush_table();
+    exiting = true;
+    pthread_mutex_unlock(&lock);
+}
+
+// Print tables nothing has been added to for a while.
+static void *flusher(void *arg)
+{
+    struct timespec nap;
+
+    (void) arg;
+    nap.tv_sec = (time_t)(time_budget / 4);
+    nap.tv_nsec = (long)((time_budget / 4 - nap.tv_sec) * 1e9);
+    while (true)
+    {
+        nanosleep(&nap, NULL);
+        pthread_mutex_lock(&lock);
+        if (NULL != atomic_load(&table_stream) && seconds_since(&table_start) >= time_budget)
+        {
+            flush_table();
+        }
+        pthread_mutex_unlock(&lock);
+    }
+    return NULL;
+}
+
+static void start(void)
+{
+    pthread_t thread;
+    sigset_t all, old;
+
+    // The library registers its own exit handler with its first row; ours
+    // has to run before it.
+    atexit(flush_at_exit);
+
+    // Signals are for the program's threads.
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    if (0 == pthread_create(&thread, NULL, flusher, NULL))
+    {
+        pthread_detach(thread);
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    started = true;
+}
+
+// Add a row to the table, or start a new one if it belongs to another.
+// Returns false if the row should be printed after all.
+static bool capture(FILE *stream, const char *fmt, va_list ap)
+{
+    pthread_mutex_lock(&lock);
+    if (exiting || fileno(stream) < 0)
+    {
+        pthread_mutex_unlock(&lock);
+        return false;    // Exit handlers have run, or a memory stream.
+    }
+    if (stream != atomic_load(&table_stream) || strcmp(fmt, table_format) != 0)
+    {
+        flush_table();
+        table_format = strdup(fmt);
+        clock_gettime(CLOCK_MONOTONIC, &table_start);
+        atomic_store(&table_stream, stream);
+    }
+    inside = true;
+    cvfprintf(stream, fmt, ap);
+    inside = false;
+    if (!started)
+    {
+        start();
+    }
+    if (++table_rows >= row_budget || seconds_since(&table_start) >= time_budget)
+    {
+        flush_table();
+    }
+    pthread_mutex_unlock(&lock);
+    return true;
+}
+
+// What every printf() comes down to. flag is the _FORTIFY_SOURCE level of a
+// __*printf_chk() call, or -1. A captured row has printed nothing yet, so
+// it counts as 0 characters.
+static int route(FILE *stream, int flag, const char *fmt, va_list ap)
+{
+    pthread_once(&resolved, resolve);
+    if (!inside && is_row(fmt) && capture(stream, fmt, ap))
+    {
+        return 0;
+    }
+    flush_before(stream);
+    return (flag < 0) ? real_vfprintf(stream, fmt, ap) :
+                        real_vfprintf_chk(stream, flag, fmt, ap);
+}
+
+INTERPOSE int printf(const char *fmt, ...)
+{
+    va_list ap;
+    int rc;
+
+    va_start(ap, fmt);
+    rc = route(stdout, -1, fmt, ap);
+    va_end(ap);
+    return rc;
+}
+
+INTERPOSE int fprintf(FILE *stream, const char *fmt, ...)
+{
+    va_list ap;
+    int rc;
+
+    va_start(ap, fmt);
+    rc = route(stream, -1, fmt, ap);
+    va_end(ap);
+    return rc;
+}
+
+INTERPOSE int vprintf(const char *fmt, va_list ap)
+{
+    return route(stdout, -1, fmt, ap);
+}
+
+INTERPOSE int vfprintf(FILE *stream, const char *fmt, va_list ap)
+{
+    return route(stream, -1, fmt, ap);
+}
+
+INTERPOSE int __printf_chk(int flag, const char *fmt, ...)
+{
+    va_list ap;
+    int rc;
+
+    va_start(ap, fmt);
+    rc = route(stdout, flag, fmt, ap);
+    va_end(ap);
+    return rc;
+}
+
+INTERPOSE int __fprintf_chk(FILE *stream, int flag, const char *fmt, ...)
+{
+    va_list ap;
+    int rc;
+
+    va_start(ap, fmt);
+    rc = route(stream, flag, fmt, ap);
+    va_end(ap);
+    return rc;
+}
+
+INTERPOSE int __vprintf_chk(int flag, const char *fmt, va_list ap)
+{
+    return route(stdout, flag, fmt, ap);
+}
+
+INTERPOSE int __vfprintf_chk(FILE *stream, int flag, const char *fmt, va_list ap)
+{
+    return route(stream, flag, fmt, ap);
+}
+
+// Other ways text reaches a stream, compilers turn printf("text\n") into
+// puts("text") for one, have to wait for its table too.
+INTERPOSE int fputs(const char *s, FILE *stream)
+{
+    pthread_once(&resolved, resolve);
+    flush_before(stream);
+    return real_fputs(s, stream);
+}
+
+INTERPOSE int puts(const char *s)
+{
+    pthread_once(&resolved, resolve);
+    flush_before(stdout);
+    return real_puts(s);
+}
+
+INTERPOSE int fputc(int c, FILE *stream)
+{
+    pthread_once(&resolved, resolve);
+    flush_before(stream);
+    return real_fputc(c, stream);
+}
+
+INTERPOSE int putc(int c, FILE *stream)
+{
+    pthread_once(&resolved, resolve);
+    flush_before(stream);
+    return real_putc(c, stream);
+}
+
+INTERPOSE int putchar(int c)
+{
+    pthread_once(&resolved, resolve);
+    flush_before(stdout);
+    return real_putchar(c);
+}
+
+INTERPOSE size_t fwrite(const void *p, size_t size, size_t n, FILE *stream)
+{
+    pthread_once(&resolved, resolve);
+    flush_before(stream);
+    return real_fwrite(p, size, n, stream);
+}
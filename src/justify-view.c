@@ -0,0 +1,67 @@
+// Copyright 2023 Lawrence Livermore National Security, LLC and other
+// libjustify Project Developers. See the top-level LICENSE file for details.
+//
+// SPDX-License-Identifier: MIT
+
+// justify-view: print a table another process published with
+// cprintf_publish().
+//
+//     justify-view [-i seconds] name
+//
+// With -i the table is redrawn every interval until interrupted.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <locale.h>
+#include <cprintf.h>
+
+static void usage(const char *argv0)
+{
+    fprintf(stderr, "usage: %s [-i seconds] name\n", argv0);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv)
+{
+    double interval = 0;
+    int opt;
+
+    setlocale(LC_ALL, "");    // Wide string conversions need the user's locale.
+    while ((opt = getopt(argc, argv, "i:")) != -1)
+    {
+        switch (opt)
+        {
+            case 'i':
+                interval = atof(optarg);
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    if (optind != argc - 1)
+    {
+        usage(argv[0]);
+    }
+
+    do
+    {
+        if (interval > 0)
+        {
+            fputs("\033[H\033[2J", stdout);    // Home the cursor and clear.
+        }
+        if (cprintf_view(argv[optind], stdout) != 0)
+        {
+            fprintf(stderr, "%s: nothing published as %s\n", argv[0], argv[optind]);
+            return EXIT_FAILURE;
+        }
+        fflush(stdout);
+        if (interval > 0)
+        {
+            usleep((useconds_t)(interval * 1e6));
+        }
+    }
+    while (interval > 0);
+
+    return EXIT_SUCCESS;
+}
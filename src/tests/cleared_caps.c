@@ -0,0 +1,95 @@
+// Copyright 2023 Lawrence Livermore National Security, LLC and other
+// libjustify Project Developers. See the top-level LICENSE file for details.
+//
+// SPDX-License-Identifier: MIT
+
+// Check that removing every width cap gives tables their row templates
+// back. While a cap is set, cflush() renders each row a cell at a time,
+// several times slower; once the caps are gone, the same table has to
+// print as it did before any were set, and about as fast.
+//
+//     cleared_caps [rows]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <cprintf.h>
+
+static const char *names[] = { "alpha", "bravo", "charlie", "delta-with-a-long-name", "e" };
+
+static double now(void)
+{
+    struct timespec t;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+// Print n rows into buf, and return the fastest of three flushes.
+static double flush_rows(char *buf, size_t size, size_t n)
+{
+    double best = 0;
+
+    for (int k = 0; k < 3; k++)
+    {
+        double t;
+
+        for (size_t i = 0; i < n; i++)
+        {
+            csnprintf(buf, size, "%zu | %-24s | %x | %6.2f\n", i, names[i % 5], (unsigned) i * 2654435761u,
+                      (double) i / 3);
+        }
+        t = now();
+        cflush();
+        t = now() - t;
+        best = (0 == k || t < best) ? t : best;
+    }
+    return best;
+}
+
+int main(int argc, char **argv)
+{
+    size_t n = (argc > 1) ? strtoul(argv[1], NULL, 10) : 100000;
+    size_t size = 80 * n + 1;
+    char *want = malloc(size), *got = malloc(size);
+    double templates, capped, cleared;
+    int failures = 0;
+
+    if (NULL == want || NULL == got)
+    {
+        return EXIT_FAILURE;
+    }
+    templates = flush_rows(want, size, n);
+
+    cprintf_set_width_cap(1, 8, CPRINTF_CAP_TRUNCATE);
+    cprintf_set_width_cap(-1, 30, CPRINTF_CAP_WRAP);
+    cprintf_set_width_percentile(3, 50);
+    capped = flush_rows(got, size, n);
+    if (strcmp(got, want) == 0)
+    {
+        fprintf(stderr, "cleared_caps: the caps changed nothing\n");
+        failures++;
+    }
+
+    cprintf_set_width_cap(1, 0, CPRINTF_CAP_TRUNCATE);
+    cprintf_set_width_cap(-1, 0, CPRINTF_CAP_WRAP);
+    cprintf_set_width_cap(3, 0, CPRINTF_CAP_PERCENTILE);
+    cleared = flush_rows(got, size, n);
+    if (strcmp(got, want) != 0)
+    {
+        fprintf(stderr, "cleared_caps: the table still differs once the caps are removed\n");
+        failures++;
+    }
+
+    // Closer to the template path than to the capped one, by ratio.
+    if (cleared * cleared > templates * capped)
+    {
+        fprintf(stderr, "cleared_caps: %.1f ns a row with the caps removed; %.1f without any, %.1f capped\n",
+                cleared / n * 1e9, templates / n * 1e9, capped / n * 1e9);
+        failures++;
+    }
+    free(got);
+    free(want);
+    return (failures) ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,97 @@
+// Copyright 2023 Lawrence Livermore National Security, LLC and other
+// libjustify Project Developers. See the top-level LICENSE file for details.
+//
+// SPDX-License-Identifier: MIT
+
+// Check that removing every footer leaves nothing of them behind. While a
+// footer is set, compact rows are unpacked to be reduced and every cell is
+// added up as it is captured; once the footers are gone, the same table has
+// to print as it did before any were set, and about as fast.
+//
+//     cleared_footers [rows]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <cprintf.h>
+
+static const char *names[] = { "alpha", "bravo", "charlie", "delta-with-a-long-name", "e" };
+
+static double now(void)
+{
+    struct timespec t;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+// Capture and print n rows into buf, and return the fastest of three.
+static double print_rows(char *buf, size_t size, size_t n)
+{
+    double best = 0;
+
+    for (int k = 0; k < 3; k++)
+    {
+        double t = now();
+
+        for (size_t i = 0; i < n; i++)
+        {
+            csnprintf(buf, size, "%zu | %-24s | %u | %6.2f\n", i, names[i % 5], (unsigned) i * 2654435761u,
+                      (double) i / 3);
+        }
+        cflush();
+        t = now() - t;
+        best = (0 == k || t < best) ? t : best;
+    }
+    return best;
+}
+
+int main(int argc, char **argv)
+{
+    size_t n = (argc > 1) ? strtoul(argv[1], NULL, 10) : 100000;
+    size_t size = 80 * n + 1;
+    char *want = malloc(size), *got = malloc(size);
+    double plain, footed, cleared;
+    int failures = 0;
+
+    if (NULL == want || NULL == got)
+    {
+        return EXIT_FAILURE;
+    }
+    cprintf_set_compact(1);
+    plain = print_rows(want, size, n);
+
+    cprintf_set_footer(0, CPRINTF_REDUCE_COUNT);
+    cprintf_set_footer(2, CPRINTF_REDUCE_SUM | CPRINTF_REDUCE_MAX);
+    cprintf_set_footer(3, CPRINTF_REDUCE_MEAN);
+    footed = print_rows(got, size, n);
+    if (strlen(got) <= strlen(want))
+    {
+        fprintf(stderr, "cleared_footers: the footers added nothing\n");
+        failures++;
+    }
+
+    // Not in the order they were set, so the last column goes last.
+    cprintf_set_footer(3, 0);
+    cprintf_set_footer(0, 0);
+    cprintf_set_footer(2, 0);
+    cleared = print_rows(got, size, n);
+    if (strcmp(got, want) != 0)
+    {
+        fprintf(stderr, "cleared_footers: the table still differs once the footers are removed\n");
+        failures++;
+    }
+
+    // Closer to never having had footers than to having them, by ratio.
+    if (cleared * cleared > plain * footed)
+    {
+        fprintf(stderr, "cleared_footers: %.1f ns a row with the footers removed; %.1f without any, %.1f with\n",
+                cleared / n * 1e9, plain / n * 1e9, footed / n * 1e9);
+        failures++;
+    }
+    cprintf_set_compact(0);
+    free(got);
+    free(want);
+    return (failures) ? EXIT_FAILURE : EXIT_SUCCESS;
+}
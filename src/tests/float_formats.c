@@ -0,0 +1,146 @@
+// Copyright 2023 Lawrence Livermore National Security, LLC and other
+// libjustify Project Developers. See the top-level LICENSE file for details.
+//
+// SPDX-License-Identifier: MIT
+
+// Differential check of the library's own double formatting against the C
+// library's. Each round captures a column of doubles with a random %f, %e,
+// %g or %a conversion and checks every line against snprintf() at the
+// width of the widest value, which is what cflush() has to print.
+//
+//     float_formats [rounds [seed]]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <cprintf.h>
+#include "xorshift.h"
+
+#define ROWS 16
+
+static double from_bits(uint64_t bits)
+{
+    double x;
+
+    memcpy(&x, &bits, sizeof(x));
+    return x;
+}
+
+// Values spread over every exponent, plus the ones rounding gets wrong:
+// short decimals, exact ties, neighbours of powers of ten, subnormals.
+static double value(void)
+{
+    uint64_t r = next();
+    double x;
+
+    switch (r % 8)
+    {
+        case 0:
+        case 1:
+            do
+            {
+                x = from_bits(next());
+            } while (isnan(x) || isinf(x));
+            return x;
+        case 2:
+            return (double)(int64_t)(next() % 2000001 - 1000000) / pow(10, next() % 12);
+        case 3:
+            // k + 1/2 at some binary scale: a tie at many precisions.
+            return ldexp((double)(2 * (next() % 100000) + 1), -(int)(next() % 20));
+        case 4:
+            x = pow(10, (int)(next() % 80) - 40);
+            return nextafter(x, (next() & 1) ? 0 : INFINITY) * ((next() & 1) ? 1 : -1);
+        case 5:
+            return from_bits(next() % (1ULL << 52)) * ((next() & 1) ? 1 : -1);
+        case 6:
+            return (next() & 1) ? 0.0 : -0.0;
+        default:
+            return 9.5 * pow(10, (int)(next() % 40) - 20) - ((next() & 1) ? 0 : 1e-10);
+    }
+}
+
+static void conversion(char *fmt, char *expected_spec)
+{
+    static const char convs[] = "feEgGaAF";
+    static const char *flags[] = { "", "", "-", "+", " ", "#", "0", "-+", "0#", "+0", "- #" };
+    const char *fl = flags[next() % (sizeof(flags) / sizeof(flags[0]))];
+    char prec[8] = "", width[8] = "";
+    char c = convs[next() % (sizeof(convs) - 1)];
+
+    switch (next() % 4)
+    {
+        case 0:
+            break;
+        case 1:
+        case 2:
+            snprintf(prec, sizeof(prec), ".%d", (int)(next() % 18));
+            break;
+        default:
+            snprintf(prec, sizeof(prec), ".%d", (int)(next() % 70));
+            break;
+    }
+    if (0 == next() % 4)
+    {
+        snprintf(width, sizeof(width), "%d", 1 + (int)(next() % 30));
+    }
+    sprintf(fmt, "%%%s%s%s%c\n", fl, width, prec, c);
+    sprintf(expected_spec, "%%%s*%s%c\n", fl, prec, c);
+}
+
+int main(int argc, char **argv)
+{
+    long rounds = (argc > 1) ? atol(argv[1]) : 20000;
+    static char got[1 << 16], want[1 << 16];
+    char fmt[32], spec[32];
+    double xs[ROWS];
+    int failures = 0;
+
+    if (argc > 2)
+    {
+        state = strtoull(argv[2], NULL, 10) | 1;
+    }
+    for (long r = 0; r < rounds && failures < 10; r++)
+    {
+        int width = 0;
+        size_t len = 0;
+
+        conversion(fmt, spec);
+        for (int i = 0; i < ROWS; i++)
+        {
+            int w;
+
+            xs[i] = value();
+            csnprintf(got, sizeof(got), fmt, xs[i]);
+            w = snprintf(NULL, 0, fmt, xs[i]) - 1;
+            width = (w > width) ? w : width;
+        }
+        cflush();
+        for (int i = 0; i < ROWS; i++)
+        {
+            len += snprintf(want + len, sizeof(want) - len, spec, width, xs[i]);
+        }
+        if (strcmp(got, want) != 0)
+        {
+            char *g = got, *w = want;
+
+            for (int i = 0; i < ROWS; i++)
+            {
+                char *ge = strchr(g, '\n'), *we = strchr(w, '\n');
+                if (NULL == ge || NULL == we || ge - g != we - w || memcmp(g, w, ge - g) != 0)
+                {
+                    fprintf(stderr, "float_formats: %.*s of %a: got \"%.*s\", want \"%.*s\"\n",
+                            (int) strlen(fmt) - 1, fmt, xs[i],
+                            (NULL == ge) ? (int) strlen(g) : (int)(ge - g), g,
+                            (NULL == we) ? (int) strlen(w) : (int)(we - w), w);
+                    failures++;
+                    break;
+                }
+                g = ge + 1;
+                w = we + 1;
+            }
+        }
+    }
+    return (failures) ? EXIT_FAILURE : EXIT_SUCCESS;
+}
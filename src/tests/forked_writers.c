@@ -0,0 +1,203 @@
+// Copyright 2023 Lawrence Livermore National Security, LLC and other
+// libjustify Project Developers. See the top-level LICENSE file for details.
+//
+// SPDX-License-Identifier: MIT
+
+// Forked processes each capture part of a table and write it into one file
+// with cprintf_get_widths(), cprintf_set_widths(), cprintf_offset() and
+// cprintf_set_pwrite(), the parent standing in for MPI's reductions. The
+// file has to match the table a single process prints from every row.
+//
+//     forked_writers [path]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <cprintf.h>
+
+#define NRANKS  4
+#define NCOLS   16
+
+static const char *names[] = { "a", "bb", "ccccccc", "dddd", "eeeeeeeeeeee" };
+
+// Rows of rank r. Ranks hold different numbers of rows of different widths,
+// and with mixed set the last one also holds rows of a second format, so
+// cprintf_row_bytes() can't be used.
+static size_t rows_of(int r)
+{
+    return 3 + 2 * r;
+}
+
+static void capture(int r, int mixed, char *buf, size_t size)
+{
+    for (size_t i = 0; i < rows_of(r); i++)
+    {
+        int v = (r * 7919 + (int) i * 104729) % (1 << (4 * r + 2));
+        const char *name = names[(r + i) % 5];
+
+        if (NULL != buf)
+        {
+            csnprintf(buf, size, "%s | %d | %.3f\n", name, v, v / 7.0);
+        }
+        else
+        {
+            cprintf("%s | %d | %.3f\n", name, v, v / 7.0);
+        }
+        if (mixed && NRANKS - 1 == r && 0 == i % 2)
+        {
+            if (NULL != buf)
+            {
+                csnprintf(buf, size, "%s total %ld\n", name, (long) v * 1000);
+            }
+            else
+            {
+                cprintf("%s total %ld\n", name, (long) v * 1000);
+            }
+        }
+    }
+}
+
+static void xread(int fd, void *p, size_t n)
+{
+    if (read(fd, p, n) != (ssize_t) n)
+    {
+        perror("read");
+        exit(EXIT_FAILURE);
+    }
+}
+
+static void xwrite(int fd, const void *p, size_t n)
+{
+    if (write(fd, p, n) != (ssize_t) n)
+    {
+        perror("write");
+        exit(EXIT_FAILURE);
+    }
+}
+
+// Rank r's side: send its widths and size, get back the reduced widths and
+// its offset, and write its rows there.
+static void writer(int r, int mixed, int fd, int up, int down)
+{
+    size_t widths[NCOLS], sizes[2];
+    off_t offset;
+
+    capture(r, mixed, NULL, 0);
+    cprintf_get_widths(widths, NCOLS);
+    xwrite(up, widths, sizeof(widths));
+    xread(down, widths, sizeof(widths));
+    cprintf_set_widths(widths, NCOLS);
+
+    // Row counts if every row has the same length, else byte counts.
+    sizes[0] = cprintf_row_bytes();
+    sizes[1] = (0 == sizes[0]) ? cprintf_rendered_size() : rows_of(r);
+    xwrite(up, sizes, sizeof(sizes));
+    xread(down, &offset, sizeof(offset));
+
+    cprintf_set_pwrite(fd, offset);
+    cflush();
+    _exit(EXIT_SUCCESS);
+}
+
+static int run(const char *path, int mixed)
+{
+    int up[NRANKS][2], down[NRANKS][2], fd, status, failed = 0;
+    size_t widths[NRANKS][NCOLS], reduced[NCOLS] = { 0 }, sizes[NRANKS][2], counts[NRANKS];
+    size_t row_bytes = 0;
+    static char expected[1 << 16], got[1 << 16];
+    ssize_t len;
+
+    fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0)
+    {
+        perror(path);
+        return 1;
+    }
+    fflush(stdout);
+    for (int r = 0; r < NRANKS; r++)
+    {
+        if (pipe(up[r]) != 0 || pipe(down[r]) != 0)
+        {
+            perror("pipe");
+            return 1;
+        }
+        if (0 == fork())
+        {
+            writer(r, mixed, fd, up[r][1], down[r][0]);
+        }
+    }
+
+    // MPI_Allreduce(MPI_MAX) of the widths.
+    for (int r = 0; r < NRANKS; r++)
+    {
+        xread(up[r][0], widths[r], sizeof(widths[r]));
+        for (int j = 0; j < NCOLS; j++)
+        {
+            reduced[j] = (widths[r][j] > reduced[j]) ? widths[r][j] : reduced[j];
+        }
+    }
+    for (int r = 0; r < NRANKS; r++)
+    {
+        xwrite(down[r][1], reduced, sizeof(reduced));
+    }
+
+    // MPI_Allgather of the row counts, or of the sizes for a prefix sum.
+    for (int r = 0; r < NRANKS; r++)
+    {
+        xread(up[r][0], sizes[r], sizeof(sizes[r]));
+        row_bytes = (0 == r || sizes[r][0] == row_bytes) ? sizes[r][0] : 0;
+    }
+    for (int r = 0; r < NRANKS; r++)
+    {
+        counts[r] = (0 != row_bytes) ? sizes[r][1] : 0;
+    }
+    for (int r = 0; r < NRANKS; r++)
+    {
+        off_t offset = 0;
+
+        if (0 != row_bytes)
+        {
+            offset = cprintf_offset(counts, r, row_bytes);
+        }
+        else
+        {
+            for (int q = 0; q < r; q++)
+            {
+                offset += (0 != sizes[q][0]) ? sizes[q][0] * sizes[q][1] : sizes[q][1];
+            }
+        }
+        xwrite(down[r][1], &offset, sizeof(offset));
+    }
+    for (int r = 0; r < NRANKS; r++)
+    {
+        wait(&status);
+        failed |= !WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS;
+    }
+
+    for (int r = 0; r < NRANKS; r++)
+    {
+        capture(r, mixed, expected, sizeof(expected));
+    }
+    cflush();
+    len = pread(fd, got, sizeof(got), 0);
+    close(fd);
+    if (failed || len != (ssize_t) strlen(expected) || memcmp(got, expected, len) != 0)
+    {
+        fprintf(stderr, "forked_writers: %s table differs\n", mixed ? "mixed" : "uniform");
+        fprintf(stderr, "expected:\n%s\ngot:\n%.*s\n", expected, (int)(len < 0 ? 0 : len), got);
+        return 1;
+    }
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    const char *path = (argc > 1) ? argv[1] : "forked_writers.out";
+    int rc = run(path, 0) | run(path, 1);
+
+    unlink(path);
+    return rc ? EXIT_FAILURE : EXIT_SUCCESS;
+}
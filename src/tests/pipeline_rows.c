@@ -0,0 +1,170 @@
+// Copyright 2023 Lawrence Livermore National Security, LLC and other
+// libjustify Project Developers. See the top-level LICENSE file for details.
+//
+// SPDX-License-Identifier: MIT
+
+// Differential check of cprintf_set_pipeline(): each table is captured
+// with cfprintf() once as before and once through the formatter thread,
+// and the two have to print the same byte for byte. The rows outnumber
+// what the ring holds many times over and vary in size, so records wrap
+// and pad records fill the ring's end; their %s and %ls strings sit in
+// buffers that are overwritten as soon as cfprintf() returns. The last
+// table has a row too big for the ring.
+//
+//     pipeline_rows [rows]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <wchar.h>
+#include <locale.h>
+#include <cprintf.h>
+#include "xorshift.h"
+
+static const char *words[] = { "", "a", "alpha", "longer than most of the others", "Zürich", "日本語" };
+
+// Fill buf with a string of up to size - 1 bytes that is different each
+// time, so a row that kept the caller's pointer would show it.
+static void fill(char *buf, size_t size)
+{
+    size_t len = next() % size;
+
+    for (size_t i = 0; i < len; i++)
+    {
+        buf[i] = 'a' + next() % 26;
+    }
+    buf[len] = '\0';
+}
+
+static void fill_wide(wchar_t *buf, size_t size)
+{
+    size_t len = next() % size;
+
+    for (size_t i = 0; i < len; i++)
+    {
+        buf[i] = (0 == i % 7) ? L'é' : L'A' + next() % 26;
+    }
+    buf[len] = L'\0';
+}
+
+// Capture n rows of table k into stream, drawing the values from seed.
+static void capture(FILE *stream, int k, size_t n, uint64_t seed)
+{
+    char name[64], *big;
+    wchar_t wide[32];
+
+    state = seed;
+    for (size_t i = 0; i < n; i++)
+    {
+        int x = (int) next();
+        double d = (double)(int64_t) next() / (1 << 20);
+
+        switch (k)
+        {
+            case 0:
+                fill(name, sizeof(name));
+                cfprintf(stream, "%d | %-s | %8.3f\n", x, name, d);
+                break;
+            case 1:
+                fill_wide(wide, sizeof(wide) / sizeof(wide[0]));
+                cfprintf(stream, "%ls | %lu | %s\n", wide, (unsigned long) next(), words[i % 6]);
+                break;
+            case 2:
+                // Mixed formats, with and without strings to copy.
+                fill(name, sizeof(name));
+                fill_wide(wide, sizeof(wide) / sizeof(wide[0]));
+                switch (i % 3)
+                {
+                    case 0:
+                        cfprintf(stream, "%s %ls %d\n", name, wide, x);
+                        break;
+                    case 1:
+                        cfprintf(stream, "%+.2e %c %x\n", d, 'a' + (int)(i % 26), (unsigned) x);
+                        break;
+                    default:
+                        cfprintf(stream, "%5d -- %-12s %lld\n", x % 1000, name, (long long) next());
+                        break;
+                }
+                break;
+            default:
+                // A row of half the ring or more is captured without it.
+                big = malloc((1 << 19) + 1);
+                if (NULL == big)
+                {
+                    exit(EXIT_FAILURE);
+                }
+                memset(big, 'z', 1 << 19);
+                big[1 << 19] = '\0';
+                fill(name, sizeof(name));
+                cfprintf(stream, "%d %s\n", x, (1 == i) ? big : name);
+                memset(big, '#', 1 << 19);
+                free(big);
+                break;
+        }
+        memset(name, '#', sizeof(name) - 1);
+        wmemset(wide, L'#', sizeof(wide) / sizeof(wide[0]) - 1);
+    }
+}
+
+// Print table k, with or without the pipeline, and return what it printed.
+static char *print_table(int pipeline, int k, size_t n, uint64_t seed, size_t *len)
+{
+    FILE *stream = tmpfile();
+    char *out;
+
+    if (NULL == stream)
+    {
+        perror("pipeline_rows");
+        exit(EXIT_FAILURE);
+    }
+    cprintf_set_pipeline(pipeline);
+    capture(stream, k, n, seed);
+    cflush();
+    cprintf_set_pipeline(0);
+
+    fflush(stream);
+    *len = (size_t) ftell(stream);
+    out = malloc(*len + 1);
+    rewind(stream);
+    if (NULL == out || fread(out, 1, *len, stream) != *len)
+    {
+        exit(EXIT_FAILURE);
+    }
+    out[*len] = '\0';
+    fclose(stream);
+    return out;
+}
+
+int main(int argc, char **argv)
+{
+    static const char *tables[] = { "%s", "%ls", "mixed formats", "a row too big for the ring" };
+    static const size_t rows[] = { 0, 0, 0, 3 };
+    size_t n = (argc > 1) ? strtoul(argv[1], NULL, 10) : 50000;
+    int failures = 0;
+
+    setlocale(LC_ALL, "C.UTF-8");
+    for (int k = 0; k < (int)(sizeof(tables) / sizeof(tables[0])); k++)
+    {
+        uint64_t seed = next() | 1;
+        size_t want_len, got_len, m = (rows[k] > 0) ? rows[k] : n;
+        char *want = print_table(0, k, m, seed, &want_len);
+        char *got = print_table(1, k, m, seed, &got_len);
+
+        if (got_len != want_len || memcmp(got, want, want_len) != 0)
+        {
+            size_t i = 0, line = 1;
+
+            while (i < got_len && i < want_len && got[i] == want[i])
+            {
+                line += ('\n' == got[i++]);
+            }
+            fprintf(stderr, "pipeline_rows: %s, %zu rows: line %zu differs with the pipeline\n",
+                    tables[k], m, line);
+            failures++;
+        }
+        free(got);
+        free(want);
+    }
+    return (failures) ? EXIT_FAILURE : EXIT_SUCCESS;
+}
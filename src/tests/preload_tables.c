@@ -0,0 +1,255 @@
+// Copyright 2023 Lawrence Livermore National Security, LLC and other
+// libjustify Project Developers. See the top-level LICENSE file for details.
+//
+// SPDX-License-Identifier: MIT
+
+// Check libjustify-preload.so on a program that only calls printf(): it
+// runs itself under LD_PRELOAD with its output in a pipe, and compares
+// what comes back with the tables the library prints for the same rows.
+// Rows with the same format make up one table, a puts() or fputs() in
+// between prints the table first, JUSTIFY_ROWS splits tables, and
+// formats the library can't capture are printed by the C library as they
+// are.
+//
+//     preload_tables /path/to/libjustify-preload.so
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <cprintf.h>
+
+#define NCASES 4
+
+static const char *cases[] = { "one table a format", "puts() and fputs() in between",
+                               "JUSTIFY_ROWS=4", "formats passed through" };
+static const char *names[] = { "a", "bravo", "", "charlie-delta", "echo" };
+
+// Row i of the table in format k, printed by printf() under the preload or
+// captured by the library for stream.
+static void row(FILE *stream, int k, size_t i)
+{
+    int v = (int)((i * 7919) % 100000) - 5000;
+
+    if (0 == k)
+    {
+        if (NULL == stream)
+        {
+            printf("%d | %s | %.2f\n", v, names[i % 5], v / 7.0);
+        }
+        else
+        {
+            cfprintf(stream, "%d | %s | %.2f\n", v, names[i % 5], v / 7.0);
+        }
+    }
+    else
+    {
+        if (NULL == stream)
+        {
+            printf("%-8s %x\n", names[(i + 2) % 5], (unsigned) v);
+        }
+        else
+        {
+            cfprintf(stream, "%-8s %x\n", names[(i + 2) % 5], (unsigned) v);
+        }
+    }
+}
+
+// Append to out the table the library prints for rows from to to - 1.
+static void table(FILE *out, int k, size_t from, size_t to)
+{
+    FILE *stream = tmpfile();
+    char buf[4096];
+    size_t n;
+
+    if (NULL == stream)
+    {
+        perror("preload_tables");
+        exit(EXIT_FAILURE);
+    }
+    for (size_t i = from; i < to; i++)
+    {
+        row(stream, k, i);
+    }
+    cflush();
+    rewind(stream);
+    while ((n = fread(buf, 1, sizeof(buf), stream)) > 0)
+    {
+        fwrite(buf, 1, n, out);
+    }
+    fclose(stream);
+}
+
+// What case c writes, run under the preload.
+static void child(int c)
+{
+    int n = 0;
+
+    switch (c)
+    {
+        case 0:
+            for (size_t i = 0; i < 20; i++)
+            {
+                row(NULL, 0, i);
+            }
+            for (size_t i = 0; i < 5; i++)
+            {
+                row(NULL, 1, i);
+            }
+            break;
+        case 1:
+            for (size_t i = 0; i < 13; i++)
+            {
+                row(NULL, 0, i);
+                if (4 == i)
+                {
+                    puts("-- between --");
+                }
+                if (9 == i)
+                {
+                    fputs("-- and again --\n", stdout);
+                }
+            }
+            break;
+        case 2:
+            for (size_t i = 0; i < 10; i++)
+            {
+                row(NULL, 0, i);
+            }
+            break;
+        default:
+            printf("%d%%\n", 42);
+            printf("abc%n %d\n", &n, 5);
+            printf("%*d|\n", 6, 42);
+            printf("two %d\nlines %s\n", 7, "here");
+            printf("%d%% (n was %d)\n", 1, n);
+            break;
+    }
+}
+
+// What case c should write.
+static void expect(FILE *out, int c)
+{
+    char buf[256];
+
+    switch (c)
+    {
+        case 0:
+            table(out, 0, 0, 20);
+            table(out, 1, 0, 5);
+            break;
+        case 1:
+            table(out, 0, 0, 5);
+            fputs("-- between --\n", out);
+            table(out, 0, 5, 10);
+            fputs("-- and again --\n", out);
+            table(out, 0, 10, 13);
+            break;
+        case 2:
+            table(out, 0, 0, 4);
+            table(out, 0, 4, 8);
+            table(out, 0, 8, 10);
+            break;
+        default:
+            snprintf(buf, sizeof(buf), "%d%%\n", 42);
+            fputs(buf, out);
+            snprintf(buf, sizeof(buf), "abc %d\n", 5);
+            fputs(buf, out);
+            snprintf(buf, sizeof(buf), "%*d|\n", 6, 42);
+            fputs(buf, out);
+            snprintf(buf, sizeof(buf), "two %d\nlines %s\n", 7, "here");
+            fputs(buf, out);
+            snprintf(buf, sizeof(buf), "%d%% (n was %d)\n", 1, 3);
+            fputs(buf, out);
+            break;
+    }
+}
+
+// Run case c under the preload and return what it wrote to stdout.
+static char *run(const char *self, const char *preload, int c, size_t *len)
+{
+    int fd[2], status;
+    char arg[16], *out = NULL;
+    size_t size = 0;
+    FILE *in;
+    pid_t pid;
+
+    if (0 != pipe(fd))
+    {
+        perror("preload_tables");
+        exit(EXIT_FAILURE);
+    }
+    pid = fork();
+    if (0 == pid)
+    {
+        snprintf(arg, sizeof(arg), "%d", c);
+        dup2(fd[1], STDOUT_FILENO);
+        close(fd[0]);
+        close(fd[1]);
+        setenv("LD_PRELOAD", preload, 1);
+        setenv("JUSTIFY_SECONDS", "3600", 1);    // Only rows and exit split tables.
+        setenv("JUSTIFY_ROWS", (2 == c) ? "4" : "10000", 1);
+        execl(self, self, "--child", arg, (char *) NULL);
+        _exit(127);
+    }
+    close(fd[1]);
+    in = fdopen(fd[0], "r");
+    for (size_t n = 1; n > 0;)
+    {
+        out = realloc(out, size + 4096 + 1);
+        if (NULL == out)
+        {
+            exit(EXIT_FAILURE);
+        }
+        n = fread(out + size, 1, 4096, in);
+        size += n;
+    }
+    out[size] = '\0';
+    fclose(in);
+    if (pid < 0 || waitpid(pid, &status, 0) != pid || !WIFEXITED(status) || 0 != WEXITSTATUS(status))
+    {
+        fprintf(stderr, "preload_tables: %s: the program failed\n", cases[c]);
+        size = 0;
+    }
+    *len = size;
+    return out;
+}
+
+int main(int argc, char **argv)
+{
+    int failures = 0;
+
+    if (3 == argc && 0 == strcmp(argv[1], "--child"))
+    {
+        child(atoi(argv[2]));
+        return EXIT_SUCCESS;
+    }
+    if (2 != argc)
+    {
+        fprintf(stderr, "usage: %s /path/to/libjustify-preload.so\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    for (int c = 0; c < NCASES; c++)
+    {
+        char *want = NULL, *got;
+        size_t want_len = 0, got_len;
+        FILE *out = open_memstream(&want, &want_len);
+
+        if (NULL == out)
+        {
+            return EXIT_FAILURE;
+        }
+        expect(out, c);
+        fclose(out);
+        got = run(argv[0], argv[1], c, &got_len);
+        if (got_len != want_len || memcmp(got, want, want_len) != 0)
+        {
+            fprintf(stderr, "preload_tables: %s:\n--- got\n%s--- want\n%s", cases[c], got, want);
+            failures++;
+        }
+        free(got);
+        free(want);
+    }
+    return (failures) ? EXIT_FAILURE : EXIT_SUCCESS;
+}
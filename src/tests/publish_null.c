@@ -0,0 +1,88 @@
+// Copyright 2023 Lawrence Livermore National Security, LLC and other
+// libjustify Project Developers. See the top-level LICENSE file for details.
+//
+// SPDX-License-Identifier: MIT
+
+// A table holding NULL %s and %ls arguments has to survive cprintf_publish()
+// and print from justify-view as it would have locally.
+//
+//     publish_null path/to/justify-view
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <wchar.h>
+#include <cprintf.h>
+
+static void rows(FILE *stream)
+{
+    cfprintf(stream, "%s %d | %ls\n", "alpha", 1, L"one");
+    cfprintf(stream, "%s %d | %ls\n", (char *) NULL, 22, L"twenty-two");
+    cfprintf(stream, "%s %d | %ls\n", "", 333, (wchar_t *) NULL);
+    cfprintf(stream, "%s %d | %ls\n", (char *) NULL, 4444, (wchar_t *) NULL);
+}
+
+static char *contents(FILE *stream)
+{
+    static char buf[2][4096];
+    static int which;
+    char *p = buf[which++ % 2];
+    size_t n;
+
+    rewind(stream);
+    n = fread(p, 1, sizeof(buf[0]) - 1, stream);
+    p[n] = '\0';
+    return p;
+}
+
+int main(int argc, char **argv)
+{
+    char name[64];
+    FILE *direct = tmpfile(), *viewed = tmpfile();
+    const char *expected, *got;
+    int status;
+
+    if (argc != 2 || NULL == direct || NULL == viewed)
+    {
+        perror("tmpfile");
+        return EXIT_FAILURE;
+    }
+    rows(direct);
+    cflush();
+
+    snprintf(name, sizeof(name), "/libjustify-publish-null-%d", (int) getpid());
+    if (cprintf_publish(name) != 0)
+    {
+        fprintf(stderr, "publish_null: can't publish, skipping\n");
+        return 77;
+    }
+    rows(direct);
+    cflush();
+
+    // The viewer has to be another process: here cflush() would publish.
+    fflush(stdout);
+    if (0 == fork())
+    {
+        dup2(fileno(viewed), STDOUT_FILENO);
+        execl(argv[1], argv[1], name, (char *) NULL);
+        _exit(EXIT_FAILURE);
+    }
+    wait(&status);
+    cprintf_publish(NULL);
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS)
+    {
+        fprintf(stderr, "publish_null: %s %s failed\n", argv[1], name);
+        return EXIT_FAILURE;
+    }
+
+    expected = contents(direct);
+    got = contents(viewed);
+    if (strcmp(expected, got) != 0 || NULL == strstr(expected, "(null)"))
+    {
+        fprintf(stderr, "publish_null: expected:\n%s\ngot:\n%s\n", expected, got);
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
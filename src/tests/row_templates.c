@@ -0,0 +1,144 @@
+// Copyright 2023 Lawrence Livermore National Security, LLC and other
+// libjustify Project Developers. See the top-level LICENSE file for details.
+//
+// SPDX-License-Identifier: MIT
+
+// Differential check of the row templates cflush() prints from against
+// render_row(), which it falls back to. A width cap wider than any cell
+// turns templates off without changing what should be printed, so each
+// table is flushed once without the cap and once with it, with and
+// without compact rows, and all four have to be the same byte for byte.
+//
+//     row_templates [rows]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <wchar.h>
+#include <locale.h>
+#include <cprintf.h>
+#include "xorshift.h"
+
+// Integers that land on every edge the templates handle: zero (which %.0d
+// prints as nothing), signs, and the most negative values.
+static long long integer(void)
+{
+    static const long long edges[] = { 0, 1, -1, 7, -8, INT_MAX, INT_MIN, 255, -4096 };
+
+    switch (next() % 4)
+    {
+        case 0:
+            return edges[next() % (sizeof(edges) / sizeof(edges[0]))];
+        case 1:
+            return (long long)(next() % 100000) - 50000;
+        default:
+            return (int) next();
+    }
+}
+
+static const char *text(void)
+{
+    static const char *words[] = { "", "a", "alpha", "longer than most", "Zürich", "日本語", NULL };
+
+    return words[next() % (sizeof(words) / sizeof(words[0]))];
+}
+
+// Capture table k, drawing its values afresh from seed.
+static void capture(char *buf, size_t size, int k, size_t n, uint64_t seed)
+{
+    state = seed;
+    for (size_t i = 0; i < n; i++)
+    {
+        int x = (int) integer(), y = (int) integer();
+        unsigned u = (unsigned) integer();
+
+        switch (k)
+        {
+            case 0:
+                csnprintf(buf, size, "%+d|% d|%05d|%-d|%.0d\n", x, y, x, y, (0 == i % 3) ? 0 : x);
+                break;
+            case 1:
+                csnprintf(buf, size, "%#x %#o %#X %x %o\n", u, u, u, 0 == i % 5 ? 0u : u, u);
+                break;
+            case 2:
+                csnprintf(buf, size, "%d %lld %ld %+lld\n", (0 == i % 4) ? INT_MIN : x,
+                          (0 == i % 3) ? LLONG_MIN : (long long) x * 1000003, (long) y,
+                          (0 == i % 7) ? LLONG_MIN : (long long) y);
+                break;
+            case 3:
+                csnprintf(buf, size, "%-12s|%s|%6s|%d\n", text(), text(), text(), x);
+                break;
+            default:
+                // Mixed formats, so that rows of several templates alternate.
+                if (i % 3)
+                {
+                    csnprintf(buf, size, "%5d %s %-+6d\n", x, text(), y);
+                }
+                else
+                {
+                    csnprintf(buf, size, "%#o -- %08x %s\n", u, u, text());
+                }
+                break;
+        }
+    }
+}
+
+int main(int argc, char **argv)
+{
+    static const char *tables[] = { "signs and flags", "#x and #o", "most negative", "strings",
+                                    "mixed formats" };
+    size_t n = (argc > 1) ? strtoul(argv[1], NULL, 10) : 3000;
+    size_t size = 128 * n + 1;
+    char *want = malloc(size), *got = malloc(size);
+    int failures = 0;
+
+    if (NULL == want || NULL == got)
+    {
+        return EXIT_FAILURE;
+    }
+    setlocale(LC_ALL, "C.UTF-8");
+    state = 0x9e3779b97f4a7c15ULL;
+    for (int k = 0; k < (int)(sizeof(tables) / sizeof(tables[0])); k++)
+    {
+        uint64_t seed = next() | 1;
+
+        capture(want, size, k, n, seed);
+        cflush();
+        for (int pass = 1; pass < 4; pass++)
+        {
+            int compact = pass & 1, fallback = pass >> 1;
+
+            cprintf_set_compact(compact);
+            cprintf_set_width_cap(-1, (fallback) ? 1000 : 0, CPRINTF_CAP_TRUNCATE);
+            capture(got, size, k, n, seed);
+            cflush();
+            if (strcmp(got, want) != 0)
+            {
+                char *g = got, *w = want;
+
+                while (*g == *w)
+                {
+                    g++;
+                    w++;
+                }
+                while (g > got && '\n' != g[-1])
+                {
+                    g--;
+                    w--;
+                }
+                fprintf(stderr, "row_templates: %s, %s%s, differs:\n  got  %.*s\n  want %.*s\n",
+                        tables[k], (fallback) ? "render_row()" : "templates",
+                        (compact) ? ", compact" : "", (int) strcspn(g, "\n"), g,
+                        (int) strcspn(w, "\n"), w);
+                failures++;
+            }
+        }
+        cprintf_set_width_cap(-1, 0, CPRINTF_CAP_TRUNCATE);
+        cprintf_set_compact(0);
+    }
+    free(got);
+    free(want);
+    return (failures) ? EXIT_FAILURE : EXIT_SUCCESS;
+}
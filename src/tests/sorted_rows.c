@@ -0,0 +1,170 @@
+// Copyright 2023 Lawrence Livermore National Security, LLC and other
+// libjustify Project Developers. See the top-level LICENSE file for details.
+//
+// SPDX-License-Identifier: MIT
+
+// Check cprintf_sort() against rows captured already in order. Every
+// column is sorted both ways, with the order set before the rows are
+// captured, after them, after a cell has been set, halfway through, and
+// with compact rows, which cflush() unpacks first. Long doubles that are
+// the same as doubles, strings that share their first bytes and 64-bit
+// integers that fill a whole key are there to catch orders that only look
+// at part of a value.
+//
+//     sorted_rows [rows]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <cprintf.h>
+#include "xorshift.h"
+
+#define COLUMNS 5
+
+struct row
+{
+    int i;
+    unsigned long long u;
+    double d;
+    long double ld;
+    const char *s;
+    int short_row;    // Only has columns 0 and 1.
+};
+
+static struct row *rows;
+static int column, ascending;
+
+static int compare(const void *p, const void *q)
+{
+    const size_t x = *(const size_t *) p, y = *(const size_t *) q;
+    const struct row *a = &rows[x], *b = &rows[y];
+    int r = 0;
+
+    // Rows without the column go last.
+    if (column > 1 && a->short_row != b->short_row)
+    {
+        return a->short_row - b->short_row;
+    }
+    if (column > 1 && a->short_row)
+    {
+        return (x > y) - (x < y);
+    }
+    switch (column)
+    {
+        case 0:
+            r = (a->i > b->i) - (a->i < b->i);
+            break;
+        case 1:
+            r = (a->u > b->u) - (a->u < b->u);
+            break;
+        case 2:
+            r = (a->d > b->d) - (a->d < b->d);
+            break;
+        case 3:
+            r = (a->ld > b->ld) - (a->ld < b->ld);
+            break;
+        default:
+            r = strcmp(a->s, b->s);
+            break;
+    }
+    if (0 != r)
+    {
+        return (ascending) ? r : -r;
+    }
+    return (x > y) - (x < y);
+}
+
+static void capture(char *buf, size_t size, const size_t *order, size_t n)
+{
+    for (size_t k = 0; k < n; k++)
+    {
+        const struct row *r = &rows[order[k]];
+
+        if (r->short_row)
+        {
+            csnprintf(buf, size, "%d %llu -\n", r->i, r->u);
+        }
+        else
+        {
+            csnprintf(buf, size, "%d %llu %g %.21Lg %s\n", r->i, r->u, r->d, r->ld, r->s);
+        }
+    }
+}
+
+int main(int argc, char **argv)
+{
+    static const char *names[] = { "rank-000000-a", "rank-000000-b", "rank-000000-", "rank-00", "", "zz" };
+    size_t n = (argc > 1) ? strtoul(argv[1], NULL, 10) : 5000;
+    size_t size = 128 * n + 1;
+    size_t *capture_order = malloc(n * sizeof(size_t));
+    size_t *sorted = malloc(n * sizeof(size_t));
+    char *got = malloc(size), *want = malloc(size);
+    int failures = 0;
+
+    rows = malloc(n * sizeof(struct row));
+    if (NULL == rows || NULL == capture_order || NULL == sorted || NULL == got || NULL == want)
+    {
+        return EXIT_FAILURE;
+    }
+    for (size_t k = 0; k < n; k++)
+    {
+        rows[k].i = (int)(next() % 2001) - 1000;
+        rows[k].u = next();
+        rows[k].d = (double)(int64_t)(next() % 2000001 - 1000000) / 64;
+        rows[k].ld = 1.0L + (long double)(next() % 8) / (1ULL << 62);    // All 1.0 as doubles.
+        rows[k].s = names[next() % (sizeof(names) / sizeof(names[0]))];
+        rows[k].short_row = (0 == next() % 50);
+        capture_order[k] = k;
+    }
+
+    for (column = 0; column < COLUMNS; column++)
+    {
+        for (ascending = 1; ascending >= 0; ascending--)
+        {
+            memcpy(sorted, capture_order, n * sizeof(size_t));
+            qsort(sorted, n, sizeof(size_t), compare);
+            cprintf_sort(-1, 1);
+            capture(want, size, sorted, n);
+            cflush();
+
+            for (int mode = 0; mode < 5; mode++)
+            {
+                const char *how[] = { "before capture", "after capture", "compact", "indexed",
+                                      "changed halfway" };
+
+                cprintf_set_compact(2 == mode);
+                cprintf_sort((0 == mode) ? column : (4 == mode) ? (column + 1) % COLUMNS : -1, ascending);
+                capture(got, size, capture_order, n / 2);
+                if (4 == mode)
+                {
+                    cprintf_sort(column, ascending);
+                }
+                capture(got, size, capture_order + n / 2, n - n / 2);
+                if (3 == mode)
+                {
+                    // Rows are found through the index cprintf_set_cell() builds.
+                    cprintf_set_cell(0, 0, rows[capture_order[0]].i);
+                }
+                if (0 != mode)
+                {
+                    cprintf_sort(column, ascending);
+                }
+                cflush();
+                cprintf_set_compact(0);
+                if (strcmp(got, want) != 0)
+                {
+                    fprintf(stderr, "sorted_rows: column %d %s, sorted %s, is out of order\n",
+                            column, (ascending) ? "ascending" : "descending", how[mode]);
+                    failures++;
+                }
+            }
+        }
+    }
+    free(want);
+    free(got);
+    free(sorted);
+    free(capture_order);
+    free(rows);
+    return (failures) ? EXIT_FAILURE : EXIT_SUCCESS;
+}
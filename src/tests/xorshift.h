@@ -0,0 +1,24 @@
+// Copyright 2023 Lawrence Livermore National Security, LLC and other
+// libjustify Project Developers. See the top-level LICENSE file for details.
+//
+// SPDX-License-Identifier: MIT
+
+// Marsaglia's xorshift64, shared by the checks so that each draws the same
+// values everywhere. A check that wants a sequence of its own sets state.
+
+#ifndef __XORSHIFT_H_HEADER
+#define __XORSHIFT_H_HEADER
+
+#include <stdint.h>
+
+static uint64_t state = 88172645463325252ULL;
+
+static uint64_t next(void)
+{
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    return state;
+}
+
+#endif